@@ -0,0 +1,336 @@
+#include <sys/types.h>
+
+#include <errno.h>
+#include <err.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gif_lib.h>
+
+#include "mono_gif.h"
+#include "monoanim_format.h"
+#include "wscons_anim.h"
+
+static const char *progname;
+static int opt_compress;
+static int opt_duration;
+static int opt_index;
+static int opt_progress;
+static int opt_tiles;
+static uint32_t tv_sec_start;
+
+static void
+init_gettime_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        err(EXIT_FAILURE, "clock_gettime");
+    tv_sec_start = (uint32_t)ts.tv_sec;
+}
+
+static uint32_t
+gettime_ms(void)
+{
+    struct timespec ts;
+    uint32_t tv_sec;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return 0;
+    tv_sec = (uint32_t)ts.tv_sec - tv_sec_start;
+    return tv_sec * 1000U + (uint32_t)(ts.tv_nsec / 1000000L);
+}
+
+#ifdef THREADED_RENDER
+#define THREAD_USAGE " [-j threads [-i]]"
+#define THREAD_HELP \
+      "  -i  Keep the frame index for -j in gif-file.idx and reuse it.\n" \
+      "  -j  Decode and render the GIF frames on this many threads.\n"
+#else
+#define THREAD_USAGE ""
+#define THREAD_HELP ""
+#endif
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: %s [-d] [-p] [-t] [-z] [-k keyframe-interval]\n"
+      "       [-K keyframe-bytes] [-M memory-budget] [-m coalesce-ms]\n"
+      "       [-F pool-directory] [-W blit-cost]" THREAD_USAGE "\n"
+      "       gif-file animation-file\n",
+      progname != NULL ? progname : "gif2monoanim");
+    fprintf(stderr,
+      "  -d  Show duration information (implies -p).\n"
+      "  -F  Build the frames in a temporary file in this directory.\n"
+      "  -K  Store a full frame after this many bytes of other frames.\n"
+      THREAD_HELP
+      "  -k  Store a full frame at least every this many frames.\n"
+      "  -M  Keep the frames within this many bytes, compressing as needed.\n"
+      "  -m  Merge frames shown for less than this many ms into the next.\n"
+      "  -p  Show progress messages.\n"
+      "  -t  Store frames as maps of shared 32x32 tiles when smaller.\n"
+      "  -W  Store partial frames only when faster to draw by this cost\n"
+      "      model, as measured by monogifplay-wscons -B.\n"
+      "  -z  Store frames as compressed XOR deltas when smaller.\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    WsconsAnimation animation;
+    WsconsLoadOptions load_options;
+    WsconsBlitCost blit_cost;
+#ifdef THREADED_RENDER
+    MonoGifIndex gif_index;
+#endif
+    MonoGifInfo gif_info;
+    GifFileType *gif;
+    const char *giffile, *animation_file, *pool_directory;
+    char *progpath, *endptr, *index_file;
+    long keyframe_interval, keyframe_bytes, coalesce_ms, memory_budget;
+    long threads;
+    int gif_error;
+    int opt;
+    uint32_t start_time, load_end_time, render_end_time, write_end_time;
+
+    wscons_animation_init(&animation);
+#ifdef THREADED_RENDER
+    mono_gif_index_init(&gif_index);
+#endif
+    index_file = NULL;
+    gif = NULL;
+    progpath = strdup(argv[0]);
+    if (progpath == NULL)
+        err(EXIT_FAILURE, "strdup");
+    progname = basename(progpath);
+
+    keyframe_interval = 0;
+    keyframe_bytes = 0;
+    coalesce_ms = 0;
+    memory_budget = 0;
+    memset(&blit_cost, 0, sizeof(blit_cost));
+    pool_directory = NULL;
+    threads = 1;
+    while ((opt = getopt(argc, argv, "F:K:M:W:dij:k:m:ptz")) != -1) {
+        switch (opt) {
+        case 'F':
+            pool_directory = optarg;
+            break;
+        case 'K':
+            keyframe_bytes = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || keyframe_bytes < 0)
+                usage();
+            break;
+        case 'M':
+            memory_budget = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || memory_budget < 0)
+                usage();
+            break;
+        case 'W':
+            if (wscons_blit_cost_parse(&blit_cost, optarg) == -1)
+                usage();
+            break;
+        case 'd':
+            opt_duration = 1;
+            opt_progress = 1;
+            break;
+#ifdef THREADED_RENDER
+        case 'i':
+            opt_index = 1;
+            break;
+        case 'j':
+            threads = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || threads < 1 || threads > INT_MAX)
+                usage();
+            break;
+#endif
+        case 'k':
+            keyframe_interval = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || keyframe_interval < 0 ||
+              keyframe_interval > INT_MAX)
+                usage();
+            break;
+        case 'm':
+            coalesce_ms = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || coalesce_ms < 0)
+                usage();
+            break;
+        case 'p':
+            opt_progress = 1;
+            break;
+        case 't':
+            opt_tiles = 1;
+            break;
+        case 'z':
+            opt_compress = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind + 2 != argc || (opt_index && threads <= 1))
+        usage();
+
+    giffile = argv[optind];
+    animation_file = argv[optind + 1];
+    init_gettime_ms();
+    start_time = gettime_ms();
+
+    load_options.progress = opt_progress != 0;
+    load_options.duration = opt_duration != 0;
+    load_options.compress = opt_compress != 0;
+    load_options.tiles = opt_tiles != 0;
+    load_options.keyframe_interval = (int)keyframe_interval;
+    load_options.keyframe_bytes = (size_t)keyframe_bytes;
+    load_options.coalesce_ms = (uint32_t)coalesce_ms;
+    load_options.memory_budget = (size_t)memory_budget;
+    load_options.blit_cost = blit_cost;
+    load_options.pool_directory = pool_directory;
+    load_options.threads = (int)threads;
+    load_options.gif_index = NULL;
+    load_options.gettime_ms = gettime_ms;
+
+#ifdef THREADED_RENDER
+    /* Frames are decoded on several threads from where they start. */
+    if (threads > 1) {
+        if (opt_index) {
+            index_file = malloc(strlen(giffile) + sizeof(".idx"));
+            if (index_file == NULL)
+                err(EXIT_FAILURE, "malloc");
+            strcpy(index_file, giffile);
+            strcat(index_file, ".idx");
+        }
+        if (mono_gif_index_open(&gif_index, giffile, index_file) == -1)
+            err(EXIT_FAILURE, "index %s", giffile);
+        if (index_file != NULL && !gif_index.from_sidecar &&
+          mono_gif_index_save(&gif_index, index_file) == -1)
+            warn("write %s", index_file);
+        load_options.gif_index = &gif_index;
+    }
+#endif
+
+    if (opt_progress)
+        fprintf(stderr, "Loading GIF file...");
+    gif = DGifOpenFileName(giffile, &gif_error);
+    if (gif == NULL)
+        errx(EXIT_FAILURE, "cannot open %s: %s",
+          giffile, GifErrorString(gif_error));
+    if (gif->SWidth <= 0 || gif->SHeight <= 0)
+        errx(EXIT_FAILURE, "invalid GIF logical screen size: %dx%d",
+          gif->SWidth, gif->SHeight);
+    if (mono_gif_scan_frames(gif) != GIF_OK)
+        errx(EXIT_FAILURE, "cannot load %s: %s",
+          giffile, GifErrorString(gif->Error));
+    load_end_time = gettime_ms();
+    if (opt_progress)
+        fprintf(stderr, " completed%s\n", opt_duration ? "" : ".");
+
+    if (gif->ImageCount <= 0)
+        errx(EXIT_FAILURE, "%s contains no GIF image frames", giffile);
+    if (mono_gif_info_init(&gif_info, (unsigned int)gif->SWidth,
+      (unsigned int)gif->SHeight, gif->ImageCount) == -1)
+        err(EXIT_FAILURE, "initialize monochrome GIF geometry");
+    if (wscons_animation_allocate(&animation, &gif_info, gif,
+      &load_options) == -1) {
+        if (errno == ENOSPC && memory_budget > 0)
+            errx(EXIT_FAILURE, "%s does not fit in %ld bytes",
+              giffile, memory_budget);
+        err(EXIT_FAILURE, "allocate monochrome frame pool");
+    }
+
+    /* Decode frames one at a time from a second pass over the file. */
+    if (DGifCloseFile(gif, &gif_error) != GIF_OK)
+        errx(EXIT_FAILURE, "close %s: %s",
+          giffile, GifErrorString(gif_error));
+    gif = DGifOpenFileName(giffile, &gif_error);
+    if (gif == NULL)
+        errx(EXIT_FAILURE, "cannot open %s: %s",
+          giffile, GifErrorString(gif_error));
+    if (gif->SWidth != (int)gif_info.width ||
+      gif->SHeight != (int)gif_info.height)
+        errx(EXIT_FAILURE, "%s changed while loading", giffile);
+    if (wscons_extract_mono_frames(gif, &animation) == -1) {
+        if (errno == 0)
+            errx(EXIT_FAILURE, "cannot load %s: %s",
+              giffile, GifErrorString(gif->Error));
+        if (errno == ENOSPC && memory_budget > 0)
+            errx(EXIT_FAILURE, "%s does not fit in %ld bytes",
+              giffile, memory_budget);
+        err(EXIT_FAILURE, "convert %s", giffile);
+    }
+    render_end_time = gettime_ms();
+
+    if (DGifCloseFile(gif, &gif_error) != GIF_OK) {
+        gif = NULL;
+        errx(EXIT_FAILURE, "close %s: %s",
+          giffile, GifErrorString(gif_error));
+    }
+    gif = NULL;
+
+    if (opt_progress)
+        fprintf(stderr, "Writing %s...", animation_file);
+    if (wscons_animation_write_file(&animation, animation_file) == -1)
+        err(EXIT_FAILURE, "write %s", animation_file);
+    write_end_time = gettime_ms();
+    if (opt_progress)
+        fprintf(stderr, " completed%s\n", opt_duration ? "" : ".");
+
+    if (opt_progress) {
+        fprintf(stderr, "%s: %ux%u, %d frames, 1bpp pool %zu bytes\n",
+          animation_file, animation.info.width, animation.info.height,
+          animation.info.frame_count, animation.bitmap_pool_size);
+    }
+
+    if (opt_duration) {
+        fprintf(stderr, "\nSummary:\n");
+        fprintf(stderr, "GIF loading time: %u ms\n",
+          load_end_time - start_time);
+#ifdef THREADED_RENDER
+        if (threads > 1)
+            fprintf(stderr, "Frame index: %d frames, %s\n",
+              gif_index.frame_count,
+              gif_index.from_sidecar ? "read from sidecar" : "scanned");
+#endif
+        fprintf(stderr, "Conversion time: %u ms\n",
+          render_end_time - load_end_time);
+        fprintf(stderr, "File writing time: %u ms\n",
+          write_end_time - render_end_time);
+        fprintf(stderr, "Changed-region trimming: %zu bytes saved "
+          "in %d frames\n", animation.trimmed_bytes,
+          animation.trimmed_frames);
+        fprintf(stderr, "Deduplication: %zu bytes saved in %d frames\n",
+          animation.dedup_bytes, animation.dedup_frames);
+        fprintf(stderr, "Motion copies: %d frames\n",
+          animation.move_frames);
+        if (opt_tiles)
+            fprintf(stderr, "Tile dictionary: %d tiles\n",
+              animation.tile_count);
+        if (keyframe_interval > 0 || keyframe_bytes > 0)
+            fprintf(stderr, "Keyframes: %d inserted\n",
+              animation.key_frames);
+        if (coalesce_ms > 0)
+            fprintf(stderr, "Coalesced frames: %d merged\n",
+              animation.coalesced_frames);
+        if (animation.loop_frame != NULL)
+            fprintf(stderr, "Loop frame: %zu bytes\n",
+              animation.loop_frame->data_size);
+        fprintf(stderr, "Total processing time: %u ms\n",
+          write_end_time - start_time);
+    }
+
+    wscons_animation_destroy(&animation);
+#ifdef THREADED_RENDER
+    mono_gif_index_close(&gif_index);
+#endif
+    free(index_file);
+    free(progpath);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1912 @@
+/*
+ * Backend-independent GIF decoding and monochrome conversion shared by
+ * monogifplay-wscons and the conversion commands.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef THREADED_RENDER
+#include <pthread.h>
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gif_lib.h>
+
+#include "mono_gif.h"
+
+#if defined(UNROLL_BITMAP_EXTRACT) || defined(SWAR_BITMAP_EXTRACT)
+#if defined(__linux__) || defined(__APPLE__)
+#include <endian.h>
+#elif defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+#include <sys/endian.h>
+#endif
+
+/* Try to check endianness without autoconf etc. */
+#if defined(__BYTE_ORDER__) && \
+  defined(__ORDER_LITTLE_ENDIAN__) && defined(__ORDER_BIG_ENDIAN__)
+# define TARGET_LITTLE_ENDIAN (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+# define TARGET_BIG_ENDIAN    (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#elif defined(_BYTE_ORDER) && \
+  defined(_LITTLE_ENDIAN) && defined(_BIG_ENDIAN)
+# define TARGET_LITTLE_ENDIAN (_BYTE_ORDER == _LITTLE_ENDIAN)
+# define TARGET_BIG_ENDIAN    (_BYTE_ORDER == _BIG_ENDIAN)
+#elif defined(BYTE_ORDER) && \
+  defined(LITTLE_ENDIAN) && defined(BIG_ENDIAN)
+# define TARGET_LITTLE_ENDIAN (BYTE_ORDER == LITTLE_ENDIAN)
+# define TARGET_BIG_ENDIAN    (BYTE_ORDER == BIG_ENDIAN)
+#else
+# error "Cannot determine endianness."
+#endif
+
+#ifndef bswap32
+#define bswap32(x) __builtin_bswap32(x)
+#endif
+#ifndef bswap64
+#define bswap64(x) __builtin_bswap64(x)
+#endif
+#endif /* UNROLL_BITMAP_EXTRACT || SWAR_BITMAP_EXTRACT */
+
+#ifdef SIMD_BITMAP_EXTRACT
+#if defined(__x86_64__) || defined(__i386__)
+#define MONO_SIMD_SSSE3
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#define MONO_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#if defined(MONO_SIMD_SSSE3) || defined(MONO_SIMD_NEON)
+#define MONO_SIMD
+#endif
+#endif /* SIMD_BITMAP_EXTRACT */
+
+#define DEF_GIF_DELAY   75U
+
+#ifdef UNROLL_BITMAP_EXTRACT
+#define MONO_WHITE_BIT  0x80000000U
+#else
+#define MONO_WHITE_BIT  0x80U
+#endif
+
+static int
+size_mul(size_t a, size_t b, size_t *result)
+{
+    if (a != 0 && b > SIZE_MAX / a) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    *result = a * b;
+    return 0;
+}
+
+int
+mono_gif_info_init(MonoGifInfo *info, unsigned int width,
+  unsigned int height, int frame_count)
+{
+    size_t line_bytes;
+    size_t frame_bytes;
+
+    if (width == 0 || height == 0 ||
+      width > UINT16_MAX || height > UINT16_MAX ||
+      frame_count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    line_bytes = ((size_t)width + 7U) / 8U;
+    if (size_mul(line_bytes, height, &frame_bytes) == -1)
+        return -1;
+    if (frame_bytes == 0) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    info->width = width;
+    info->height = height;
+    info->line_bytes = line_bytes;
+    info->frame_bytes = frame_bytes;
+    info->frame_count = frame_count;
+    return 0;
+}
+
+#if defined(UNROLL_BITMAP_EXTRACT) || defined(SWAR_BITMAP_EXTRACT)
+/*
+ * Return the number of leading pixels to process one by one before a safe,
+ * byte-boundary store of a word aligned to align bytes can be used.
+ */
+static unsigned int
+pixels_to_word_alignment(uint8_t *row, unsigned int x, unsigned int width,
+  uintptr_t align)
+{
+    unsigned int n;
+
+    n = 0;
+    while (n < width && ((x + n) & 7U) != 0)
+        n++;
+
+    while (n + 8U <= width &&
+      (((uintptr_t)(row + ((x + n) >> 3))) & (align - 1U)) != 0)
+        n += 8U;
+
+    return n;
+}
+#endif
+
+/*
+ * Return opaque_bit_cache filled with MONO_WHITE_BIT for each of the first
+ * count palette indexes other than transparent_index, or NULL if there is
+ * no transparent_index and mono_render_row() need not read the screen.
+ */
+static const uint32_t *
+mono_opaque_cache(uint32_t *opaque_bit_cache, unsigned int count,
+  int transparent_index)
+{
+    unsigned int ci;
+
+    if (transparent_index == NO_TRANSPARENT_COLOR)
+        return NULL;
+
+    for (ci = 0; ci < count; ci++)
+        opaque_bit_cache[ci] = (int)ci != transparent_index ?
+          MONO_WHITE_BIT : 0;
+    return opaque_bit_cache;
+}
+
+/*
+ * Convert one row of palette indexes into MSB-first 1bpp pixels starting at
+ * screen x position left of bitmap_row.  Pixels whose opaque_bit_cache
+ * entry is 0 are left unchanged, without a branch per pixel: each word is
+ * composited as (old & ~mask) | (value & mask).  opaque_bit_cache is NULL
+ * if every pixel is opaque.
+ */
+static void
+mono_render_row(uint8_t *bitmap_row, unsigned int left,
+  const GifByteType *raster, unsigned int width,
+  const uint32_t *bw_bit_cache, const uint32_t *opaque_bit_cache)
+{
+    unsigned int x, screenx;
+    GifByteType px;
+    uint8_t mask;
+#ifdef UNROLL_BITMAP_EXTRACT
+    uint8_t *bitmapp;
+    unsigned int unaligned_pixels;
+
+    unaligned_pixels = pixels_to_word_alignment(bitmap_row, left, width,
+      sizeof(uint32_t));
+
+    /* 1. Pixel operations until a safe uint32_t boundary. */
+    for (x = 0, screenx = left; x < unaligned_pixels; x++, screenx++) {
+        unsigned int byte, bit;
+
+        px = *raster++;
+        byte = screenx >> 3;
+        bit = screenx & 7U;
+        mask = opaque_bit_cache != NULL ?
+          (uint8_t)(opaque_bit_cache[px] >> (bit + 24U)) :
+          (uint8_t)(0x80U >> bit);
+        bitmap_row[byte] = (uint8_t)((bitmap_row[byte] & ~mask) |
+          ((bw_bit_cache[px] >> (bit + 24U)) & mask));
+    }
+
+    /* 2. Unrolled 32-pixel operations. */
+    for (bitmapp = &bitmap_row[screenx >> 3];
+      x + 31U < width;
+      x += 32U, screenx += 32U, bitmapp += 4) {
+        uint32_t bitmap32, value32, mask32;
+
+        if (opaque_bit_cache == NULL) {
+            bitmap32  = bw_bit_cache[*raster++] >> 0U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 1U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 2U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 3U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 4U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 5U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 6U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 7U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 8U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 9U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 10U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 11U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 12U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 13U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 14U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 15U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 16U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 17U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 18U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 19U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 20U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 21U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 22U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 23U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 24U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 25U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 26U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 27U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 28U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 29U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 30U;
+            bitmap32 |= bw_bit_cache[*raster++] >> 31U;
+#if TARGET_LITTLE_ENDIAN
+            bitmap32 = bswap32(bitmap32);
+#endif
+            *(uint32_t *)(void *)bitmapp = bitmap32;
+        } else {
+            bitmap32 = *(uint32_t *)(void *)bitmapp;
+#if TARGET_LITTLE_ENDIAN
+            bitmap32 = bswap32(bitmap32);
+#endif
+            value32 = 0;
+            mask32 = 0;
+#define UPDATE_BITMAP32_BIT(bitpos) do {                              \
+            px = *raster++;                                           \
+            value32 |= bw_bit_cache[px] >> (bitpos);                  \
+            mask32 |= opaque_bit_cache[px] >> (bitpos);               \
+        } while (0)
+            UPDATE_BITMAP32_BIT(0U);
+            UPDATE_BITMAP32_BIT(1U);
+            UPDATE_BITMAP32_BIT(2U);
+            UPDATE_BITMAP32_BIT(3U);
+            UPDATE_BITMAP32_BIT(4U);
+            UPDATE_BITMAP32_BIT(5U);
+            UPDATE_BITMAP32_BIT(6U);
+            UPDATE_BITMAP32_BIT(7U);
+            UPDATE_BITMAP32_BIT(8U);
+            UPDATE_BITMAP32_BIT(9U);
+            UPDATE_BITMAP32_BIT(10U);
+            UPDATE_BITMAP32_BIT(11U);
+            UPDATE_BITMAP32_BIT(12U);
+            UPDATE_BITMAP32_BIT(13U);
+            UPDATE_BITMAP32_BIT(14U);
+            UPDATE_BITMAP32_BIT(15U);
+            UPDATE_BITMAP32_BIT(16U);
+            UPDATE_BITMAP32_BIT(17U);
+            UPDATE_BITMAP32_BIT(18U);
+            UPDATE_BITMAP32_BIT(19U);
+            UPDATE_BITMAP32_BIT(20U);
+            UPDATE_BITMAP32_BIT(21U);
+            UPDATE_BITMAP32_BIT(22U);
+            UPDATE_BITMAP32_BIT(23U);
+            UPDATE_BITMAP32_BIT(24U);
+            UPDATE_BITMAP32_BIT(25U);
+            UPDATE_BITMAP32_BIT(26U);
+            UPDATE_BITMAP32_BIT(27U);
+            UPDATE_BITMAP32_BIT(28U);
+            UPDATE_BITMAP32_BIT(29U);
+            UPDATE_BITMAP32_BIT(30U);
+            UPDATE_BITMAP32_BIT(31U);
+#undef UPDATE_BITMAP32_BIT
+            bitmap32 = (bitmap32 & ~mask32) | (value32 & mask32);
+#if TARGET_LITTLE_ENDIAN
+            bitmap32 = bswap32(bitmap32);
+#endif
+            *(uint32_t *)(void *)bitmapp = bitmap32;
+        }
+    }
+
+    /* 3. Remaining pixels. */
+    for (; x < width; x++, screenx++) {
+        unsigned int byte, bit;
+
+        px = *raster++;
+        byte = screenx >> 3;
+        bit = screenx & 7U;
+        mask = opaque_bit_cache != NULL ?
+          (uint8_t)(opaque_bit_cache[px] >> (bit + 24U)) :
+          (uint8_t)(0x80U >> bit);
+        bitmap_row[byte] = (uint8_t)((bitmap_row[byte] & ~mask) |
+          ((bw_bit_cache[px] >> (bit + 24U)) & mask));
+    }
+#else
+    for (x = 0, screenx = left; x < width; x++, screenx++) {
+        unsigned int byte, bit;
+
+        px = raster[x];
+        byte = screenx >> 3;
+        bit = screenx & 7U;
+        mask = opaque_bit_cache != NULL ?
+          (uint8_t)(opaque_bit_cache[px] >> bit) : (uint8_t)(0x80U >> bit);
+        bitmap_row[byte] = (uint8_t)((bitmap_row[byte] & ~mask) |
+          ((bw_bit_cache[px] >> bit) & mask));
+    }
+#endif
+}
+
+/*
+ * Palette tables for mono_render_row_simd(): white is 0xff for white and 0
+ * for black palette indexes, and bit n of bits_low[h] and bits_high[h] is
+ * set when index h * 16 + n and h * 16 + 8 + n respectively is white.
+ */
+typedef struct {
+    uint8_t white[256];
+#ifdef MONO_SIMD_SSSE3
+    uint8_t bits_low[16];
+    uint8_t bits_high[16];
+#endif
+} MonoRowTable;
+
+#ifdef MONO_SIMD
+/* Convert one pixel as mono_render_row() does. */
+static inline void
+mono_simd_pixel(uint8_t *bitmap_row, unsigned int screenx, GifByteType px,
+  const MonoRowTable *table, int transparent_index)
+{
+    uint8_t bit;
+
+    if (px == transparent_index)
+        return;
+
+    bit = (uint8_t)(0x80U >> (screenx & 7U));
+    bitmap_row[screenx >> 3] &= (uint8_t)~bit;
+    bitmap_row[screenx >> 3] |= table->white[px] & bit;
+}
+#endif
+
+#ifdef MONO_SIMD_SSSE3
+/*
+ * SSSE3 version of mono_render_row().  pshufb only looks up 16 entries, so
+ * the high nibble of each of 16 pixels selects a byte of bits_low or
+ * bits_high and the low nibble the bit within it.  Each half of the result
+ * is byte-reversed so that pmovmskb puts its first pixel in bit 7, and
+ * transparent pixels are blended back from the screen by a compare mask.
+ */
+__attribute__((target("ssse3")))
+static void
+mono_render_row_simd(uint8_t *bitmap_row, unsigned int left,
+  const GifByteType *raster, unsigned int width, const MonoRowTable *table,
+  int transparent_index)
+{
+    unsigned int x, screenx, bits, keep;
+    uint8_t *bitmapp;
+    __m128i nibble, seven, bits_low, bits_high, bit_of, reverse, transparent;
+    __m128i px, low, high, upper, row, bit;
+
+    for (x = 0, screenx = left; x < width && (screenx & 7U) != 0;
+      x++, screenx++)
+        mono_simd_pixel(bitmap_row, screenx, raster[x], table,
+          transparent_index);
+
+    nibble = _mm_set1_epi8(0x0f);
+    seven = _mm_set1_epi8(7);
+    bits_low = _mm_loadu_si128((const void *)table->bits_low);
+    bits_high = _mm_loadu_si128((const void *)table->bits_high);
+    bit_of = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+      1, 2, 4, 8, 16, 32, 64, -128);
+    reverse = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+      15, 14, 13, 12, 11, 10, 9, 8);
+    transparent = _mm_set1_epi8((char)transparent_index);
+    for (bitmapp = &bitmap_row[screenx >> 3]; x + 15U < width;
+      x += 16U, screenx += 16U, bitmapp += 2) {
+        px = _mm_loadu_si128((const void *)&raster[x]);
+        low = _mm_and_si128(px, nibble);
+        high = _mm_and_si128(_mm_srli_epi16(px, 4), nibble);
+        upper = _mm_cmpgt_epi8(low, seven);
+        row = _mm_or_si128(
+          _mm_andnot_si128(upper, _mm_shuffle_epi8(bits_low, high)),
+          _mm_and_si128(upper, _mm_shuffle_epi8(bits_high, high)));
+        bit = _mm_shuffle_epi8(bit_of, low);
+        bits = (unsigned int)_mm_movemask_epi8(_mm_shuffle_epi8(
+          _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit), reverse));
+        if (transparent_index >= 0 && transparent_index <= 0xff) {
+            keep = (unsigned int)_mm_movemask_epi8(_mm_shuffle_epi8(
+              _mm_cmpeq_epi8(px, transparent), reverse));
+            bits = (bits & ~keep) |
+              (((unsigned int)bitmapp[1] << 8 | bitmapp[0]) & keep);
+        }
+        bitmapp[0] = (uint8_t)bits;
+        bitmapp[1] = (uint8_t)(bits >> 8);
+    }
+
+    for (; x < width; x++, screenx++)
+        mono_simd_pixel(bitmap_row, screenx, raster[x], table,
+          transparent_index);
+}
+
+static bool
+mono_simd_available(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+#endif /* MONO_SIMD_SSSE3 */
+
+#ifdef MONO_SIMD_NEON
+/* Pack the set bits of each lane of v into two MSB-first bitmap bytes. */
+static inline void
+mono_neon_pack(uint8x16_t v, uint8_t *bitmapp)
+{
+    static const uint8_t weights[16] = {
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+    };
+
+    v = vandq_u8(v, vld1q_u8(weights));
+    bitmapp[0] = vaddv_u8(vget_low_u8(v));
+    bitmapp[1] = vaddv_u8(vget_high_u8(v));
+}
+
+/*
+ * NEON version of mono_render_row().  white is looked up 16 pixels at a
+ * time as four 64-byte tbl tables, each of which yields 0 for indexes out of
+ * its range, and transparent pixels are blended back by a compare mask.
+ */
+static void
+mono_render_row_simd(uint8_t *bitmap_row, unsigned int left,
+  const GifByteType *raster, unsigned int width, const MonoRowTable *table,
+  int transparent_index)
+{
+    unsigned int x, screenx, i;
+    uint8_t *bitmapp;
+    uint8x16x4_t white[4];
+    uint8x16_t px, bits, keep, old, transparent;
+    uint8_t packed[2];
+
+    for (x = 0, screenx = left; x < width && (screenx & 7U) != 0;
+      x++, screenx++)
+        mono_simd_pixel(bitmap_row, screenx, raster[x], table,
+          transparent_index);
+
+    for (i = 0; i < 16; i++)
+        white[i / 4].val[i % 4] = vld1q_u8(&table->white[i * 16]);
+    transparent = vdupq_n_u8((uint8_t)transparent_index);
+    for (bitmapp = &bitmap_row[screenx >> 3]; x + 15U < width;
+      x += 16U, screenx += 16U, bitmapp += 2) {
+        px = vld1q_u8(&raster[x]);
+        bits = vqtbl4q_u8(white[0], px);
+        bits = vorrq_u8(bits,
+          vqtbl4q_u8(white[1], vsubq_u8(px, vdupq_n_u8(64))));
+        bits = vorrq_u8(bits,
+          vqtbl4q_u8(white[2], vsubq_u8(px, vdupq_n_u8(128))));
+        bits = vorrq_u8(bits,
+          vqtbl4q_u8(white[3], vsubq_u8(px, vdupq_n_u8(192))));
+        if (transparent_index >= 0 && transparent_index <= 0xff) {
+            keep = vceqq_u8(px, transparent);
+            old = vcombine_u8(vdup_n_u8(bitmapp[0]), vdup_n_u8(bitmapp[1]));
+            bits = vbslq_u8(keep, old, bits);
+        }
+        mono_neon_pack(bits, packed);
+        bitmapp[0] = packed[0];
+        bitmapp[1] = packed[1];
+    }
+
+    for (; x < width; x++, screenx++)
+        mono_simd_pixel(bitmap_row, screenx, raster[x], table,
+          transparent_index);
+}
+
+static bool
+mono_simd_available(void)
+{
+    return true;
+}
+#endif /* MONO_SIMD_NEON */
+
+/*
+ * Build table from the first count entries of bw_bit_cache and return it
+ * for mono_pack_row(), or return NULL to use mono_render_row() where there
+ * is no SIMD kernel for this build or CPU.
+ */
+static const MonoRowTable *
+mono_simd_table(MonoRowTable *table, const uint32_t *bw_bit_cache,
+  unsigned int count)
+{
+#ifdef MONO_SIMD
+    unsigned int ci;
+#ifdef MONO_SIMD_SSSE3
+    unsigned int h, n;
+#endif
+
+    if (!mono_simd_available())
+        return NULL;
+
+    memset(table, 0, sizeof(*table));
+    for (ci = 0; ci < count; ci++)
+        table->white[ci] = bw_bit_cache[ci] != 0 ? 0xff : 0;
+#ifdef MONO_SIMD_SSSE3
+    for (h = 0; h < 16; h++) {
+        for (n = 0; n < 8; n++) {
+            table->bits_low[h] |= (table->white[h * 16 + n] & 1U) << n;
+            table->bits_high[h] |=
+              (table->white[h * 16 + 8 + n] & 1U) << n;
+        }
+    }
+#endif
+    return table;
+#else
+    (void)table;
+    (void)bw_bit_cache;
+    (void)count;
+    return NULL;
+#endif
+}
+
+/* mono_render_row() with the SIMD kernel when mono_simd_table() made one. */
+static inline void
+mono_pack_row(uint8_t *bitmap_row, unsigned int left,
+  const GifByteType *raster, unsigned int width,
+  const uint32_t *bw_bit_cache, const uint32_t *opaque_bit_cache,
+  const MonoRowTable *table, int transparent_index)
+{
+#ifdef MONO_SIMD
+    if (table != NULL) {
+        mono_render_row_simd(bitmap_row, left, raster, width, table,
+          transparent_index);
+        return;
+    }
+#else
+    (void)transparent_index;
+#endif
+    mono_render_row(bitmap_row, left, raster, width, bw_bit_cache,
+      opaque_bit_cache);
+}
+
+/* GIF delays are in 1/100 s; frames without one get DEF_GIF_DELAY. */
+static uint32_t
+mono_gif_delay_ms(int delay_time)
+{
+    return delay_time > 0 ? (uint32_t)delay_time * 10U : DEF_GIF_DELAY;
+}
+
+/*
+ * Return the display time in milliseconds of a frame read by
+ * mono_gif_scan_frames() or mono_gif_read_frame(), as mono_render_frame()
+ * reports it.
+ */
+uint32_t
+mono_gif_frame_delay(const SavedImage *img)
+{
+    GraphicsControlBlock gcb;
+    int i;
+
+    memset(&gcb, 0, sizeof(gcb));
+    for (i = 0; i < img->ExtensionBlockCount; i++) {
+        const ExtensionBlock *block = &img->ExtensionBlocks[i];
+
+        if (block->Function == GRAPHICS_EXT_FUNC_CODE) {
+            (void)DGifExtensionToGCB((size_t)block->ByteCount,
+              block->Bytes, &gcb);
+            break;
+        }
+    }
+    return mono_gif_delay_ms(gcb.DelayTime);
+}
+
+/*
+ * Common frame setup for both decoders: validate the image rectangle, read
+ * the graphics control block, fill frame_info, start from the previous
+ * image when the frame does not cover every pixel, and build the per-palette
+ * 1bpp bit table.
+ */
+static int
+mono_frame_begin(GifFileType *gif, const MonoGifInfo *info, int frame,
+  uint8_t *bitmap, const uint8_t *previous, MonoGifFrameInfo *frame_info,
+  uint32_t bw_bit_cache[256], int *transparent)
+{
+    unsigned int swidth, sheight;
+    unsigned int frame_width, frame_height, frame_left, frame_top;
+    unsigned int ci, ncolors;
+    const GifImageDesc *desc;
+    const ColorMapObject *cmap;
+    GraphicsControlBlock gcb;
+    int transparent_index;
+
+    if (gif == NULL || info == NULL || bitmap == NULL ||
+      frame_info == NULL ||
+      frame < 0 || frame >= info->frame_count ||
+      frame >= gif->ImageCount) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    swidth = info->width;
+    sheight = info->height;
+
+    desc = &gif->SavedImages[frame].ImageDesc;
+    cmap = desc->ColorMap != NULL ? desc->ColorMap : gif->SColorMap;
+    if (cmap == NULL || cmap->ColorCount > 256 ||
+      desc->Left < 0 || desc->Top < 0 ||
+      desc->Width < 0 || desc->Height < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    frame_width = (unsigned int)desc->Width;
+    frame_height = (unsigned int)desc->Height;
+    frame_left = (unsigned int)desc->Left;
+    frame_top = (unsigned int)desc->Top;
+    if (frame_left > swidth || frame_top > sheight ||
+      frame_width > swidth - frame_left ||
+      frame_height > sheight - frame_top) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&gcb, 0, sizeof(gcb));
+    gcb.TransparentColor = NO_TRANSPARENT_COLOR;
+    /*
+     * GIFLIB returns GIF_ERROR when no GCE exists, while leaving the
+     * caller-supplied defaults in gcb.  This is valid for ordinary GIFs.
+     */
+    (void)DGifSavedExtensionToGCB(gif, frame, &gcb);
+    frame_info->delay = mono_gif_delay_ms(gcb.DelayTime);
+    frame_info->update_left = (uint16_t)frame_left;
+    frame_info->update_top = (uint16_t)frame_top;
+    frame_info->update_width = (uint16_t)frame_width;
+    frame_info->update_height = (uint16_t)frame_height;
+    transparent_index = gcb.TransparentColor;
+
+    if (transparent_index != NO_TRANSPARENT_COLOR ||
+      swidth != frame_width || sheight != frame_height ||
+      frame_left != 0 || frame_top != 0) {
+        if (previous == NULL)
+            memset(bitmap, 0, info->frame_bytes);
+        else if (bitmap != previous)
+            memcpy(bitmap, previous, info->frame_bytes);
+    } else if ((swidth & 7U) != 0) {
+        /* Bits past the screen width are kept clear whatever bitmap held. */
+        uint8_t *last;
+
+        for (last = bitmap + info->line_bytes - 1;
+          last < bitmap + info->frame_bytes; last += info->line_bytes)
+            *last &= (uint8_t)(0xff00U >> (swidth & 7U));
+    }
+
+    memset(bw_bit_cache, 0, 256 * sizeof(bw_bit_cache[0]));
+    ncolors = (unsigned int)cmap->ColorCount;
+    for (ci = 0; ci < ncolors; ci++) {
+        GifColorType c = cmap->Colors[ci];
+        if ((unsigned int)c.Red * 299U +
+          (unsigned int)c.Green * 587U +
+          (unsigned int)c.Blue * 114U > 128000U)
+            bw_bit_cache[ci] = MONO_WHITE_BIT;
+    }
+
+    *transparent = transparent_index;
+    return 0;
+}
+
+/*
+ * Render the rows of the image rectangle of img, starting at the screen row
+ * at rows, each stride bytes after the last.
+ */
+static void
+mono_render_rows(uint8_t *rows, size_t stride, const SavedImage *img,
+  const MonoGifFrameInfo *frame_info, const uint32_t *bw_bit_cache,
+  int transparent_index)
+{
+    size_t raster_offset;
+    unsigned int y;
+    uint32_t opaque_bit_cache[256];
+    const uint32_t *opaque;
+    MonoRowTable row_table;
+    const MonoRowTable *table;
+
+    opaque = mono_opaque_cache(opaque_bit_cache, 256, transparent_index);
+    table = mono_simd_table(&row_table, bw_bit_cache, 256);
+    for (y = 0, raster_offset = 0; y < frame_info->update_height;
+      y++, rows += stride, raster_offset += frame_info->update_width) {
+        mono_pack_row(rows, frame_info->update_left,
+          img->RasterBits + raster_offset, frame_info->update_width,
+          bw_bit_cache, opaque, table, transparent_index);
+    }
+}
+
+/*
+ * Render one GIF frame into a complete MSB-first 1bpp logical-screen image.
+ *
+ * This function is deliberately independent of wsdisplay and of the final
+ * frame storage policy.  The X11 and wscons backends can pass one reusable
+ * work buffer as both bitmap and previous, while the packer renders into the
+ * same work buffer before serializing the frame pool.
+ */
+int
+mono_render_frame(GifFileType *gif, const MonoGifInfo *info, int frame,
+  uint8_t *bitmap, const uint8_t *previous, MonoGifFrameInfo *frame_info)
+{
+    const SavedImage *img;
+    int transparent_index;
+    uint32_t bw_bit_cache[256];
+
+    if (mono_frame_begin(gif, info, frame, bitmap, previous, frame_info,
+      bw_bit_cache, &transparent_index) == -1)
+        return -1;
+
+    img = &gif->SavedImages[frame];
+    if (frame_info->update_width != 0 && frame_info->update_height != 0 &&
+      img->RasterBits == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mono_render_rows(bitmap + (size_t)frame_info->update_top *
+      info->line_bytes, info->line_bytes, img, frame_info, bw_bit_cache,
+      transparent_index);
+    return 0;
+}
+
+/*
+ * Release the source data for a frame after its rendered result has been
+ * committed to backend-owned storage.  Keeping this separate from rendering
+ * makes the ownership transition explicit for every caller of this module.
+ */
+void
+mono_release_saved_image(SavedImage *img)
+{
+    free(img->RasterBits);
+    img->RasterBits = NULL;
+
+    if (img->ImageDesc.ColorMap != NULL) {
+        GifFreeMapObject(img->ImageDesc.ColorMap);
+        img->ImageDesc.ColorMap = NULL;
+    }
+
+    GifFreeExtensions(&img->ExtensionBlockCount, &img->ExtensionBlocks);
+}
+
+/*
+ * Skip the LZW data of the image whose descriptor was just read.
+ */
+static int
+mono_gif_skip_image(GifFileType *gif)
+{
+    GifByteType *block;
+    int code_size;
+
+    if (DGifGetCode(gif, &code_size, &block) == GIF_ERROR)
+        return GIF_ERROR;
+    while (block != NULL) {
+        if (DGifGetCodeNext(gif, &block) == GIF_ERROR)
+            return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
+/*
+ * Read one extension record.  Only graphics control blocks are kept, since
+ * nothing else is used by mono_render_frame(); pass NULL to discard all.
+ */
+static int
+mono_gif_read_extension(GifFileType *gif, int *block_count,
+  ExtensionBlock **blocks)
+{
+    GifByteType *data;
+    int function;
+
+    if (DGifGetExtension(gif, &function, &data) == GIF_ERROR)
+        return GIF_ERROR;
+    if (blocks != NULL && function == GRAPHICS_EXT_FUNC_CODE &&
+      data != NULL) {
+        if (GifAddExtensionBlock(block_count, blocks, function,
+          data[0], &data[1]) == GIF_ERROR) {
+            gif->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+            return GIF_ERROR;
+        }
+    }
+    while (data != NULL) {
+        if (DGifGetExtensionNext(gif, &data) == GIF_ERROR)
+            return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
+static int
+mono_gif_read_raster(GifFileType *gif, SavedImage *img)
+{
+    static const unsigned int interlaced_offset[] = { 0, 4, 2, 1 };
+    static const unsigned int interlaced_jump[] = { 8, 8, 4, 2 };
+    unsigned int width, height, pass, y;
+    size_t raster_size;
+
+    if (img->ImageDesc.Width < 0 || img->ImageDesc.Height < 0) {
+        gif->Error = D_GIF_ERR_WRONG_RECORD;
+        return GIF_ERROR;
+    }
+    width = (unsigned int)img->ImageDesc.Width;
+    height = (unsigned int)img->ImageDesc.Height;
+    if (width == 0 || height == 0)
+        return mono_gif_skip_image(gif);
+
+    if (size_mul(width, height, &raster_size) == -1 ||
+      (img->RasterBits = malloc(raster_size)) == NULL) {
+        gif->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
+    }
+
+    if (img->ImageDesc.Interlace) {
+        for (pass = 0; pass < 4; pass++) {
+            for (y = interlaced_offset[pass]; y < height;
+              y += interlaced_jump[pass]) {
+                if (DGifGetLine(gif, img->RasterBits + (size_t)y * width,
+                  (int)width) == GIF_ERROR)
+                    return GIF_ERROR;
+            }
+        }
+    } else {
+        for (y = 0; y < height; y++) {
+            if (DGifGetLine(gif, img->RasterBits + (size_t)y * width,
+              (int)width) == GIF_ERROR)
+                return GIF_ERROR;
+        }
+    }
+    return GIF_OK;
+}
+
+/*
+ * First pass of record-by-record loading: collect every image descriptor
+ * and graphics control block without decoding any LZW data, so that
+ * callers know the frame count, update rectangles and delays before the
+ * first frame is rendered.  Unlike DGifSlurp(), no RasterBits are kept.
+ */
+int
+mono_gif_scan_frames(GifFileType *gif)
+{
+    GifRecordType record_type;
+    ExtensionBlock *blocks;
+    int block_count;
+
+    blocks = NULL;
+    block_count = 0;
+    do {
+        if (DGifGetRecordType(gif, &record_type) == GIF_ERROR)
+            goto fail;
+
+        switch (record_type) {
+        case IMAGE_DESC_RECORD_TYPE: {
+            SavedImage *img;
+
+            if (DGifGetImageDesc(gif) == GIF_ERROR)
+                goto fail;
+            if (mono_gif_skip_image(gif) == GIF_ERROR)
+                goto fail;
+            /* Only the geometry is needed; color maps are read again. */
+            img = &gif->SavedImages[gif->ImageCount - 1];
+            mono_release_saved_image(img);
+            img->ExtensionBlockCount = block_count;
+            img->ExtensionBlocks = blocks;
+            blocks = NULL;
+            block_count = 0;
+            break;
+        }
+        case EXTENSION_RECORD_TYPE:
+            if (mono_gif_read_extension(gif, &block_count,
+              &blocks) == GIF_ERROR)
+                goto fail;
+            break;
+        default:
+            break;
+        }
+    } while (record_type != TERMINATE_RECORD_TYPE);
+
+    GifFreeExtensions(&block_count, &blocks);
+    return GIF_OK;
+
+fail:
+    GifFreeExtensions(&block_count, &blocks);
+    return GIF_ERROR;
+}
+
+/*
+ * Second pass: decode the next image and its graphics control block into
+ * gif->SavedImages[*frame].  *frame is set to -1 at the end of the stream.
+ * The caller renders the frame and then calls mono_release_saved_image(),
+ * so at most one 8bpp raster is held at a time.
+ */
+int
+mono_gif_read_frame(GifFileType *gif, int *frame)
+{
+    GifRecordType record_type;
+    ExtensionBlock *blocks;
+    int block_count;
+
+    *frame = -1;
+    blocks = NULL;
+    block_count = 0;
+
+    for (;;) {
+        if (DGifGetRecordType(gif, &record_type) == GIF_ERROR)
+            goto fail;
+
+        switch (record_type) {
+        case IMAGE_DESC_RECORD_TYPE: {
+            SavedImage *img;
+
+            if (DGifGetImageDesc(gif) == GIF_ERROR)
+                goto fail;
+            img = &gif->SavedImages[gif->ImageCount - 1];
+            img->ExtensionBlockCount = block_count;
+            img->ExtensionBlocks = blocks;
+            if (mono_gif_read_raster(gif, img) == GIF_ERROR)
+                return GIF_ERROR;
+            *frame = gif->ImageCount - 1;
+            return GIF_OK;
+        }
+        case EXTENSION_RECORD_TYPE:
+            if (mono_gif_read_extension(gif, &block_count,
+              &blocks) == GIF_ERROR)
+                goto fail;
+            break;
+        case TERMINATE_RECORD_TYPE:
+            GifFreeExtensions(&block_count, &blocks);
+            return GIF_OK;
+        default:
+            break;
+        }
+    }
+
+fail:
+    GifFreeExtensions(&block_count, &blocks);
+    return GIF_ERROR;
+}
+
+#ifdef FUSED_LZW_DECODE
+#define LZW_MAX_BITS    12U
+#define LZW_MAX_CODES   (1U << LZW_MAX_BITS)
+
+/* Pixel classes stored in the LZW dictionary instead of palette indexes. */
+#define MONO_CLASS_BLACK        0U
+#define MONO_CLASS_WHITE        1U
+#define MONO_CLASS_TRANSPARENT  2U
+
+#ifdef SWAR_BITMAP_EXTRACT
+#define MONO_SWAR_LOW_BITS      0x0101010101010101ULL
+#define MONO_SWAR_PACK          0x8040201008040201ULL
+
+/*
+ * Gather bit 0 of each byte of bytes into one MSB-first byte: after masking,
+ * each byte is 0 or 1, and multiplying by MONO_SWAR_PACK moves bit 0 of byte
+ * i to bit 63 - i without any carries into the top byte.
+ */
+static inline uint64_t
+mono_swar_pack8(uint64_t bytes)
+{
+    return ((bytes & MONO_SWAR_LOW_BITS) * MONO_SWAR_PACK) >> 56;
+}
+
+/* Load 8 bytes with the first one in the lowest byte on any host. */
+static inline uint64_t
+mono_swar_load(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if TARGET_BIG_ENDIAN
+    v = bswap64(v);
+#endif
+    return v;
+}
+
+/*
+ * Convert one row of pixel classes into MSB-first 1bpp pixels starting at
+ * screen x position left of bitmap_row, as mono_render_row() would with
+ * class_cache, 64 pixels per store.  MONO_CLASS_WHITE and
+ * MONO_CLASS_TRANSPARENT are bit 0 and bit 1 of a class byte, so 8 classes
+ * are tested at once as 64-bit words.
+ */
+static void
+mono_render_class_row(uint8_t *bitmap_row, unsigned int left,
+  const uint8_t *classes, unsigned int width)
+{
+    unsigned int x, screenx, i, unaligned_pixels;
+    uint64_t *bitmapp;
+    uint64_t bits, keep, v;
+
+    unaligned_pixels = pixels_to_word_alignment(bitmap_row, left, width,
+      sizeof(uint64_t));
+
+    /* 1. Pixel operations until a safe uint64_t boundary. */
+    for (x = 0, screenx = left; x < unaligned_pixels; x++, screenx++) {
+        uint8_t bit;
+
+        if (classes[x] == MONO_CLASS_TRANSPARENT)
+            continue;
+        bit = (uint8_t)(0x80U >> (screenx & 7U));
+        bitmap_row[screenx >> 3] &= (uint8_t)~bit;
+        if (classes[x] == MONO_CLASS_WHITE)
+            bitmap_row[screenx >> 3] |= bit;
+    }
+
+    /* 2. 64-pixel operations, 8 pixels per multiply. */
+    for (bitmapp = (uint64_t *)(void *)&bitmap_row[screenx >> 3];
+      x + 63U < width; x += 64U, screenx += 64U, bitmapp++) {
+        bits = 0;
+        keep = 0;
+        for (i = 0; i < 8; i++) {
+            v = mono_swar_load(&classes[x + i * 8U]);
+            bits |= mono_swar_pack8(v) << (56U - i * 8U);
+            keep |= mono_swar_pack8(v >> 1) << (56U - i * 8U);
+        }
+        if (keep != 0) {
+#if TARGET_LITTLE_ENDIAN
+            bits = (bits & ~keep) | (bswap64(*bitmapp) & keep);
+#else
+            bits = (bits & ~keep) | (*bitmapp & keep);
+#endif
+        }
+#if TARGET_LITTLE_ENDIAN
+        bits = bswap64(bits);
+#endif
+        *bitmapp = bits;
+    }
+
+    /* 3. Remaining pixels. */
+    for (; x < width; x++, screenx++) {
+        uint8_t bit;
+
+        if (classes[x] == MONO_CLASS_TRANSPARENT)
+            continue;
+        bit = (uint8_t)(0x80U >> (screenx & 7U));
+        bitmap_row[screenx >> 3] &= (uint8_t)~bit;
+        if (classes[x] == MONO_CLASS_WHITE)
+            bitmap_row[screenx >> 3] |= bit;
+    }
+}
+#endif /* SWAR_BITMAP_EXTRACT */
+
+/*
+ * mono_pack_row() for a row of pixel classes, which needs no palette lookup
+ * for mono_render_class_row() when there is no SIMD kernel.
+ */
+static inline void
+mono_pack_class_row(uint8_t *bitmap_row, unsigned int left,
+  const uint8_t *classes, unsigned int width, const uint32_t *class_cache,
+  const uint32_t *class_opaque, const MonoRowTable *table,
+  int class_transparent)
+{
+#ifdef SWAR_BITMAP_EXTRACT
+    if (table == NULL) {
+        mono_render_class_row(bitmap_row, left, classes, width);
+        return;
+    }
+#endif
+    mono_pack_row(bitmap_row, left, classes, width, class_cache,
+      class_opaque, table, class_transparent);
+}
+
+typedef struct {
+    GifFileType *gif;
+    GifByteType *block;         /* block[0] is the sub-block length */
+    unsigned int block_pos;
+    uint32_t bits;
+    unsigned int bit_count;
+} MonoLzwInput;
+
+static int
+mono_lzw_read_code(MonoLzwInput *in, unsigned int code_size)
+{
+    unsigned int code;
+
+    while (in->bit_count < code_size) {
+        while (in->block != NULL && in->block_pos > in->block[0]) {
+            if (DGifGetCodeNext(in->gif, &in->block) == GIF_ERROR)
+                return -1;
+            in->block_pos = 1;
+        }
+        if (in->block == NULL) {
+            in->gif->Error = D_GIF_ERR_IMAGE_DEFECT;
+            return -1;
+        }
+        in->bits |= (uint32_t)in->block[in->block_pos++] << in->bit_count;
+        in->bit_count += 8U;
+    }
+
+    code = in->bits & ((1U << code_size) - 1U);
+    in->bits >>= code_size;
+    in->bit_count -= code_size;
+    return (int)code;
+}
+
+/*
+ * Decode the LZW image data of the current image straight into 1bpp rows.
+ *
+ * Root dictionary entries hold the black/white/transparent class of each
+ * palette index rather than the index itself.  LZW only ever copies suffix
+ * values, so every decoded string is already thresholded when it is emitted,
+ * and no 8bpp raster is built: one row of classes is packed into the bitmap
+ * by mono_render_row() as soon as it is complete.
+ */
+static int
+mono_lzw_decode_image(GifFileType *gif, const MonoGifInfo *info,
+  const MonoGifFrameInfo *frame_info, bool interlace, uint8_t *bitmap,
+  const uint32_t *bw_bit_cache, int transparent_index)
+{
+    static const unsigned int interlaced_offset[] = { 0, 4, 2, 1 };
+    static const unsigned int interlaced_jump[] = { 8, 8, 4, 2 };
+    uint16_t prefix[LZW_MAX_CODES];
+    uint8_t suffix[LZW_MAX_CODES];
+    uint8_t stack[LZW_MAX_CODES];
+    uint32_t class_cache[3], class_opaque_cache[3];
+    const uint32_t *class_opaque;
+    MonoRowTable row_table;
+    const MonoRowTable *table;
+    MonoLzwInput in;
+    GifByteType *row;
+    unsigned int width, height, rows_done, pass, y, x;
+    unsigned int min_code_size, code_size, clear_code, eoi_code, next_code;
+    unsigned int i;
+    int prev_code, code, class_transparent, rv;
+    uint8_t first;
+
+    width = frame_info->update_width;
+    height = frame_info->update_height;
+    if (width == 0 || height == 0)
+        return mono_gif_skip_image(gif);
+
+    in.gif = gif;
+    in.block_pos = 1;
+    in.bits = 0;
+    in.bit_count = 0;
+    if (DGifGetCode(gif, &code, &in.block) == GIF_ERROR)
+        return GIF_ERROR;
+    if (code < 1 || code > 8) {
+        gif->Error = D_GIF_ERR_IMAGE_DEFECT;
+        return GIF_ERROR;
+    }
+    min_code_size = (unsigned int)code;
+    clear_code = 1U << min_code_size;
+    eoi_code = clear_code + 1U;
+
+    class_transparent = NO_TRANSPARENT_COLOR;
+    for (i = 0; i < clear_code; i++) {
+        if ((int)i == transparent_index) {
+            suffix[i] = MONO_CLASS_TRANSPARENT;
+            class_transparent = MONO_CLASS_TRANSPARENT;
+        } else {
+            suffix[i] = bw_bit_cache[i] != 0 ?
+              MONO_CLASS_WHITE : MONO_CLASS_BLACK;
+        }
+        prefix[i] = 0;
+    }
+    class_cache[MONO_CLASS_BLACK] = 0;
+    class_cache[MONO_CLASS_WHITE] = MONO_WHITE_BIT;
+    class_cache[MONO_CLASS_TRANSPARENT] = 0;
+    class_opaque = mono_opaque_cache(class_opaque_cache, 3,
+      class_transparent);
+    table = mono_simd_table(&row_table, class_cache, 3);
+
+    row = malloc(width);
+    if (row == NULL) {
+        gif->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
+    }
+
+    rv = GIF_ERROR;
+    code_size = min_code_size + 1U;
+    next_code = eoi_code + 1U;
+    prev_code = -1;
+    first = 0;
+    rows_done = 0;
+    pass = 0;
+    y = 0;
+    x = 0;
+
+    while (rows_done < height) {
+        unsigned int sp, cur;
+
+        code = mono_lzw_read_code(&in, code_size);
+        if (code < 0)
+            goto out;
+        if ((unsigned int)code == clear_code) {
+            code_size = min_code_size + 1U;
+            next_code = eoi_code + 1U;
+            prev_code = -1;
+            continue;
+        }
+        if ((unsigned int)code == eoi_code ||
+          (unsigned int)code > next_code ||
+          (prev_code == -1 && (unsigned int)code >= clear_code)) {
+            gif->Error = D_GIF_ERR_IMAGE_DEFECT;
+            goto out;
+        }
+
+        /* Push the string for code in reverse order. */
+        sp = 0;
+        cur = (unsigned int)code;
+        if (prev_code != -1 && cur == next_code) {
+            stack[sp++] = first;
+            cur = (unsigned int)prev_code;
+        }
+        while (cur >= clear_code) {
+            stack[sp++] = suffix[cur];
+            cur = prefix[cur];
+        }
+        stack[sp++] = suffix[cur];
+        first = suffix[cur];
+
+        if (prev_code != -1 && next_code < LZW_MAX_CODES) {
+            prefix[next_code] = (uint16_t)prev_code;
+            suffix[next_code] = first;
+            next_code++;
+            if (next_code == (1U << code_size) && code_size < LZW_MAX_BITS)
+                code_size++;
+        }
+        prev_code = code;
+
+        while (sp > 0) {
+            row[x++] = stack[--sp];
+            if (x < width)
+                continue;
+
+            mono_pack_class_row(bitmap +
+              (size_t)(frame_info->update_top + y) * info->line_bytes,
+              frame_info->update_left, row, width,
+              class_cache, class_opaque, table, class_transparent);
+            x = 0;
+            if (++rows_done == height)
+                break;
+            if (interlace) {
+                y += interlaced_jump[pass];
+                while (y >= height && pass < 3) {
+                    pass++;
+                    y = interlaced_offset[pass];
+                }
+            } else {
+                y++;
+            }
+        }
+    }
+
+    /* Skip the end code and any trailing sub-blocks. */
+    while (in.block != NULL) {
+        if (DGifGetCodeNext(gif, &in.block) == GIF_ERROR)
+            goto out;
+    }
+    rv = GIF_OK;
+
+out:
+    free(row);
+    return rv;
+}
+#endif /* FUSED_LZW_DECODE */
+
+/*
+ * Decode the next GIF image and render it into bitmap as
+ * mono_render_frame() does.  *frame receives the image index, or -1 at the
+ * end of the stream.  On a GIFLIB failure, -1 is returned with gif->Error
+ * set and errno 0.
+ *
+ * With FUSED_LZW_DECODE, the image data is decoded by mono_lzw_decode_image()
+ * directly into the bitmap; otherwise GIFLIB decodes the frame into a
+ * temporary 8bpp raster first.
+ */
+int
+mono_gif_decode_frame(GifFileType *gif, const MonoGifInfo *info,
+  uint8_t *bitmap, const uint8_t *previous, MonoGifFrameInfo *frame_info,
+  int *frame)
+{
+#ifdef FUSED_LZW_DECODE
+    GifRecordType record_type;
+    ExtensionBlock *blocks;
+    int block_count;
+
+    *frame = -1;
+    blocks = NULL;
+    block_count = 0;
+
+    for (;;) {
+        if (DGifGetRecordType(gif, &record_type) == GIF_ERROR)
+            goto gif_fail;
+
+        switch (record_type) {
+        case IMAGE_DESC_RECORD_TYPE: {
+            SavedImage *img;
+            uint32_t bw_bit_cache[256];
+            int transparent_index;
+            int rv;
+
+            if (DGifGetImageDesc(gif) == GIF_ERROR)
+                goto gif_fail;
+            *frame = gif->ImageCount - 1;
+            img = &gif->SavedImages[*frame];
+            img->ExtensionBlockCount = block_count;
+            img->ExtensionBlocks = blocks;
+
+            if (mono_frame_begin(gif, info, *frame, bitmap, previous,
+              frame_info, bw_bit_cache, &transparent_index) == -1)
+                return -1;
+            rv = mono_lzw_decode_image(gif, info, frame_info,
+              img->ImageDesc.Interlace, bitmap, bw_bit_cache,
+              transparent_index);
+            mono_release_saved_image(img);
+            if (rv == GIF_ERROR) {
+                errno = 0;
+                return -1;
+            }
+            return 0;
+        }
+        case EXTENSION_RECORD_TYPE:
+            if (mono_gif_read_extension(gif, &block_count,
+              &blocks) == GIF_ERROR)
+                goto gif_fail;
+            break;
+        case TERMINATE_RECORD_TYPE:
+            GifFreeExtensions(&block_count, &blocks);
+            return 0;
+        default:
+            break;
+        }
+    }
+
+gif_fail:
+    GifFreeExtensions(&block_count, &blocks);
+    errno = 0;
+    return -1;
+#else
+    int rv;
+
+    if (mono_gif_read_frame(gif, frame) == GIF_ERROR) {
+        errno = 0;
+        return -1;
+    }
+    if (*frame < 0)
+        return 0;
+    rv = mono_render_frame(gif, info, *frame, bitmap, previous, frame_info);
+    mono_release_saved_image(&gif->SavedImages[*frame]);
+    return rv;
+#endif
+}
+
+#ifdef THREADED_RENDER
+/*
+ * Frame offset index.  The file is mapped whole and its blocks are walked
+ * by their lengths without decoding any LZW data, recording where the
+ * records of each frame start, so that every frame can be decoded on its
+ * own GIFLIB handle reading from there.
+ */
+#define MONO_INDEX_MAGIC        "MGIX"
+#define MONO_INDEX_VERSION      1U
+#define MONO_INDEX_HEADER       28U
+
+static void
+mono_put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t
+mono_get_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+      (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+void
+mono_gif_index_init(MonoGifIndex *index)
+{
+    memset(index, 0, sizeof(*index));
+}
+
+/* Skip the data sub-blocks at *pos, including the terminating block. */
+static int
+mono_index_skip_blocks(const MonoGifIndex *index, size_t *pos)
+{
+    while (*pos < index->size && index->data[*pos] != 0)
+        *pos += (size_t)index->data[*pos] + 1U;
+    if (*pos >= index->size)
+        return -1;
+    (*pos)++;
+    return 0;
+}
+
+static int
+mono_index_add(MonoGifIndex *index, size_t offset, int *capacity)
+{
+    size_t *offsets;
+
+    if (index->frame_count == *capacity) {
+        if (*capacity > INT_MAX / 2) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+        *capacity = *capacity != 0 ? *capacity * 2 : 64;
+        offsets = realloc(index->offsets,
+          (size_t)*capacity * sizeof(*offsets));
+        if (offsets == NULL)
+            return -1;
+        index->offsets = offsets;
+    }
+    index->offsets[index->frame_count++] = offset;
+    return 0;
+}
+
+static int
+mono_index_scan(MonoGifIndex *index)
+{
+    const uint8_t *data = index->data;
+    size_t pos, start;
+    int capacity;
+
+    capacity = 0;
+    if (index->size < 13U || memcmp(data, "GIF", 3) != 0)
+        goto invalid;
+    pos = 13U;
+    if ((data[10] & 0x80U) != 0)
+        pos += 3U * (2U << (data[10] & 7U));
+    for (start = pos; pos < index->size; ) {
+        switch (data[pos]) {
+        case 0x21:      /* extension introducer and label */
+            pos += 2U;
+            if (mono_index_skip_blocks(index, &pos) == -1)
+                goto invalid;
+            break;
+        case 0x2c:      /* image descriptor */
+            if (index->size - pos < 11U)
+                goto invalid;
+            if ((data[pos + 9U] & 0x80U) != 0)
+                pos += 3U * (2U << (data[pos + 9U] & 7U));
+            /* The descriptor is followed by the LZW minimum code size. */
+            pos += 11U;
+            if (mono_index_skip_blocks(index, &pos) == -1)
+                goto invalid;
+            if (mono_index_add(index, start, &capacity) == -1)
+                return -1;
+            start = pos;
+            break;
+        case 0x3b:      /* trailer */
+            if (index->frame_count == 0)
+                goto invalid;
+            return 0;
+        default:
+            goto invalid;
+        }
+    }
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/* Read an index saved by mono_gif_index_save() if it is up to date. */
+static int
+mono_index_load(MonoGifIndex *index, const char *sidecar)
+{
+    struct stat st;
+    uint8_t header[MONO_INDEX_HEADER];
+    uint8_t *entries;
+    uint32_t count, i;
+    size_t offset;
+    ssize_t n;
+    int fd;
+
+    fd = open(sidecar, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    entries = NULL;
+    if (fstat(fd, &st) == -1 ||
+      read(fd, header, sizeof(header)) != (ssize_t)sizeof(header))
+        goto fail;
+    count = mono_get_be32(header + 24);
+    if (memcmp(header, MONO_INDEX_MAGIC, 4) != 0 ||
+      mono_get_be32(header + 4) != MONO_INDEX_VERSION ||
+      mono_get_be32(header + 8) != 0 ||
+      mono_get_be32(header + 12) != index->size ||
+      mono_get_be32(header + 16) != (uint32_t)(index->mtime >> 32) ||
+      mono_get_be32(header + 20) != (uint32_t)index->mtime ||
+      count == 0 || count > INT_MAX ||
+      (uint64_t)st.st_size != MONO_INDEX_HEADER + (uint64_t)count * 4U)
+        goto fail;
+    entries = malloc((size_t)count * 4U);
+    index->offsets = calloc(count, sizeof(*index->offsets));
+    if (entries == NULL || index->offsets == NULL)
+        goto fail;
+    n = read(fd, entries, (size_t)count * 4U);
+    if (n != (ssize_t)count * 4)
+        goto fail;
+    /* Each frame must start at a record after the previous one. */
+    for (i = 0; i < count; i++) {
+        offset = mono_get_be32(entries + (size_t)i * 4U);
+        if (offset < 13U || offset >= index->size ||
+          (i > 0 && offset <= index->offsets[i - 1]) ||
+          (index->data[offset] != 0x21 && index->data[offset] != 0x2c))
+            goto fail;
+        index->offsets[i] = offset;
+    }
+    index->frame_count = (int)count;
+    free(entries);
+    (void)close(fd);
+    return 0;
+
+fail:
+    free(entries);
+    free(index->offsets);
+    index->offsets = NULL;
+    (void)close(fd);
+    return -1;
+}
+
+/*
+ * Map path and index its frames.  If sidecar is not NULL, an index saved
+ * there for the same file size and modification time is used instead of
+ * walking the file, and from_sidecar is set.
+ */
+int
+mono_gif_index_open(MonoGifIndex *index, const char *path,
+  const char *sidecar)
+{
+    struct stat st;
+    void *data;
+    int fd, saved_errno;
+
+    mono_gif_index_init(index);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1) {
+        saved_errno = errno;
+        (void)close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    if (st.st_size < 13 || (uint64_t)st.st_size > UINT32_MAX) {
+        (void)close(fd);
+        errno = st.st_size < 13 ? EINVAL : EFBIG;
+        return -1;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    saved_errno = errno;
+    (void)close(fd);
+    if (data == MAP_FAILED) {
+        errno = saved_errno;
+        return -1;
+    }
+    index->data = data;
+    index->size = (size_t)st.st_size;
+    index->mtime = (int64_t)st.st_mtime;
+
+    if (sidecar != NULL && mono_index_load(index, sidecar) == 0) {
+        index->from_sidecar = true;
+        return 0;
+    }
+    if (mono_index_scan(index) == -1) {
+        saved_errno = errno;
+        mono_gif_index_close(index);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Save the index to sidecar for later mono_gif_index_open() calls.  It is
+ * written under a temporary name and renamed into place.
+ */
+int
+mono_gif_index_save(const MonoGifIndex *index, const char *sidecar)
+{
+    char *temp;
+    uint8_t *buf;
+    size_t size;
+    int fd, i, len, saved_errno;
+
+    size = MONO_INDEX_HEADER + (size_t)index->frame_count * 4U;
+    len = snprintf(NULL, 0, "%s.%ld", sidecar, (long)getpid());
+    if (len < 0)
+        return -1;
+    temp = malloc((size_t)len + 1);
+    buf = malloc(size);
+    if (temp == NULL || buf == NULL) {
+        free(temp);
+        free(buf);
+        return -1;
+    }
+    (void)snprintf(temp, (size_t)len + 1, "%s.%ld", sidecar, (long)getpid());
+
+    memcpy(buf, MONO_INDEX_MAGIC, 4);
+    mono_put_be32(buf + 4, MONO_INDEX_VERSION);
+    mono_put_be32(buf + 8, 0);
+    mono_put_be32(buf + 12, (uint32_t)index->size);
+    mono_put_be32(buf + 16, (uint32_t)(index->mtime >> 32));
+    mono_put_be32(buf + 20, (uint32_t)index->mtime);
+    mono_put_be32(buf + 24, (uint32_t)index->frame_count);
+    for (i = 0; i < index->frame_count; i++)
+        mono_put_be32(buf + MONO_INDEX_HEADER + (size_t)i * 4U,
+          (uint32_t)index->offsets[i]);
+
+    fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd == -1)
+        goto fail;
+    if (write(fd, buf, size) != (ssize_t)size) {
+        if (errno == 0)
+            errno = EIO;
+        (void)close(fd);
+        goto unlink;
+    }
+    if (close(fd) == -1 || rename(temp, sidecar) == -1)
+        goto unlink;
+    free(temp);
+    free(buf);
+    return 0;
+
+unlink:
+    saved_errno = errno;
+    (void)unlink(temp);
+    errno = saved_errno;
+fail:
+    saved_errno = errno;
+    free(temp);
+    free(buf);
+    errno = saved_errno;
+    return -1;
+}
+
+void
+mono_gif_index_close(MonoGifIndex *index)
+{
+    if (index->data != NULL)
+        (void)munmap((void *)(uintptr_t)index->data, index->size);
+    free(index->offsets);
+    mono_gif_index_init(index);
+}
+
+/* GIFLIB input function reading a mapped file from pos. */
+typedef struct {
+    const MonoGifIndex *index;
+    size_t pos;
+} MonoIndexReader;
+
+static int
+mono_index_read(GifFileType *gif, GifByteType *buf, int len)
+{
+    MonoIndexReader *reader = gif->UserData;
+    size_t n;
+
+    n = reader->index->size - reader->pos;
+    if (len >= 0 && (size_t)len < n)
+        n = (size_t)len;
+    memcpy(buf, reader->index->data + reader->pos, n);
+    reader->pos += n;
+    return (int)n;
+}
+
+/*
+ * Threaded rendering of a whole GIF for multi-core hosts.  Each frame is
+ * first decoded and rendered on its own into a layer: its pixels over a
+ * cleared screen plus a mask of the pixels it draws, or just the complete
+ * image for a frame that covers the screen without transparency.  Such
+ * frames start segments whose later frames are then composited over their
+ * predecessors in order, one segment at a time on each thread.  Both
+ * passes take the next frame or segment from a shared counter.
+ */
+typedef struct {
+    const MonoGifIndex *index;
+    const MonoGifInfo *info;
+    uint8_t *const *bitmaps;
+    MonoGifFrameInfo *frame_infos;
+    uint8_t **masks;
+    int *segments;
+    int segment_count;
+    pthread_mutex_t lock;
+    int next;
+    int error;
+    int gif_error;
+} MonoRenderJob;
+
+/* On a GIFLIB failure, -1 is returned with *gif_error set and errno 0. */
+static int
+mono_render_layer(MonoRenderJob *job, int frame, int *gif_error)
+{
+    const MonoGifInfo *info = job->info;
+    MonoGifFrameInfo *frame_info = &job->frame_infos[frame];
+    MonoIndexReader reader;
+    GifFileType *gif;
+    const SavedImage *img;
+    uint8_t *bitmap = job->bitmaps[frame];
+    uint32_t bw_bit_cache[256], mask_bit_cache[256];
+    int transparent_index, image, saved_errno;
+    unsigned int ci;
+
+    /* Each frame has its own handle, which reads the header first. */
+    reader.index = job->index;
+    reader.pos = 0;
+    gif = DGifOpen(&reader, mono_index_read, gif_error);
+    if (gif == NULL) {
+        errno = 0;
+        return -1;
+    }
+    reader.pos = job->index->offsets[frame];
+    if (mono_gif_read_frame(gif, &image) == GIF_ERROR || image != 0) {
+        *gif_error = gif->Error != D_GIF_SUCCEEDED ? gif->Error :
+          D_GIF_ERR_WRONG_RECORD;
+        errno = 0;
+        goto fail;
+    }
+
+    if (mono_frame_begin(gif, info, image, bitmap, NULL, frame_info,
+      bw_bit_cache, &transparent_index) == -1)
+        goto fail;
+    img = &gif->SavedImages[image];
+    if (frame_info->update_width != 0 && frame_info->update_height != 0 &&
+      img->RasterBits == NULL) {
+        errno = EINVAL;
+        goto fail;
+    }
+    mono_render_rows(bitmap + (size_t)frame_info->update_top *
+      info->line_bytes, info->line_bytes, img, frame_info, bw_bit_cache,
+      transparent_index);
+
+    /* mono_frame_begin() left the screen as is for covering frames. */
+    if (transparent_index != NO_TRANSPARENT_COLOR ||
+      frame_info->update_left != 0 || frame_info->update_top != 0 ||
+      frame_info->update_width != info->width ||
+      frame_info->update_height != info->height) {
+        job->masks[frame] = calloc(frame_info->update_height != 0 ?
+          frame_info->update_height : 1U, info->line_bytes);
+        if (job->masks[frame] == NULL)
+            goto fail;
+        for (ci = 0; ci < 256; ci++)
+            mask_bit_cache[ci] = MONO_WHITE_BIT;
+        mono_render_rows(job->masks[frame], info->line_bytes, img,
+          frame_info, mask_bit_cache, transparent_index);
+    }
+    (void)DGifCloseFile(gif, NULL);
+    return 0;
+
+fail:
+    saved_errno = errno;
+    (void)DGifCloseFile(gif, NULL);
+    errno = saved_errno;
+    return -1;
+}
+
+static void
+mono_composite_layer(const MonoGifInfo *info, uint8_t *bitmap,
+  const uint8_t *previous, const MonoGifFrameInfo *frame_info,
+  const uint8_t *mask)
+{
+    size_t top, end, i;
+
+    top = (size_t)frame_info->update_top * info->line_bytes;
+    end = top + (size_t)frame_info->update_height * info->line_bytes;
+    memcpy(bitmap, previous, top);
+    for (i = top; i < end; i++)
+        bitmap[i] |= previous[i] & (uint8_t)~mask[i - top];
+    memcpy(bitmap + end, previous + end, info->frame_bytes - end);
+}
+
+static int
+mono_render_take(MonoRenderJob *job)
+{
+    int n;
+
+    (void)pthread_mutex_lock(&job->lock);
+    n = job->error == 0 && job->gif_error == 0 ? job->next++ : INT_MAX;
+    (void)pthread_mutex_unlock(&job->lock);
+    return n;
+}
+
+static void *
+mono_render_layers(void *arg)
+{
+    MonoRenderJob *job = arg;
+    int frame, gif_error;
+
+    while ((frame = mono_render_take(job)) < job->info->frame_count) {
+        gif_error = D_GIF_SUCCEEDED;
+        if (mono_render_layer(job, frame, &gif_error) == -1) {
+            (void)pthread_mutex_lock(&job->lock);
+            if (job->error == 0 && job->gif_error == 0) {
+                if (errno != 0)
+                    job->error = errno;
+                else
+                    job->gif_error = gif_error != D_GIF_SUCCEEDED ?
+                      gif_error : D_GIF_ERR_READ_FAILED;
+            }
+            (void)pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return NULL;
+}
+
+static void *
+mono_render_segments(void *arg)
+{
+    MonoRenderJob *job = arg;
+    int segment, frame, end;
+
+    while ((segment = mono_render_take(job)) < job->segment_count) {
+        end = segment + 1 < job->segment_count ?
+          job->segments[segment + 1] : job->info->frame_count;
+        for (frame = job->segments[segment] + 1; frame < end; frame++) {
+            mono_composite_layer(job->info, job->bitmaps[frame],
+              job->bitmaps[frame - 1], &job->frame_infos[frame],
+              job->masks[frame]);
+        }
+    }
+    return NULL;
+}
+
+static int
+mono_render_run(MonoRenderJob *job, void *(*worker)(void *), int threads)
+{
+    pthread_t *tids;
+    int i, started;
+
+    tids = calloc((size_t)threads, sizeof(*tids));
+    if (tids == NULL)
+        return -1;
+    job->next = 0;
+    /* The calling thread works too, so one thread less is started. */
+    for (started = 0; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, worker, job) != 0)
+            break;
+    }
+    (void)worker(job);
+    for (i = 0; i < started; i++)
+        (void)pthread_join(tids[i], NULL);
+    free(tids);
+    return 0;
+}
+
+/*
+ * Decode and render every frame of an indexed GIF into bitmaps[frame] as
+ * mono_render_frame() would, using up to threads threads.  On a GIFLIB
+ * error, -1 is returned with index->error set and errno 0.
+ */
+int
+mono_gif_render_frames(MonoGifIndex *index, const MonoGifInfo *info,
+  uint8_t *const *bitmaps, MonoGifFrameInfo *frame_infos, int threads)
+{
+    MonoRenderJob job;
+    int i, saved_errno;
+    int rv;
+
+    if (index->frame_count < info->frame_count) {
+        index->error = D_GIF_ERR_WRONG_RECORD;
+        errno = 0;
+        return -1;
+    }
+    memset(&job, 0, sizeof(job));
+    job.index = index;
+    job.info = info;
+    job.bitmaps = bitmaps;
+    job.frame_infos = frame_infos;
+    rv = -1;
+    job.masks = calloc((size_t)info->frame_count, sizeof(*job.masks));
+    job.segments = calloc((size_t)info->frame_count, sizeof(*job.segments));
+    if (job.masks == NULL || job.segments == NULL)
+        goto done;
+    if (pthread_mutex_init(&job.lock, NULL) != 0) {
+        errno = ENOMEM;
+        goto done;
+    }
+
+    if (mono_render_run(&job, mono_render_layers, threads) == -1)
+        goto unlock;
+    for (i = 0; i < info->frame_count; i++) {
+        if (i == 0 || job.masks[i] == NULL)
+            job.segments[job.segment_count++] = i;
+    }
+    if (job.error == 0 && job.gif_error == 0 &&
+      mono_render_run(&job, mono_render_segments, threads) == -1)
+        goto unlock;
+    if (job.gif_error != 0) {
+        index->error = job.gif_error;
+        errno = 0;
+    } else if (job.error != 0)
+        errno = job.error;
+    else
+        rv = 0;
+
+unlock:
+    (void)pthread_mutex_destroy(&job.lock);
+done:
+    saved_errno = errno;
+    if (job.masks != NULL) {
+        for (i = 0; i < info->frame_count; i++)
+            free(job.masks[i]);
+    }
+    free(job.masks);
+    free(job.segments);
+    errno = saved_errno;
+    return rv;
+}
+#endif /* THREADED_RENDER */
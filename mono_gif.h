@@ -0,0 +1,74 @@
+#ifndef MONO_GIF_H
+#define MONO_GIF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gif_lib.h>
+
+/*
+ * GIF-to-monochrome data shared by the display backends and the conversion
+ * commands.  It contains no display-backend resources.
+ */
+typedef struct {
+    unsigned int width;
+    unsigned int height;
+    size_t line_bytes;
+    size_t frame_bytes;
+    int frame_count;
+} MonoGifInfo;
+
+/*
+ * Per-frame metadata produced by the backend-independent GIF renderer.
+ * update_* preserves the original GIF image rectangle even though a backend
+ * may keep a complete composited logical-screen bitmap.
+ */
+typedef struct {
+    uint32_t delay;
+    uint16_t update_left;
+    uint16_t update_top;
+    uint16_t update_width;
+    uint16_t update_height;
+} MonoGifFrameInfo;
+
+int mono_gif_info_init(MonoGifInfo *info, unsigned int width,
+    unsigned int height, int frame_count);
+
+int mono_render_frame(GifFileType *gif, const MonoGifInfo *info, int frame,
+    uint8_t *bitmap, const uint8_t *previous, MonoGifFrameInfo *frame_info);
+void mono_release_saved_image(SavedImage *img);
+
+int mono_gif_scan_frames(GifFileType *gif);
+uint32_t mono_gif_frame_delay(const SavedImage *img);
+int mono_gif_read_frame(GifFileType *gif, int *frame);
+int mono_gif_decode_frame(GifFileType *gif, const MonoGifInfo *info,
+    uint8_t *bitmap, const uint8_t *previous, MonoGifFrameInfo *frame_info,
+    int *frame);
+
+/*
+ * Offsets of the records of each frame in a GIF file mapped at data, as
+ * found by mono_gif_index_open() or read back from a sidecar file.  error
+ * holds the GIFLIB error of a failed mono_gif_render_frames().
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    int64_t mtime;
+    size_t *offsets;
+    int frame_count;
+    bool from_sidecar;
+    int error;
+} MonoGifIndex;
+
+#ifdef THREADED_RENDER
+void mono_gif_index_init(MonoGifIndex *index);
+int mono_gif_index_open(MonoGifIndex *index, const char *path,
+    const char *sidecar);
+int mono_gif_index_save(const MonoGifIndex *index, const char *sidecar);
+void mono_gif_index_close(MonoGifIndex *index);
+int mono_gif_render_frames(MonoGifIndex *index, const MonoGifInfo *info,
+    uint8_t *const *bitmaps, MonoGifFrameInfo *frame_infos, int threads);
+#endif
+
+#endif /* MONO_GIF_H */
@@ -0,0 +1,489 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "monoanim_format.h"
+
+static const uint8_t monoanim_magic[8] = {
+    'M', 'O', 'N', 'O', 'A', 'N', '\r', '\n'
+};
+
+static void
+put_be16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static void
+put_be32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static uint16_t
+get_be16(const uint8_t *p)
+{
+    return (uint16_t)(((uint16_t)p[0] << 8) | p[1]);
+}
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) |
+      ((uint32_t)p[1] << 16) |
+      ((uint32_t)p[2] << 8) |
+      (uint32_t)p[3];
+}
+
+static int
+read_full(int fd, void *buffer, size_t size)
+{
+    uint8_t *p = buffer;
+
+    while (size != 0) {
+        ssize_t n = read(fd, p, size);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        p += (size_t)n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+static int
+write_full(int fd, const void *buffer, size_t size)
+{
+    const uint8_t *p = buffer;
+
+    while (size != 0) {
+        ssize_t n = write(fd, p, size);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        p += (size_t)n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+static int
+monoanim_info_validate(const MonoAnimInfo *info)
+{
+    MonoAnimInfo expected;
+
+    if (info == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (monoanim_info_init(&expected, info->width, info->height,
+      info->frame_count, info->flags, info->pool_size) == -1)
+        return -1;
+    if (info->depth != expected.depth ||
+      info->pixel_format != expected.pixel_format ||
+      info->line_bytes != expected.line_bytes ||
+      info->frame_bytes != expected.frame_bytes ||
+      info->table_offset != expected.table_offset ||
+      info->pool_offset != expected.pool_offset) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void
+monoanim_reader_init(MonoAnimReader *reader)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+}
+
+void
+monoanim_reader_close(MonoAnimReader *reader)
+{
+    if (reader->fd != -1) {
+        (void)close(reader->fd);
+        reader->fd = -1;
+    }
+    memset(&reader->info, 0, sizeof(reader->info));
+    reader->next_frame = 0;
+}
+
+int
+monoanim_info_init(MonoAnimInfo *info, unsigned int width,
+  unsigned int height, uint32_t frame_count, uint16_t flags,
+  uint32_t pool_size)
+{
+    uint64_t line_bytes;
+    uint64_t frame_bytes;
+    uint64_t entries;
+    uint64_t pool_offset;
+
+    if (info == NULL || width == 0 || height == 0 ||
+      width > UINT16_MAX || height > UINT16_MAX ||
+      frame_count == 0 || pool_size == 0 ||
+      (flags & ~MONOANIM_FLAG_LOOP_FRAME) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    line_bytes = ((uint64_t)width + 7U) / 8U;
+    frame_bytes = line_bytes * height;
+    entries = (uint64_t)frame_count +
+      ((flags & MONOANIM_FLAG_LOOP_FRAME) != 0 ? 1U : 0U);
+    pool_offset = MONOANIM_HEADER_SIZE + entries * MONOANIM_FRAME_SIZE;
+    pool_offset = (pool_offset + MONOANIM_POOL_ALIGN - 1U) /
+      MONOANIM_POOL_ALIGN * MONOANIM_POOL_ALIGN;
+    if (frame_bytes > UINT32_MAX || pool_offset > UINT32_MAX ||
+      pool_offset + pool_size > (uint64_t)UINT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    info->width = (uint16_t)width;
+    info->height = (uint16_t)height;
+    info->depth = 1;
+    info->pixel_format = MONOANIM_PIXEL_MSB_WHITE_ONE;
+    info->flags = flags;
+    info->line_bytes = (uint32_t)line_bytes;
+    info->frame_bytes = (uint32_t)frame_bytes;
+    info->frame_count = frame_count;
+    info->table_offset = MONOANIM_HEADER_SIZE;
+    info->pool_offset = (uint32_t)pool_offset;
+    info->pool_size = pool_size;
+    return 0;
+}
+
+/* Number of frame table entries, including any loop frame. */
+uint32_t
+monoanim_table_entries(const MonoAnimInfo *info)
+{
+    return info->frame_count +
+      ((info->flags & MONOANIM_FLAG_LOOP_FRAME) != 0 ? 1U : 0U);
+}
+
+int
+monoanim_header_encode(uint8_t header[MONOANIM_HEADER_SIZE],
+  const MonoAnimInfo *info)
+{
+    if (header == NULL || monoanim_info_validate(info) == -1)
+        return -1;
+
+    memset(header, 0, MONOANIM_HEADER_SIZE);
+    memcpy(header, monoanim_magic, sizeof(monoanim_magic));
+    put_be16(header + 8, MONOANIM_VERSION);
+    put_be16(header + 10, MONOANIM_HEADER_SIZE);
+    put_be16(header + 12, info->width);
+    put_be16(header + 14, info->height);
+    put_be16(header + 16, info->depth);
+    put_be16(header + 18, info->pixel_format);
+    put_be32(header + 20, info->line_bytes);
+    put_be32(header + 24, info->frame_bytes);
+    put_be32(header + 28, info->frame_count);
+    put_be16(header + 32, MONOANIM_FRAME_SIZE);
+    put_be16(header + 34, info->flags);
+    put_be32(header + 36, info->table_offset);
+    put_be32(header + 40, info->pool_offset);
+    put_be32(header + 44, info->pool_size);
+    return 0;
+}
+
+int
+monoanim_header_decode(const uint8_t header[MONOANIM_HEADER_SIZE],
+  MonoAnimInfo *info)
+{
+    MonoAnimInfo decoded;
+
+    if (header == NULL || info == NULL ||
+      memcmp(header, monoanim_magic, sizeof(monoanim_magic)) != 0 ||
+      get_be16(header + 8) != MONOANIM_VERSION ||
+      get_be16(header + 10) != MONOANIM_HEADER_SIZE ||
+      get_be16(header + 32) != MONOANIM_FRAME_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    decoded.width = get_be16(header + 12);
+    decoded.height = get_be16(header + 14);
+    decoded.depth = get_be16(header + 16);
+    decoded.pixel_format = get_be16(header + 18);
+    decoded.flags = get_be16(header + 34);
+    decoded.line_bytes = get_be32(header + 20);
+    decoded.frame_bytes = get_be32(header + 24);
+    decoded.frame_count = get_be32(header + 28);
+    decoded.table_offset = get_be32(header + 36);
+    decoded.pool_offset = get_be32(header + 40);
+    decoded.pool_size = get_be32(header + 44);
+
+    if (monoanim_info_validate(&decoded) == -1)
+        return -1;
+
+    *info = decoded;
+    return 0;
+}
+
+void
+monoanim_frame_encode(uint8_t entry[MONOANIM_FRAME_SIZE],
+  const MonoAnimFrame *frame)
+{
+    memset(entry, 0, MONOANIM_FRAME_SIZE);
+    put_be32(entry + 0, frame->delay);
+    put_be16(entry + 4, frame->update_left);
+    put_be16(entry + 6, frame->update_top);
+    put_be16(entry + 8, frame->update_width);
+    put_be16(entry + 10, frame->update_height);
+    put_be32(entry + 12, frame->data_offset);
+    put_be32(entry + 16, frame->data_size);
+    put_be32(entry + 20, frame->line_bytes);
+    entry[24] = frame->format;
+    entry[25] = frame->flags;
+}
+
+void
+monoanim_frame_decode(const uint8_t entry[MONOANIM_FRAME_SIZE],
+  MonoAnimFrame *frame)
+{
+    frame->delay = get_be32(entry + 0);
+    frame->update_left = get_be16(entry + 4);
+    frame->update_top = get_be16(entry + 6);
+    frame->update_width = get_be16(entry + 8);
+    frame->update_height = get_be16(entry + 10);
+    frame->data_offset = get_be32(entry + 12);
+    frame->data_size = get_be32(entry + 16);
+    frame->line_bytes = get_be32(entry + 20);
+    frame->format = entry[24];
+    frame->flags = entry[25];
+}
+
+/*
+ * Return 1 if path starts with the container magic, 0 if it does not (for
+ * example a GIF file), or -1 if the file cannot be read.
+ */
+int
+monoanim_probe(const char *path)
+{
+    uint8_t magic[sizeof(monoanim_magic)];
+    ssize_t n;
+    int fd;
+
+    if (path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    do {
+        n = read(fd, magic, sizeof(magic));
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        int saved_errno = errno;
+
+        (void)close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    (void)close(fd);
+
+    return (size_t)n == sizeof(magic) &&
+      memcmp(magic, monoanim_magic, sizeof(magic)) == 0 ? 1 : 0;
+}
+
+int
+monoanim_reader_open(const char *path, MonoAnimReader *reader)
+{
+    uint8_t header[MONOANIM_HEADER_SIZE];
+    struct stat st;
+    uint64_t expected_size;
+    int fd;
+
+    if (path == NULL || reader == NULL || reader->fd != -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (fstat(fd, &st) == -1) {
+        int saved_errno = errno;
+
+        (void)close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        (void)close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (read_full(fd, header, sizeof(header)) == -1) {
+        int saved_errno = errno;
+
+        (void)close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    if (monoanim_header_decode(header, &reader->info) == -1) {
+        int saved_errno = errno;
+
+        (void)close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    expected_size = (uint64_t)reader->info.pool_offset +
+      reader->info.pool_size;
+    if (st.st_size < 0 || (uint64_t)st.st_size != expected_size) {
+        (void)close(fd);
+        memset(&reader->info, 0, sizeof(reader->info));
+        errno = EINVAL;
+        return -1;
+    }
+
+    reader->fd = fd;
+    reader->next_frame = 0;
+    return 0;
+}
+
+int
+monoanim_reader_read_frame(MonoAnimReader *reader, MonoAnimFrame *frame)
+{
+    uint8_t entry[MONOANIM_FRAME_SIZE];
+
+    if (reader == NULL || reader->fd == -1 || frame == NULL ||
+      reader->next_frame >= monoanim_table_entries(&reader->info)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (read_full(reader->fd, entry, sizeof(entry)) == -1)
+        return -1;
+    monoanim_frame_decode(entry, frame);
+    reader->next_frame++;
+    return 0;
+}
+
+/*
+ * Read size bytes of the frame pool from offset, without moving the file
+ * position used for the frame table.
+ */
+int
+monoanim_reader_read_pool(MonoAnimReader *reader, void *buffer,
+  size_t offset, size_t size)
+{
+    uint8_t *p = buffer;
+    off_t position;
+
+    if (reader == NULL || reader->fd == -1 ||
+      offset > reader->info.pool_size ||
+      size > reader->info.pool_size - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    position = (off_t)reader->info.pool_offset + (off_t)offset;
+    while (size != 0) {
+        ssize_t n = pread(reader->fd, p, size, position);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        p += (size_t)n;
+        position += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+int
+monoanim_write_file(const char *path, const MonoAnimInfo *info,
+  const MonoAnimFrame *frames, const uint8_t *pool)
+{
+    uint8_t header[MONOANIM_HEADER_SIZE];
+    uint8_t entry[MONOANIM_FRAME_SIZE];
+    uint8_t padding[256];
+    size_t pad;
+    uint32_t i;
+    int fd;
+    int saved_errno;
+
+    if (path == NULL || frames == NULL || pool == NULL ||
+      monoanim_header_encode(header, info) == -1)
+        return -1;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd == -1)
+        return -1;
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (write_full(fd, header, sizeof(header)) == -1)
+        goto fail;
+    for (i = 0; i < monoanim_table_entries(info); i++) {
+        monoanim_frame_encode(entry, &frames[i]);
+        if (write_full(fd, entry, sizeof(entry)) == -1)
+            goto fail;
+    }
+
+    memset(padding, 0, sizeof(padding));
+    pad = info->pool_offset - info->table_offset -
+      (size_t)monoanim_table_entries(info) * MONOANIM_FRAME_SIZE;
+    while (pad != 0) {
+        size_t n = pad < sizeof(padding) ? pad : sizeof(padding);
+
+        if (write_full(fd, padding, n) == -1)
+            goto fail;
+        pad -= n;
+    }
+    if (write_full(fd, pool, info->pool_size) == -1)
+        goto fail;
+
+    if (close(fd) == -1) {
+        saved_errno = errno;
+        (void)unlink(path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+
+fail:
+    saved_errno = errno;
+    (void)close(fd);
+    (void)unlink(path);
+    errno = saved_errno;
+    return -1;
+}
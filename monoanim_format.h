@@ -0,0 +1,85 @@
+#ifndef MONOANIM_FORMAT_H
+#define MONOANIM_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MONOANIM_HEADER_SIZE 48U
+#define MONOANIM_FRAME_SIZE 32U
+#define MONOANIM_VERSION 1U
+#define MONOANIM_PIXEL_MSB_WHITE_ONE 1U
+#define MONOANIM_POOL_ALIGN 8192U
+
+/*
+ * Header flags.  With MONOANIM_FLAG_LOOP_FRAME, the frame table has one more
+ * entry after the frames: the change from the last frame back to the first,
+ * drawn in place of the first frame when playback loops.
+ */
+#define MONOANIM_FLAG_LOOP_FRAME 0x0001U
+
+/*
+ * Precompiled animation container.  The header and the frame table are
+ * big-endian; the frame pool follows at a MONOANIM_POOL_ALIGN boundary so
+ * that players can mmap it read-only without copying.
+ */
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint16_t depth;
+    uint16_t pixel_format;
+    uint16_t flags;
+    uint32_t line_bytes;
+    uint32_t frame_bytes;
+    uint32_t frame_count;
+    uint32_t table_offset;
+    uint32_t pool_offset;
+    uint32_t pool_size;
+} MonoAnimInfo;
+
+/* One frame table entry, mirroring the player's frame descriptor. */
+typedef struct {
+    uint32_t delay;
+    uint16_t update_left;
+    uint16_t update_top;
+    uint16_t update_width;
+    uint16_t update_height;
+    uint32_t data_offset;
+    uint32_t data_size;
+    uint32_t line_bytes;
+    uint8_t format;
+    uint8_t flags;
+} MonoAnimFrame;
+
+typedef struct {
+    MonoAnimInfo info;
+    int fd;
+    uint32_t next_frame;
+} MonoAnimReader;
+
+void monoanim_reader_init(MonoAnimReader *reader);
+void monoanim_reader_close(MonoAnimReader *reader);
+
+int monoanim_info_init(MonoAnimInfo *info, unsigned int width,
+    unsigned int height, uint32_t frame_count, uint16_t flags,
+    uint32_t pool_size);
+uint32_t monoanim_table_entries(const MonoAnimInfo *info);
+
+int monoanim_header_encode(uint8_t header[MONOANIM_HEADER_SIZE],
+    const MonoAnimInfo *info);
+int monoanim_header_decode(const uint8_t header[MONOANIM_HEADER_SIZE],
+    MonoAnimInfo *info);
+void monoanim_frame_encode(uint8_t entry[MONOANIM_FRAME_SIZE],
+    const MonoAnimFrame *frame);
+void monoanim_frame_decode(const uint8_t entry[MONOANIM_FRAME_SIZE],
+    MonoAnimFrame *frame);
+
+int monoanim_probe(const char *path);
+int monoanim_reader_open(const char *path, MonoAnimReader *reader);
+int monoanim_reader_read_frame(MonoAnimReader *reader, MonoAnimFrame *frame);
+int monoanim_reader_read_pool(MonoAnimReader *reader, void *buffer,
+    size_t offset, size_t size);
+
+int monoanim_write_file(const char *path, const MonoAnimInfo *info,
+    const MonoAnimFrame *frames, const uint8_t *pool);
+
+#endif /* MONOANIM_FORMAT_H */
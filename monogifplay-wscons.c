@@ -1,7 +1,8 @@
 /*
  * MonoGIFPlayer for NetBSD/luna68k wsdisplay dumb framebuffer.
  *
- * GIF decoding and monochrome conversion are derived from monogifplay.c.
+ * GIF decoding and monochrome conversion are in mono_gif.c, and the frame
+ * pool is built or mapped by wscons_anim.c.
  */
 #include <sys/types.h>
 #include <sys/ioctl.h>
@@ -14,6 +15,7 @@
 #include <err.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -26,98 +28,51 @@
 
 #include <gif_lib.h>
 
+#include "mono_gif.h"
+#include "monoanim_format.h"
 #include "monobg_format.h"
+#include "wscons_anim.h"
 
 #ifndef __NetBSD__
 #error "monogifplay-wscons is supported only on NetBSD"
 #endif
 
-#ifdef UNROLL_BITMAP_EXTRACT
-#include <sys/endian.h>
-
-/* Try to check endianness without autoconf etc. */
-#if defined(__BYTE_ORDER__) && \
-  defined(__ORDER_LITTLE_ENDIAN__) && defined(__ORDER_BIG_ENDIAN__)
-# define TARGET_LITTLE_ENDIAN (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
-# define TARGET_BIG_ENDIAN    (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
-#elif defined(_BYTE_ORDER) && \
-  defined(_LITTLE_ENDIAN) && defined(_BIG_ENDIAN)
-# define TARGET_LITTLE_ENDIAN (_BYTE_ORDER == _LITTLE_ENDIAN)
-# define TARGET_BIG_ENDIAN    (_BYTE_ORDER == _BIG_ENDIAN)
-#elif defined(BYTE_ORDER) && \
-  defined(LITTLE_ENDIAN) && defined(BIG_ENDIAN)
-# define TARGET_LITTLE_ENDIAN (BYTE_ORDER == LITTLE_ENDIAN)
-# define TARGET_BIG_ENDIAN    (BYTE_ORDER == BIG_ENDIAN)
-#else
-# error "Cannot determine endianness."
-#endif
-
-#ifndef bswap32
-#define bswap32(x) __builtin_bswap32(x)
-#endif
-#endif /* UNROLL_BITMAP_EXTRACT */
-
 #define DEF_FBDEV       "/dev/ttyE0"
-#define DEF_GIF_DELAY   75U
 #define LUNA_FB_OFFSET  8U
+#define CALIBRATE_NS    100000000U
+#define PREFETCH_FRAMES 4
 
-/*
- * GIF-to-monochrome data which can later be moved to a common module shared
- * with the X11 backend.  It contains no display-backend resources.
- */
 typedef struct {
-    unsigned int width;
-    unsigned int height;
-    size_t line_bytes;
-    size_t frame_bytes;
-    int frame_count;
-} MonoGifInfo;
+    unsigned int x;
+    unsigned int y;
+} DisplayPosition;
 
 /*
- * Per-frame metadata produced by the backend-independent GIF renderer.
- * update_* preserves the original GIF image rectangle even though the initial
- * wscons storage format keeps a complete composited logical-screen bitmap.
+ * Union of the update rectangles of frames that were composited into the
+ * shadow screen but not drawn, in byte columns and rows.  right is 0 while
+ * the rectangle is empty.
  */
 typedef struct {
-    uint32_t delay;
-    uint16_t update_left;
-    uint16_t update_top;
-    uint16_t update_width;
-    uint16_t update_height;
-} MonoGifFrameInfo;
-
-enum {
-    WSCONS_FRAME_FULL_1BPP = 0,
-    WSCONS_FRAME_PARTIAL_1BPP
-};
+    size_t left;
+    size_t right;
+    unsigned int top;
+    unsigned int bottom;
+} DirtyRect;
 
 /*
- * wscons-specific frame descriptor.  The first frame is a complete composited
- * logical-screen bitmap.  Later frames may store only the byte-aligned portion
- * covering the original GIF update rectangle.  Addresses are described by pool
- * offsets rather than inferred from the frame number.
+ * Playback position whose frame pool pages wait_until() advises on while
+ * idle: frame is the next frame to draw, on a pass after the first if
+ * looped.  pending is cleared once the advice has been given.  stream, if
+ * not NULL, is read ahead instead while filling is set.
  */
 typedef struct {
-    MonoGifFrameInfo gif;
-    size_t data_offset;
-    size_t data_size;
-    size_t line_bytes;
-    uint8_t format;
-    uint8_t flags;
-    uint16_t reserved;
-} WsconsFrame;
-
-typedef struct {
-    MonoGifInfo info;
-    WsconsFrame *frames;
-    uint8_t *bitmap_pool;
-    size_t bitmap_pool_size;
-} WsconsAnimation;
-
-typedef struct {
-    unsigned int x;
-    unsigned int y;
-} DisplayPosition;
+    const WsconsAnimation *animation;
+    WsconsStream *stream;
+    int frame;
+    bool looped;
+    bool pending;
+    bool filling;
+} PoolWindow;
 
 typedef struct {
     int fd;
@@ -144,15 +99,18 @@ typedef struct {
 } WsDisplay;
 
 static const char *progname;
+static int opt_calibrate;
 static int opt_center;
 static int opt_clear;
+static int opt_compress;
+static int opt_drop;
 static int opt_duration;
 static int opt_progress;
+static int opt_tiles;
 
 static uint32_t total_start_time;
 static uint32_t gifload_start_time;
 static uint32_t gifload_end_time;
-static uint32_t total_frame_time;
 static uint32_t tv_sec_start;
 
 static volatile sig_atomic_t stop_requested;
@@ -237,642 +195,6 @@ gettime_ms(void)
     return tv_sec * 1000U + (uint32_t)(ts.tv_nsec / 1000000L);
 }
 
-static int
-mono_gif_info_init(MonoGifInfo *info, unsigned int width,
-  unsigned int height, int frame_count)
-{
-    size_t line_bytes;
-    size_t frame_bytes;
-
-    if (width == 0 || height == 0 ||
-      width > UINT16_MAX || height > UINT16_MAX ||
-      frame_count <= 0) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    line_bytes = ((size_t)width + 7U) / 8U;
-    if (size_mul(line_bytes, height, &frame_bytes) == -1)
-        return -1;
-    if (frame_bytes == 0) {
-        errno = EOVERFLOW;
-        return -1;
-    }
-
-    info->width = width;
-    info->height = height;
-    info->line_bytes = line_bytes;
-    info->frame_bytes = frame_bytes;
-    info->frame_count = frame_count;
-    return 0;
-}
-
-static int
-wscons_frame_range_valid(const WsconsAnimation *animation,
-  const WsconsFrame *frame)
-{
-    if (animation == NULL || frame == NULL ||
-      animation->bitmap_pool == MAP_FAILED ||
-      frame->data_offset > animation->bitmap_pool_size ||
-      frame->data_size >
-      animation->bitmap_pool_size - frame->data_offset) {
-        errno = EINVAL;
-        return 0;
-    }
-
-    return 1;
-}
-
-static uint8_t *
-wscons_frame_data(WsconsAnimation *animation, WsconsFrame *frame)
-{
-    if (!wscons_frame_range_valid(animation, frame))
-        return NULL;
-
-    return animation->bitmap_pool + frame->data_offset;
-}
-
-static const uint8_t *
-wscons_frame_const_data(const WsconsAnimation *animation,
-  const WsconsFrame *frame)
-{
-    if (!wscons_frame_range_valid(animation, frame))
-        return NULL;
-
-    return animation->bitmap_pool + frame->data_offset;
-}
-
-static void
-wscons_animation_init(WsconsAnimation *animation)
-{
-    memset(animation, 0, sizeof(*animation));
-    animation->bitmap_pool = MAP_FAILED;
-}
-
-static int
-wscons_frame_layout(WsconsFrame *frame, const MonoGifInfo *info,
-  const GifImageDesc *desc, bool first_frame)
-{
-    unsigned int left, top, width, height;
-    size_t line_bytes, data_size;
-
-    left = (unsigned int)desc->Left;
-    top = (unsigned int)desc->Top;
-    width = (unsigned int)desc->Width;
-    height = (unsigned int)desc->Height;
-    if (left > info->width || top > info->height ||
-      width > info->width - left || height > info->height - top) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    frame->gif.update_left = (uint16_t)left;
-    frame->gif.update_top = (uint16_t)top;
-    frame->gif.update_width = (uint16_t)width;
-    frame->gif.update_height = (uint16_t)height;
-
-    if (!first_frame) {
-        line_bytes = ((size_t)(left & 7U) + width + 7U) / 8U;
-        if (size_mul(line_bytes, height, &data_size) == -1)
-            return -1;
-        if (data_size < info->frame_bytes) {
-            frame->data_size = data_size;
-            frame->line_bytes = line_bytes;
-            frame->format = WSCONS_FRAME_PARTIAL_1BPP;
-            return 0;
-        }
-    }
-
-    frame->data_size = info->frame_bytes;
-    frame->line_bytes = info->line_bytes;
-    frame->format = WSCONS_FRAME_FULL_1BPP;
-    return 0;
-}
-
-static int
-wscons_animation_allocate(WsconsAnimation *animation,
-  const MonoGifInfo *info, const GifFileType *gif)
-{
-    size_t pool_size;
-    int i;
-
-    if (gif == NULL || gif->ImageCount != info->frame_count) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    animation->info = *info;
-    animation->frames = calloc((size_t)info->frame_count,
-      sizeof(*animation->frames));
-    if (animation->frames == NULL)
-        return -1;
-
-    pool_size = 0;
-    for (i = 0; i < info->frame_count; i++) {
-        WsconsFrame *frame = &animation->frames[i];
-
-        if (wscons_frame_layout(frame, info,
-          &gif->SavedImages[i].ImageDesc, i == 0) == -1)
-            return -1;
-        frame->data_offset = pool_size;
-        if (size_add(pool_size, frame->data_size, &pool_size) == -1)
-            return -1;
-    }
-    if (pool_size == 0) {
-        errno = EOVERFLOW;
-        return -1;
-    }
-
-    animation->bitmap_pool = mmap(NULL, pool_size,
-      PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-    if (animation->bitmap_pool == MAP_FAILED)
-        return -1;
-
-    animation->bitmap_pool_size = pool_size;
-
-    /* Touch no bitmap pages here; rendering commits them frame by frame. */
-    return 0;
-}
-
-static void
-wscons_animation_finish_loading(WsconsAnimation *animation)
-{
-    /* The frame pool is immutable while playing. */
-    if (animation->bitmap_pool != MAP_FAILED) {
-        if (mprotect(animation->bitmap_pool, animation->bitmap_pool_size,
-          PROT_READ) == -1 && opt_progress)
-            warn("mprotect frame bitmap pool");
-
-        /*
-         * Playback walks the mapping from low to high addresses.  On NetBSD,
-         * MADV_SEQUENTIAL can lower the priority of pages already passed,
-         * allowing old frames to be paged out before other useful memory.
-         */
-        if (madvise(animation->bitmap_pool, animation->bitmap_pool_size,
-          MADV_SEQUENTIAL) == -1 && opt_progress)
-            warn("madvise frame bitmap pool");
-    }
-}
-
-static void
-wscons_animation_destroy(WsconsAnimation *animation)
-{
-    if (animation->bitmap_pool != MAP_FAILED) {
-        (void)munmap(animation->bitmap_pool, animation->bitmap_pool_size);
-        animation->bitmap_pool = MAP_FAILED;
-    }
-    free(animation->frames);
-    animation->frames = NULL;
-    animation->bitmap_pool_size = 0;
-}
-
-#ifdef UNROLL_BITMAP_EXTRACT
-/*
- * Return the number of leading pixels to process one by one before a safe,
- * byte-boundary and uint32_t-aligned 32-pixel store can be used.
- */
-static unsigned int
-pixels_to_word_alignment(uint8_t *row, unsigned int x, unsigned int width)
-{
-    unsigned int n;
-
-    n = 0;
-    while (n < width && ((x + n) & 7U) != 0)
-        n++;
-
-    while (n + 8U <= width &&
-      (((uintptr_t)(row + ((x + n) >> 3))) & 3U) != 0)
-        n += 8U;
-
-    return n;
-}
-#endif
-
-/*
- * Render one GIF frame into a complete MSB-first 1bpp logical-screen image.
- *
- * This function is deliberately independent of wsdisplay and of the final
- * frame storage policy.  A future X11 backend and the wscons backend can pass
- * one reusable work buffer as both bitmap and previous.
- */
-static int
-mono_render_frame(GifFileType *gif, const MonoGifInfo *info, int frame,
-  uint8_t *bitmap, const uint8_t *previous, MonoGifFrameInfo *frame_info)
-{
-    unsigned int swidth, sheight;
-    size_t line_bytes;
-    unsigned int ci, x, y;
-    unsigned int screenx;
-    size_t frame_row_offset, bitmap_row_offset;
-    unsigned int frame_width, frame_height, frame_left, frame_top;
-    unsigned int ncolors;
-    SavedImage *img;
-    GifImageDesc *desc;
-    ColorMapObject *cmap;
-    GraphicsControlBlock gcb;
-    int delay, transparent_index;
-    uint32_t bw_bit_cache[256];
-
-    if (gif == NULL || info == NULL || bitmap == NULL ||
-      frame_info == NULL ||
-      frame < 0 || frame >= info->frame_count) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    swidth = info->width;
-    sheight = info->height;
-    line_bytes = info->line_bytes;
-
-    img = &gif->SavedImages[frame];
-    desc = &img->ImageDesc;
-    cmap = desc->ColorMap != NULL ? desc->ColorMap : gif->SColorMap;
-    if (cmap == NULL || cmap->ColorCount > 256) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    frame_width = (unsigned int)desc->Width;
-    frame_height = (unsigned int)desc->Height;
-    frame_left = (unsigned int)desc->Left;
-    frame_top = (unsigned int)desc->Top;
-    if (frame_left > swidth || frame_top > sheight ||
-      frame_width > swidth - frame_left ||
-      frame_height > sheight - frame_top ||
-      (frame_width != 0 && frame_height != 0 && img->RasterBits == NULL)) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    memset(&gcb, 0, sizeof(gcb));
-    gcb.TransparentColor = NO_TRANSPARENT_COLOR;
-    /*
-     * GIFLIB returns GIF_ERROR when no GCE exists, while leaving the
-     * caller-supplied defaults in gcb.  This is valid for ordinary GIFs.
-     */
-    (void)DGifSavedExtensionToGCB(gif, frame, &gcb);
-    delay = gcb.DelayTime * 10;
-    frame_info->delay = delay > 0 ? (uint32_t)delay : DEF_GIF_DELAY;
-    frame_info->update_left = (uint16_t)frame_left;
-    frame_info->update_top = (uint16_t)frame_top;
-    frame_info->update_width = (uint16_t)frame_width;
-    frame_info->update_height = (uint16_t)frame_height;
-    transparent_index = gcb.TransparentColor;
-
-    if (transparent_index != NO_TRANSPARENT_COLOR ||
-      swidth != frame_width || sheight != frame_height ||
-      frame_left != 0 || frame_top != 0) {
-        if (previous == NULL)
-            memset(bitmap, 0, info->frame_bytes);
-        else if (bitmap != previous)
-            memcpy(bitmap, previous, info->frame_bytes);
-    }
-
-    memset(bw_bit_cache, 0, sizeof(bw_bit_cache));
-    ncolors = (unsigned int)cmap->ColorCount;
-    for (ci = 0; ci < ncolors; ci++) {
-        GifColorType c = cmap->Colors[ci];
-        if ((unsigned int)c.Red * 299U +
-          (unsigned int)c.Green * 587U +
-          (unsigned int)c.Blue * 114U > 128000U) {
-            bw_bit_cache[ci] =
-#ifdef UNROLL_BITMAP_EXTRACT
-              0x80000000U;
-#else
-              0x80U;
-#endif
-        }
-    }
-
-#ifdef UNROLL_BITMAP_EXTRACT
-    for (y = 0, bitmap_row_offset = (size_t)frame_top * line_bytes,
-      frame_row_offset = 0;
-      y < frame_height;
-      y++, bitmap_row_offset += line_bytes,
-      frame_row_offset += frame_width) {
-        GifByteType *raster, px;
-        uint8_t *bitmap_row, *bitmapp;
-        unsigned int unaligned_pixels;
-
-        bitmap_row = bitmap + bitmap_row_offset;
-        unaligned_pixels = pixels_to_word_alignment(bitmap_row,
-          frame_left, frame_width);
-        raster = &img->RasterBits[frame_row_offset];
-
-        /* 1. Pixel operations until a safe uint32_t boundary. */
-        for (x = 0, screenx = frame_left;
-          x < unaligned_pixels; x++, screenx++) {
-            unsigned int byte, bit;
-            size_t bitmap_byte_offset;
-
-            px = *raster++;
-            if (px == transparent_index)
-                continue;
-
-            byte = screenx >> 3;
-            bitmap_byte_offset = bitmap_row_offset + byte;
-            bit = screenx & 7U;
-            bitmap[bitmap_byte_offset] &= (uint8_t)~(0x80U >> bit);
-            bitmap[bitmap_byte_offset] |=
-              (uint8_t)(bw_bit_cache[px] >> (bit + 24U));
-        }
-
-        /* 2. Unrolled 32-pixel operations. */
-        for (bitmapp = &bitmap_row[screenx >> 3];
-          x + 31U < frame_width;
-          x += 32U, screenx += 32U, bitmapp += 4) {
-            uint32_t bitmap32;
-
-            if (transparent_index == NO_TRANSPARENT_COLOR) {
-                bitmap32  = bw_bit_cache[*raster++] >> 0U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 1U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 2U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 3U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 4U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 5U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 6U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 7U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 8U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 9U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 10U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 11U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 12U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 13U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 14U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 15U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 16U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 17U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 18U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 19U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 20U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 21U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 22U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 23U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 24U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 25U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 26U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 27U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 28U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 29U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 30U;
-                bitmap32 |= bw_bit_cache[*raster++] >> 31U;
-#if TARGET_LITTLE_ENDIAN
-                bitmap32 = bswap32(bitmap32);
-#endif
-                *(uint32_t *)(void *)bitmapp = bitmap32;
-            } else {
-                bitmap32 = *(uint32_t *)(void *)bitmapp;
-#if TARGET_LITTLE_ENDIAN
-                bitmap32 = bswap32(bitmap32);
-#endif
-#define UPDATE_BITMAP32_BIT(bitpos) do {                              \
-                px = *raster++;                                   \
-                if (px != transparent_index) {                    \
-                    bitmap32 &= ~(0x80000000U >> (bitpos));        \
-                    bitmap32 |= bw_bit_cache[px] >> (bitpos);      \
-                }                                                  \
-            } while (0)
-                UPDATE_BITMAP32_BIT(0U);
-                UPDATE_BITMAP32_BIT(1U);
-                UPDATE_BITMAP32_BIT(2U);
-                UPDATE_BITMAP32_BIT(3U);
-                UPDATE_BITMAP32_BIT(4U);
-                UPDATE_BITMAP32_BIT(5U);
-                UPDATE_BITMAP32_BIT(6U);
-                UPDATE_BITMAP32_BIT(7U);
-                UPDATE_BITMAP32_BIT(8U);
-                UPDATE_BITMAP32_BIT(9U);
-                UPDATE_BITMAP32_BIT(10U);
-                UPDATE_BITMAP32_BIT(11U);
-                UPDATE_BITMAP32_BIT(12U);
-                UPDATE_BITMAP32_BIT(13U);
-                UPDATE_BITMAP32_BIT(14U);
-                UPDATE_BITMAP32_BIT(15U);
-                UPDATE_BITMAP32_BIT(16U);
-                UPDATE_BITMAP32_BIT(17U);
-                UPDATE_BITMAP32_BIT(18U);
-                UPDATE_BITMAP32_BIT(19U);
-                UPDATE_BITMAP32_BIT(20U);
-                UPDATE_BITMAP32_BIT(21U);
-                UPDATE_BITMAP32_BIT(22U);
-                UPDATE_BITMAP32_BIT(23U);
-                UPDATE_BITMAP32_BIT(24U);
-                UPDATE_BITMAP32_BIT(25U);
-                UPDATE_BITMAP32_BIT(26U);
-                UPDATE_BITMAP32_BIT(27U);
-                UPDATE_BITMAP32_BIT(28U);
-                UPDATE_BITMAP32_BIT(29U);
-                UPDATE_BITMAP32_BIT(30U);
-                UPDATE_BITMAP32_BIT(31U);
-#undef UPDATE_BITMAP32_BIT
-#if TARGET_LITTLE_ENDIAN
-                bitmap32 = bswap32(bitmap32);
-#endif
-                *(uint32_t *)(void *)bitmapp = bitmap32;
-            }
-        }
-
-        /* 3. Remaining pixels. */
-        for (; x < frame_width; x++, screenx++) {
-            unsigned int byte, bit;
-            size_t bitmap_byte_offset;
-
-            px = *raster++;
-            if (px == transparent_index)
-                continue;
-
-            byte = screenx >> 3;
-            bitmap_byte_offset = bitmap_row_offset + byte;
-            bit = screenx & 7U;
-            bitmap[bitmap_byte_offset] &= (uint8_t)~(0x80U >> bit);
-            bitmap[bitmap_byte_offset] |=
-              (uint8_t)(bw_bit_cache[px] >> (bit + 24U));
-        }
-    }
-#else
-    for (y = 0, bitmap_row_offset = (size_t)frame_top * line_bytes,
-      frame_row_offset = 0;
-      y < frame_height;
-      y++, bitmap_row_offset += line_bytes,
-      frame_row_offset += frame_width) {
-        for (x = 0, screenx = frame_left;
-          x < frame_width; x++, screenx++) {
-            unsigned int byte, bit;
-            size_t bitmap_byte_offset;
-            GifByteType px;
-
-            px = img->RasterBits[frame_row_offset + x];
-            if (px == transparent_index)
-                continue;
-
-            byte = screenx >> 3;
-            bitmap_byte_offset = bitmap_row_offset + byte;
-            bit = screenx & 7U;
-            bitmap[bitmap_byte_offset] &= (uint8_t)~(0x80U >> bit);
-            bitmap[bitmap_byte_offset] |=
-              (uint8_t)(bw_bit_cache[px] >> bit);
-        }
-    }
-#endif
-
-    return 0;
-}
-
-/*
- * Release the source data for a frame after its rendered result has been
- * committed to backend-owned storage.  Keeping this separate from rendering
- * makes the ownership transition explicit and is suitable for later movement
- * into a shared GIF conversion module.
- */
-static void
-mono_release_saved_image(SavedImage *img)
-{
-    free(img->RasterBits);
-    img->RasterBits = NULL;
-
-    if (img->ImageDesc.ColorMap != NULL) {
-        GifFreeMapObject(img->ImageDesc.ColorMap);
-        img->ImageDesc.ColorMap = NULL;
-    }
-
-    GifFreeExtensions(&img->ExtensionBlockCount, &img->ExtensionBlocks);
-}
-
-static int
-wscons_store_composited_frame(WsconsAnimation *animation,
-  WsconsFrame *frame, const uint8_t *canvas)
-{
-    uint8_t *data;
-
-    data = wscons_frame_data(animation, frame);
-    if (data == NULL)
-        return -1;
-
-    if (frame->format == WSCONS_FRAME_FULL_1BPP) {
-        if (frame->data_size != animation->info.frame_bytes ||
-          frame->line_bytes != animation->info.line_bytes) {
-            errno = EINVAL;
-            return -1;
-        }
-        memcpy(data, canvas, frame->data_size);
-        return 0;
-    }
-
-    if (frame->format == WSCONS_FRAME_PARTIAL_1BPP) {
-        size_t expected_line_bytes, expected_size;
-        size_t src_byte;
-        unsigned int y;
-
-        if (frame->gif.update_left > animation->info.width ||
-          frame->gif.update_top > animation->info.height ||
-          frame->gif.update_width >
-          animation->info.width - frame->gif.update_left ||
-          frame->gif.update_height >
-          animation->info.height - frame->gif.update_top) {
-            errno = EINVAL;
-            return -1;
-        }
-        expected_line_bytes =
-          ((size_t)(frame->gif.update_left & 7U) +
-          frame->gif.update_width + 7U) / 8U;
-        if (size_mul(expected_line_bytes, frame->gif.update_height,
-          &expected_size) == -1)
-            return -1;
-        if (frame->line_bytes != expected_line_bytes ||
-          frame->data_size != expected_size ||
-          frame->data_size >= animation->info.frame_bytes) {
-            errno = EINVAL;
-            return -1;
-        }
-
-        src_byte = frame->gif.update_left / 8U;
-        for (y = 0; y < frame->gif.update_height; y++) {
-            const uint8_t *src;
-            uint8_t *dst;
-
-            src = canvas +
-              (size_t)(frame->gif.update_top + y) *
-              animation->info.line_bytes + src_byte;
-            dst = data + (size_t)y * frame->line_bytes;
-            if (frame->line_bytes != 0)
-                memcpy(dst, src, frame->line_bytes);
-        }
-        return 0;
-    }
-
-    errno = ENOTSUP;
-    return -1;
-}
-
-/*
- * Composite each GIF frame in one reusable full-screen work buffer, then copy
- * either the complete result or the byte-aligned original update rectangle
- * into the wscons-specific mmap pool.
- */
-static int
-wscons_extract_mono_frames(GifFileType *gif, WsconsAnimation *animation)
-{
-    uint8_t *canvas;
-    int rv;
-    int i;
-
-    canvas = malloc(animation->info.frame_bytes);
-    if (canvas == NULL)
-        return -1;
-    memset(canvas, 0, animation->info.frame_bytes);
-    rv = -1;
-
-    for (i = 0; i < animation->info.frame_count; i++) {
-        uint32_t frame_start_time;
-        WsconsFrame *frame;
-
-        if (opt_progress) {
-            fprintf(stderr, "Preparing bitmap for frame %d/%d...",
-              i + 1, animation->info.frame_count);
-        }
-
-        frame_start_time = opt_duration ? gettime_ms() : 0;
-        frame = &animation->frames[i];
-
-        if (mono_render_frame(gif, &animation->info, i, canvas,
-          i == 0 ? NULL : canvas, &frame->gif) == -1) {
-            if (opt_progress)
-                fprintf(stderr, "\n");
-            goto out;
-        }
-        if (wscons_store_composited_frame(animation, frame, canvas) == -1) {
-            if (opt_progress)
-                fprintf(stderr, "\n");
-            goto out;
-        }
-
-        /*
-         * The 1bpp result and its metadata now belong to the wscons frame
-         * descriptor and bitmap pool.  The decoded 8bpp source and frame-local
-         * giflib objects are no longer needed.
-         */
-        mono_release_saved_image(&gif->SavedImages[i]);
-
-        if (opt_progress) {
-            if (opt_duration) {
-                uint32_t frame_time;
-
-                frame_time = gettime_ms() - frame_start_time;
-                total_frame_time += frame_time;
-                fprintf(stderr, " completed in %u ms.\n", frame_time);
-            } else {
-                fprintf(stderr, "%s",
-                  i < animation->info.frame_count - 1 ? "\r" : "\n");
-            }
-        }
-    }
-
-    rv = 0;
-out:
-    free(canvas);
-    return rv;
-}
-
 static int
 monobg_validate_display(const MonoBgInfo *info, const WsDisplay *display)
 {
@@ -1128,19 +450,114 @@ wsdisplay_cleanup(WsDisplay *display)
     }
 }
 
+static unsigned int
+span_get16(const uint8_t *p)
+{
+    return ((unsigned int)p[0] << 8) | p[1];
+}
+
+static uint32_t
+tile_get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+      ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/*
+ * Copy rows of bytes bytes each, src_stride apart in src, to byte column x
+ * of the rows from top of the logical screen.  Bits past the screen width
+ * in its last byte are left as they are.
+ */
+static void
+wsdisplay_blit_rows(const WsDisplay *display,
+  const WsconsAnimation *animation, const uint8_t *src, size_t src_stride,
+  size_t x, size_t bytes, unsigned int top, unsigned int rows,
+  unsigned int dst_x, unsigned int dst_y)
+{
+    unsigned int y, rem_bits;
+    size_t copy_bytes;
+    bool mask_last;
+
+    rem_bits = animation->info.width & 7U;
+    mask_last = rem_bits != 0 && bytes != 0 &&
+      x + bytes == animation->info.line_bytes;
+    copy_bytes = bytes - (mask_last ? 1U : 0U);
+
+    for (y = 0; y < rows; y++) {
+        uint8_t *dst;
+
+        dst = display->fb_base + (size_t)(dst_y + top + y) * display->stride +
+          dst_x / 8U + x;
+
+        if (copy_bytes != 0)
+            memcpy(dst, src, copy_bytes);
+
+        if (mask_last) {
+            uint8_t mask = (uint8_t)(0xffU << (8U - rem_bits));
+
+            dst[copy_bytes] = (uint8_t)((dst[copy_bytes] &
+              (uint8_t)~mask) | (src[copy_bytes] & mask));
+        }
+        src += src_stride;
+    }
+}
+
+/*
+ * Draw WSCONS_FRAME_SPANS_1BPP data from p to end.  Unchanged rows are
+ * absent; only the listed spans are written.
+ */
+static void
+wsdisplay_blit_spans(const WsDisplay *display,
+  const WsconsAnimation *animation, const uint8_t *p, const uint8_t *end,
+  unsigned int dst_x, unsigned int dst_y)
+{
+    unsigned int rem_bits;
+
+    rem_bits = animation->info.width & 7U;
+    while (p < end) {
+        uint8_t *row;
+        unsigned int count;
+
+        row = display->fb_base +
+          (size_t)(dst_y + span_get16(p)) * display->stride + dst_x / 8U;
+        count = span_get16(p + 2);
+        p += WSCONS_SPAN_ROW_HEADER;
+
+        while (count-- > 0) {
+            size_t x, len, copy_bytes;
+            bool mask_last;
+
+            x = span_get16(p);
+            len = span_get16(p + 2);
+            p += WSCONS_SPAN_HEADER;
+            mask_last = rem_bits != 0 &&
+              x + len == animation->info.line_bytes;
+            copy_bytes = len - (mask_last ? 1U : 0U);
+
+            if (copy_bytes != 0)
+                memcpy(row + x, p, copy_bytes);
+
+            if (mask_last) {
+                uint8_t mask = (uint8_t)(0xffU << (8U - rem_bits));
+
+                row[x + copy_bytes] = (uint8_t)((row[x + copy_bytes] &
+                  (uint8_t)~mask) | (p[copy_bytes] & mask));
+            }
+            p += len;
+        }
+    }
+}
+
 static int
 wsdisplay_blit_frame(const WsDisplay *display,
-  const WsconsAnimation *animation, int frame_number,
+  const WsconsAnimation *animation, const WsconsFrame *frame,
   unsigned int dst_x, unsigned int dst_y)
 {
-    const WsconsFrame *frame;
     const uint8_t *bitmap;
     unsigned int y;
-    size_t full_bytes;
     unsigned int rem_bits;
 
-    if (frame_number < 0 || frame_number >= animation->info.frame_count ||
-      animation->info.width > display->width ||
+    if (animation->info.width > display->width ||
       animation->info.height > display->height ||
       (dst_x & 7U) != 0 ||
       dst_x > display->width - animation->info.width ||
@@ -1149,94 +566,183 @@ wsdisplay_blit_frame(const WsDisplay *display,
         return -1;
     }
 
-    frame = &animation->frames[frame_number];
+    if (wscons_frame_validate(animation, frame) == -1)
+        return -1;
     bitmap = wscons_frame_const_data(animation, frame);
     if (bitmap == NULL)
         return -1;
 
     if (frame->format == WSCONS_FRAME_FULL_1BPP) {
-        if (frame->data_size != animation->info.frame_bytes ||
-          frame->line_bytes != animation->info.line_bytes) {
-            errno = EINVAL;
-            return -1;
-        }
-
-        full_bytes = animation->info.width / 8U;
-        rem_bits = animation->info.width & 7U;
+        wsdisplay_blit_rows(display, animation, bitmap, frame->line_bytes,
+          0, animation->info.line_bytes, 0, animation->info.height,
+          dst_x, dst_y);
+        return 0;
+    }
 
-        for (y = 0; y < animation->info.height; y++) {
-            const uint8_t *src;
-            uint8_t *dst;
+    if (frame->format == WSCONS_FRAME_PARTIAL_1BPP) {
+        wsdisplay_blit_rows(display, animation, bitmap, frame->line_bytes,
+          frame->gif.update_left / 8U, frame->line_bytes,
+          frame->gif.update_top, frame->gif.update_height, dst_x, dst_y);
+        return 0;
+    }
 
-            src = bitmap + (size_t)y * frame->line_bytes;
-            dst = display->fb_base +
-              (size_t)(dst_y + y) * display->stride + dst_x / 8U;
+    if (frame->format == WSCONS_FRAME_SPANS_1BPP) {
+        wsdisplay_blit_spans(display, animation, bitmap,
+          bitmap + frame->data_size, dst_x, dst_y);
+        return 0;
+    }
 
-            if (full_bytes != 0)
-                memcpy(dst, src, full_bytes);
+    if (frame->format == WSCONS_FRAME_XOR_RLE_1BPP) {
+        const uint8_t *p;
+        size_t byte_left;
 
-            if (rem_bits != 0) {
-                uint8_t mask = (uint8_t)(0xffU << (8U - rem_bits));
+        /*
+         * The screen still shows the previous frame, so the delta is
+         * applied to VRAM as it is decoded.  Skipped bytes are not touched.
+         */
+        byte_left = frame->gif.update_left / 8U;
+        p = bitmap;
+        for (y = 0; y < frame->gif.update_height; y++) {
+            uint8_t *dst, *row_end;
 
-                dst[full_bytes] = (uint8_t)((dst[full_bytes] &
-                  (uint8_t)~mask) | (src[full_bytes] & mask));
+            dst = display->fb_base +
+              (size_t)(dst_y + frame->gif.update_top + y) *
+              display->stride + dst_x / 8U + byte_left;
+            row_end = dst + frame->line_bytes;
+
+            while (dst < row_end) {
+                unsigned int code = *p++;
+                size_t n;
+
+                if ((code & 0x80U) == WSCONS_RLE_LITERAL) {
+                    for (n = code + 1U; n > 0; n--)
+                        *dst++ ^= *p++;
+                } else if ((code & 0xc0U) == WSCONS_RLE_REPEAT) {
+                    uint8_t value = *p++;
+
+                    for (n = (code & 0x3fU) + WSCONS_RLE_REPEAT_MIN; n > 0;
+                      n--)
+                        *dst++ ^= value;
+                } else {
+                    dst += (code & 0x3fU) + 1U;
+                }
             }
         }
 
         return 0;
     }
 
-    if (frame->format == WSCONS_FRAME_PARTIAL_1BPP) {
-        size_t expected_line_bytes, expected_size;
-        size_t byte_left, copy_bytes;
+    if (frame->format == WSCONS_FRAME_MOVE_1BPP) {
+        unsigned int top, rows, src_top;
+        size_t x, bytes, src_x, copy_bytes;
+        ptrdiff_t step;
+        uint8_t *dst, *src;
         bool mask_last;
 
-        if (frame->gif.update_left > animation->info.width ||
-          frame->gif.update_top > animation->info.height ||
-          frame->gif.update_width >
-          animation->info.width - frame->gif.update_left ||
-          frame->gif.update_height >
-          animation->info.height - frame->gif.update_top) {
-            errno = EINVAL;
-            return -1;
+        /*
+         * Scrolled content is copied within VRAM, in the order that reads
+         * each source row before it is overwritten, then the rest of the
+         * frame is drawn from its spans.
+         */
+        top = span_get16(bitmap);
+        rows = span_get16(bitmap + 2);
+        x = span_get16(bitmap + 4);
+        bytes = span_get16(bitmap + 6);
+        src_top = span_get16(bitmap + 8);
+        src_x = span_get16(bitmap + 10);
+        rem_bits = animation->info.width & 7U;
+        mask_last = rem_bits != 0 && x + bytes == animation->info.line_bytes;
+        copy_bytes = bytes - (mask_last ? 1U : 0U);
+
+        step = (ptrdiff_t)display->stride;
+        if (src_top < top) {
+            top += rows - 1U;
+            src_top += rows - 1U;
+            step = -step;
         }
+        dst = display->fb_base + (size_t)(dst_y + top) * display->stride +
+          dst_x / 8U + x;
+        src = display->fb_base + (size_t)(dst_y + src_top) *
+          display->stride + dst_x / 8U + src_x;
+        for (y = 0; y < rows; y++) {
+            if (mask_last) {
+                uint8_t mask = (uint8_t)(0xffU << (8U - rem_bits));
+                uint8_t last = src[copy_bytes];
 
-        expected_line_bytes =
-          ((size_t)(frame->gif.update_left & 7U) +
-          frame->gif.update_width + 7U) / 8U;
-        if (size_mul(expected_line_bytes, frame->gif.update_height,
-          &expected_size) == -1)
-            return -1;
-        if (frame->line_bytes != expected_line_bytes ||
-          frame->data_size != expected_size ||
-          frame->data_size >= animation->info.frame_bytes) {
-            errno = EINVAL;
-            return -1;
+                if (copy_bytes != 0)
+                    memmove(dst, src, copy_bytes);
+                dst[copy_bytes] = (uint8_t)((dst[copy_bytes] &
+                  (uint8_t)~mask) | (last & mask));
+            } else {
+                memmove(dst, src, copy_bytes);
+            }
+            dst += step;
+            src += step;
         }
 
-        byte_left = frame->gif.update_left / 8U;
-        rem_bits = animation->info.width & 7U;
-        mask_last = rem_bits != 0 && frame->line_bytes != 0 &&
-          byte_left + frame->line_bytes == animation->info.line_bytes;
-        copy_bytes = frame->line_bytes - (mask_last ? 1U : 0U);
-
-        for (y = 0; y < frame->gif.update_height; y++) {
-            const uint8_t *src;
-            uint8_t *dst;
-
-            src = bitmap + (size_t)y * frame->line_bytes;
-            dst = display->fb_base +
-              (size_t)(dst_y + frame->gif.update_top + y) *
-              display->stride + dst_x / 8U + byte_left;
+        wsdisplay_blit_spans(display, animation,
+          bitmap + WSCONS_MOVE_HEADER, bitmap + frame->data_size,
+          dst_x, dst_y);
+        return 0;
+    }
 
-            if (copy_bytes != 0)
-                memcpy(dst, src, copy_bytes);
+    if (frame->format == WSCONS_FRAME_TILES_1BPP) {
+        unsigned int tx0, ty0, tx, ty, columns, rows;
+        const uint8_t *entry;
 
-            if (mask_last) {
-                uint8_t mask = (uint8_t)(0xffU << (8U - rem_bits));
+        /* Tiles are clipped to the logical screen as they are drawn. */
+        rem_bits = animation->info.width & 7U;
+        tx0 = frame->gif.update_left / 8U / WSCONS_TILE_BYTES;
+        ty0 = frame->gif.update_top / WSCONS_TILE_ROWS;
+        columns = (unsigned int)(frame->line_bytes / WSCONS_TILE_ENTRY);
+        rows = (unsigned int)(frame->data_size / frame->line_bytes);
+        entry = bitmap;
+
+        for (ty = ty0; ty < ty0 + rows; ty++) {
+            unsigned int top, tile_rows;
+
+            top = ty * WSCONS_TILE_ROWS;
+            tile_rows = animation->info.height - top;
+            if (tile_rows > WSCONS_TILE_ROWS)
+                tile_rows = WSCONS_TILE_ROWS;
+
+            for (tx = tx0; tx < tx0 + columns; tx++) {
+                const uint8_t *src;
+                uint8_t *dst;
+                uint32_t offset;
+                size_t x, copy_bytes;
+                bool mask_last;
+
+                offset = tile_get32(entry);
+                entry += WSCONS_TILE_ENTRY;
+                if (offset == WSCONS_TILE_NONE)
+                    continue;
 
-                dst[copy_bytes] = (uint8_t)((dst[copy_bytes] &
-                  (uint8_t)~mask) | (src[copy_bytes] & mask));
+                src = animation->bitmap_pool + offset;
+                x = (size_t)tx * WSCONS_TILE_BYTES;
+                copy_bytes = animation->info.line_bytes - x;
+                if (copy_bytes > WSCONS_TILE_BYTES)
+                    copy_bytes = WSCONS_TILE_BYTES;
+                mask_last = rem_bits != 0 &&
+                  x + copy_bytes == animation->info.line_bytes;
+                if (mask_last)
+                    copy_bytes--;
+                dst = display->fb_base +
+                  (size_t)(dst_y + top) * display->stride + dst_x / 8U + x;
+
+                for (y = 0; y < tile_rows; y++) {
+                    if (copy_bytes != 0)
+                        memcpy(dst, src, copy_bytes);
+
+                    if (mask_last) {
+                        uint8_t mask = (uint8_t)(0xffU << (8U - rem_bits));
+
+                        dst[copy_bytes] = (uint8_t)((dst[copy_bytes] &
+                          (uint8_t)~mask) | (src[copy_bytes] & mask));
+                    }
+                    src += WSCONS_TILE_BYTES;
+                    dst += display->stride;
+                }
             }
         }
 
@@ -1247,6 +753,184 @@ wsdisplay_blit_frame(const WsDisplay *display,
     return -1;
 }
 
+/*
+ * Show frame without waiting: draw the nearest frame before it that
+ * redraws the whole screen, then the frames that follow up to frame.  With
+ * stream, the frames are read from it, which is left to continue after
+ * frame.
+ */
+static int
+wsdisplay_seek(const WsDisplay *display, const WsconsAnimation *animation,
+  WsconsStream *stream, int frame, unsigned int dst_x, unsigned int dst_y)
+{
+    int i;
+
+    i = wscons_animation_seek_start(animation, frame);
+    if (stream != NULL)
+        wscons_stream_seek(stream, i, false);
+    for (; i <= frame; i++) {
+        const WsconsFrame *drawn;
+
+        if (stream != NULL) {
+            drawn = wscons_stream_next(stream);
+            if (drawn == NULL)
+                return -1;
+        } else {
+            drawn = &animation->frames[i];
+        }
+        if (wsdisplay_blit_frame(display,
+          stream != NULL ? &stream->view : animation, drawn,
+          dst_x, dst_y) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static void
+dirty_rect_add(DirtyRect *dirty, const WsconsFrame *frame)
+{
+    size_t left, right;
+    unsigned int top, bottom;
+
+    if (frame->gif.update_width == 0 || frame->gif.update_height == 0)
+        return;
+    left = frame->gif.update_left / 8U;
+    right = ((size_t)frame->gif.update_left + frame->gif.update_width +
+      7U) / 8U;
+    top = frame->gif.update_top;
+    bottom = top + frame->gif.update_height;
+    if (dirty->right == 0) {
+        dirty->left = left;
+        dirty->right = right;
+        dirty->top = top;
+        dirty->bottom = bottom;
+        return;
+    }
+    if (left < dirty->left)
+        dirty->left = left;
+    if (right > dirty->right)
+        dirty->right = right;
+    if (top < dirty->top)
+        dirty->top = top;
+    if (bottom > dirty->bottom)
+        dirty->bottom = bottom;
+}
+
+/*
+ * Catch up after dropped frames: copy the union of their update rectangles
+ * from the shadow screen, which already holds the latest composite.
+ */
+static void
+wsdisplay_blit_dirty(const WsDisplay *display,
+  const WsconsAnimation *animation, const WsDisplay *shadow,
+  DirtyRect *dirty, unsigned int dst_x, unsigned int dst_y)
+{
+    if (dirty->right == 0)
+        return;
+    wsdisplay_blit_rows(display, animation,
+      shadow->fb_base + (size_t)dirty->top * shadow->stride + dirty->left,
+      shadow->stride, dirty->left, dirty->right - dirty->left, dirty->top,
+      dirty->bottom - dirty->top, dst_x, dst_y);
+    dirty->right = 0;
+}
+
+static uint64_t
+gettime_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Return the average time in ns to draw rows rows of bytes bytes from byte
+ * column x of src, repeated for CALIBRATE_NS.
+ */
+static uint64_t
+wsdisplay_time_rows(const WsDisplay *display,
+  const WsconsAnimation *animation, const uint8_t *src, size_t x,
+  size_t bytes, unsigned int rows)
+{
+    uint64_t start, elapsed, count;
+
+    start = gettime_ns();
+    count = 0;
+    do {
+        wsdisplay_blit_rows(display, animation, src,
+          animation->info.line_bytes, x, bytes, 0, rows, 0, 0);
+        count++;
+        elapsed = gettime_ns() - start;
+    } while (elapsed < CALIBRATE_NS);
+    return elapsed / count;
+}
+
+/* Scale the time that slower took over faster to per units. */
+static uint32_t
+calibrate_cost(uint64_t slower, uint64_t faster, uint64_t scale,
+  uint64_t units)
+{
+    uint64_t cost;
+
+    if (slower <= faster)
+        return 0;
+    cost = (slower - faster) * scale / units;
+    return cost > UINT32_MAX ? UINT32_MAX : (uint32_t)cost;
+}
+
+/*
+ * Measure the blit cost model of the framebuffer by drawing over it.  Each
+ * coefficient comes from two runs that differ only in what it prices.  The
+ * screen is taken one pixel short of whole bytes so that rows reaching its
+ * right edge merge their last byte.
+ */
+static int
+wsdisplay_calibrate(const WsDisplay *display, WsconsBlitCost *cost)
+{
+    WsconsAnimation screen;
+    uint8_t *src;
+    size_t line_bytes, bytes, edge_x;
+    unsigned int rows;
+    uint64_t t_one, t_rows, t_bytes, t_unaligned, t_edge;
+
+    line_bytes = display->width / 8U;
+    rows = display->height;
+    if (line_bytes < 2U * WSCONS_BLIT_ALIGN || rows < 2U) {
+        errno = EINVAL;
+        return -1;
+    }
+    wscons_animation_init(&screen);
+    if (mono_gif_info_init(&screen.info, (unsigned int)line_bytes * 8U - 1U,
+      rows, 1) == -1)
+        return -1;
+    src = malloc(screen.info.frame_bytes);
+    if (src == NULL)
+        return -1;
+    memset(src, 0x55, screen.info.frame_bytes);
+
+    /* The aligned right half of the screen, moved left for the others. */
+    edge_x = line_bytes / 2U / WSCONS_BLIT_ALIGN * WSCONS_BLIT_ALIGN;
+    bytes = line_bytes - edge_x;
+    t_one = wsdisplay_time_rows(display, &screen, src, 0, 1, 1);
+    t_rows = wsdisplay_time_rows(display, &screen, src, 0, 1, rows);
+    t_bytes = wsdisplay_time_rows(display, &screen, src, 0, bytes, rows);
+    t_unaligned = wsdisplay_time_rows(display, &screen, src, 1, bytes,
+      rows);
+    t_edge = wsdisplay_time_rows(display, &screen, src, edge_x, bytes,
+      rows);
+    free(src);
+
+    cost->row = calibrate_cost(t_rows, t_one, 1, rows - 1U);
+    cost->call = calibrate_cost(t_one, cost->row, 1, 1);
+    cost->kbyte = calibrate_cost(t_bytes, t_rows, 1024,
+      (uint64_t)rows * (bytes - 1U));
+    cost->unaligned = calibrate_cost(t_unaligned, t_bytes, 1024,
+      (uint64_t)rows * bytes);
+    cost->edge = calibrate_cost(t_edge, t_bytes, 1, rows);
+    return 0;
+}
+
 static void
 handle_signal(int signo)
 {
@@ -1273,8 +957,14 @@ install_signal_handlers(void)
     return 0;
 }
 
+/*
+ * Wait for deadline, reading 'q' from stdin to stop.  Time to spare is
+ * first used to read streamed frames ahead, one at a time, or to slide the
+ * prefetch window over the frame pool, so that the next frames are in
+ * memory before they are due.
+ */
 static int
-wait_until(uint32_t deadline, bool monitor_stdin)
+wait_until(uint32_t deadline, bool monitor_stdin, PoolWindow *window)
 {
     while (!stop_requested) {
         uint32_t now;
@@ -1287,6 +977,18 @@ wait_until(uint32_t deadline, bool monitor_stdin)
         remaining = (int32_t)(deadline - now);
         if (remaining <= 0)
             break;
+        if (window->stream != NULL && window->filling) {
+            /* A read error shows up again when the frame is needed. */
+            if (wscons_stream_fill(window->stream) != 1)
+                window->filling = false;
+            continue;
+        }
+        if (window->pending) {
+            wscons_animation_advance(window->animation, window->frame,
+              window->looped, PREFETCH_FRAMES);
+            window->pending = false;
+            continue;
+        }
 
         tv.tv_sec = remaining / 1000;
         tv.tv_usec = (remaining % 1000) * 1000;
@@ -1332,19 +1034,42 @@ static void
 usage(void)
 {
     fprintf(stderr,
-      "Usage: %s [-C] [-c] [-d] [-p] [-r] [-f framebuffer-device]\n"
-      "       [-b background-file] [-x x-position] [-y y-position] gif-file\n",
+      "Usage: %s [-C] [-D] [-c] [-d] [-p] [-r] [-t] [-z]\n"
+      "       [-f framebuffer-device] [-b background-file]\n"
+      "       [-A cache-directory]\n"
+      "       [-k keyframe-interval] [-K keyframe-bytes]\n"
+      "       [-M memory-budget] [-m coalesce-ms] [-s start-frame]\n"
+      "       [-F pool-directory] [-S stream-frames] [-W blit-cost]\n"
+      "       [-x x-position] [-y y-position] gif-file | animation-file\n"
+      "       %s -B [-p] [-f framebuffer-device]\n",
+      progname != NULL ? progname : "monogifplay-wscons",
       progname != NULL ? progname : "monogifplay-wscons");
     fprintf(stderr,
+      "  -A  Keep converted GIF files in this directory and reuse them\n"
+      "      (default: $MONOGIFPLAY_CACHE, or no cache).\n"
+      "  -B  Measure the blit cost model of the framebuffer for -W.\n"
       "  -C  Center the GIF in the framebuffer.\n"
+      "  -D  Drop frames to keep up when drawing falls behind schedule.\n"
+      "  -F  Build the frames in a temporary file in this directory.\n"
       "  -b  Display a MonoBG background before playback.\n"
       "  -c  Clear the whole screen to white before playback.\n"
       "  -d  Show duration information (implies -p).\n"
       "  -p  Show progress messages.\n"
       "  -r  Restore the visible pre-playback screen on exit.\n"
       "  -f  Select wsdisplay device (default: $FRAMEBUFFER or %s).\n"
+      "  -K  Store a full frame after this many bytes of other frames.\n"
+      "  -k  Store a full frame at least every this many frames.\n"
+      "  -M  Keep the frames within this many bytes, compressing as needed.\n"
+      "  -m  Merge frames shown for less than this many ms into the next.\n"
+      "  -S  Read the frames of an animation file while playing through\n"
+      "      a ring of this many frames instead of mapping them all.\n"
+      "  -s  Start playback at this frame (counted from 0).\n"
+      "  -t  Store frames as maps of shared 32x32 tiles when smaller.\n"
+      "  -W  Store partial frames only when faster to draw by this cost\n"
+      "      model, as printed by -B.\n"
       "  -x  Set the left X position in pixels (must be a multiple of 8).\n"
-      "  -y  Set the top Y position in pixels.\n",
+      "  -y  Set the top Y position in pixels.\n"
+      "  -z  Store frames as compressed XOR deltas when smaller.\n",
       DEF_FBDEV);
     exit(EXIT_FAILURE);
 }
@@ -1352,29 +1077,53 @@ usage(void)
 int
 main(int argc, char **argv)
 {
-    WsDisplay display;
+    WsDisplay display, shadow;
     DisplayPosition position;
+    DirtyRect dirty;
     MonoGifInfo gif_info;
     WsconsAnimation animation;
+    WsconsStream stream;
     MonoBgReader background;
     GifFileType *gif;
-    const char *device, *giffile, *background_file;
+    const char *device, *giffile, *background_file, *pool_directory;
+    const char *source_file;
+    const char *cache_directory;
+    char *cache_path;
     uint8_t *background_line;
     char *progpath;
     char errmsg[512];
     int opt, gif_error;
+    int filled;
+    int loaded;
     int saved_errno;
     bool have_error;
     bool restore_screen;
     int exit_status;
-    uint64_t raster_total;
+    WsconsLoadOptions load_options;
+    WsconsBlitCost blit_cost;
+    PoolWindow window;
+    const WsconsAnimation *drawing;
+    bool from_container;
+    bool cache_hit, cache_stored;
+    bool looped;
+    int probe;
+    unsigned int screen_width, screen_height;
+    uint64_t raster_max;
     long requested_x, requested_y;
+    long keyframe_interval, keyframe_bytes, start_frame, coalesce_ms;
+    long memory_budget, stream_frames;
+    uint32_t due_time;
+    int dropped_frames;
     int i;
 
     wsdisplay_init(&display);
+    wsdisplay_init(&shadow);
+    memset(&dirty, 0, sizeof(dirty));
+    dropped_frames = 0;
     memset(&position, 0, sizeof(position));
     memset(&gif_info, 0, sizeof(gif_info));
     wscons_animation_init(&animation);
+    wscons_stream_init(&stream);
     monobg_reader_init(&background);
     gif = NULL;
     background_line = NULL;
@@ -1388,12 +1137,55 @@ main(int argc, char **argv)
     restore_screen = false;
     requested_x = -1;
     requested_y = -1;
-    while ((opt = getopt(argc, argv, "Cb:cdf:prx:y:")) != -1) {
+    keyframe_interval = 0;
+    keyframe_bytes = 0;
+    start_frame = 0;
+    coalesce_ms = 0;
+    memory_budget = 0;
+    stream_frames = 0;
+    memset(&blit_cost, 0, sizeof(blit_cost));
+    pool_directory = NULL;
+    cache_directory = NULL;
+    cache_path = NULL;
+    while ((opt = getopt(argc, argv,
+      "A:BCDF:K:M:S:W:b:cdf:k:m:prs:tx:y:z")) != -1) {
         switch (opt) {
         char *endptr;
+        case 'A':
+            cache_directory = optarg;
+            break;
+        case 'B':
+            opt_calibrate = 1;
+            break;
         case 'C':
             opt_center = 1;
             break;
+        case 'D':
+            opt_drop = 1;
+            break;
+        case 'F':
+            pool_directory = optarg;
+            break;
+        case 'K':
+            keyframe_bytes = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || keyframe_bytes < 0)
+                usage();
+            break;
+        case 'M':
+            memory_budget = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || memory_budget < 0)
+                usage();
+            break;
+        case 'S':
+            stream_frames = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || stream_frames < 1 ||
+              stream_frames > INT_MAX)
+                usage();
+            break;
+        case 'W':
+            if (wscons_blit_cost_parse(&blit_cost, optarg) == -1)
+                usage();
+            break;
         case 'b':
             background_file = optarg;
             break;
@@ -1407,12 +1199,31 @@ main(int argc, char **argv)
         case 'f':
             device = optarg;
             break;
+        case 'k':
+            keyframe_interval = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || keyframe_interval < 0 ||
+              keyframe_interval > INT_MAX)
+                usage();
+            break;
+        case 'm':
+            coalesce_ms = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || coalesce_ms < 0)
+                usage();
+            break;
         case 'p':
             opt_progress = 1;
             break;
         case 'r':
             restore_screen = true;
             break;
+        case 's':
+            start_frame = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || start_frame < 0)
+                usage();
+            break;
+        case 't':
+            opt_tiles = 1;
+            break;
         case 'x':
             requested_x = strtol(optarg, &endptr, 10);
             if (*endptr != '\0' || requested_x < 0)
@@ -1423,11 +1234,14 @@ main(int argc, char **argv)
             if (*endptr != '\0' || requested_y < 0)
                 usage();
             break;
+        case 'z':
+            opt_compress = 1;
+            break;
         default:
             usage();
         }
     }
-    if (optind + 1 != argc ||
+    if (optind + (opt_calibrate ? 0 : 1) != argc ||
       (background_file != NULL && opt_clear))
         usage();
 
@@ -1435,7 +1249,12 @@ main(int argc, char **argv)
         device = getenv("FRAMEBUFFER");
     if (device == NULL || *device == '\0')
         device = DEF_FBDEV;
-    giffile = argv[optind];
+    if (cache_directory == NULL)
+        cache_directory = getenv("MONOGIFPLAY_CACHE");
+    if (cache_directory != NULL && *cache_directory == '\0')
+        cache_directory = NULL;
+    giffile = opt_calibrate ? NULL : argv[optind];
+    source_file = giffile;
 
     init_gettime_ms();
     if (opt_duration)
@@ -1459,6 +1278,50 @@ main(int argc, char **argv)
         goto cleanup;                                                  \
     } while (0)
 
+    load_options.progress = opt_progress != 0;
+    load_options.duration = opt_duration != 0;
+    load_options.compress = opt_compress != 0;
+    load_options.tiles = opt_tiles != 0;
+    load_options.keyframe_interval = (int)keyframe_interval;
+    load_options.keyframe_bytes = (size_t)keyframe_bytes;
+    load_options.coalesce_ms = (uint32_t)coalesce_ms;
+    load_options.memory_budget = (size_t)memory_budget;
+    load_options.blit_cost = blit_cost;
+    load_options.pool_directory = pool_directory;
+    load_options.threads = 1;
+    load_options.gif_index = NULL;
+    load_options.gettime_ms = gettime_ms;
+
+    /* A precompiled animation file skips GIF decoding entirely. */
+    from_container = false;
+    cache_hit = false;
+    cache_stored = false;
+    if (!opt_calibrate) {
+        probe = monoanim_probe(giffile);
+        if (probe == -1)
+            FAIL_ERRNO("open %s", giffile);
+        from_container = probe == 1;
+        if (!from_container && cache_directory != NULL) {
+            cache_path = wscons_cache_path(cache_directory, giffile,
+              &load_options);
+            if (cache_path == NULL)
+                FAIL_ERRNO("read %s", giffile);
+            /*
+             * A cached conversion is played as an animation file, or
+             * removed and made again if it cannot be loaded.
+             */
+            if (access(cache_path, R_OK) == 0) {
+                cache_hit = true;
+                from_container = true;
+                giffile = cache_path;
+            }
+        }
+        /* A GIF file can only be streamed once converted into the cache. */
+        if (stream_frames > 0 && !from_container && cache_directory == NULL)
+            FAIL_MSG("%s is not an animation file made by gif2monoanim",
+              giffile);
+    }
+
     if (wsdisplay_open_and_query(&display, device) == -1)
         FAIL_ERRNO("initialize wsdisplay device %s", device);
 
@@ -1471,6 +1334,21 @@ main(int argc, char **argv)
         FAIL_MSG("unsupported framebuffer geometry: %ux%u, depth %u, stride %u",
           display.width, display.height, display.depth, display.stride);
 
+    if (opt_calibrate) {
+        /* The measurement draws over the screen, which is put back. */
+        if (install_signal_handlers() == -1)
+            FAIL_ERRNO("install signal handlers");
+        if (wsdisplay_enter_dumbfb(&display, true) == -1)
+            FAIL_ERRNO("enter wsdisplay dumb framebuffer mode");
+        if (opt_progress)
+            fprintf(stderr, "Measuring blit costs...");
+        if (wsdisplay_calibrate(&display, &blit_cost) == -1)
+            FAIL_ERRNO("measure blit costs on %s", device);
+        if (opt_progress)
+            fprintf(stderr, " completed.\n");
+        goto playback_done;
+    }
+
     if (background_file != NULL) {
         if (monobg_reader_open(background_file, &background) == -1)
             FAIL_ERRNO("open background file %s", background_file);
@@ -1494,32 +1372,72 @@ main(int argc, char **argv)
               background_file, background.info.width, background.info.height,
               background.info.line_bytes, background.info.payload_size);
         }
-        fprintf(stderr, "Loading GIF file...");
+        fprintf(stderr, "Loading %s file...",
+          from_container ? "animation" : "GIF");
     }
     if (opt_duration)
         gifload_start_time = gettime_ms();
 
-    gif = DGifOpenFileName(giffile, &gif_error);
-    if (gif == NULL)
-        FAIL_MSG("cannot open %s: %s", giffile, GifErrorString(gif_error));
-
-    if (gif->SWidth <= 0 || gif->SHeight <= 0)
-        FAIL_MSG("invalid GIF logical screen size: %dx%d",
-          gif->SWidth, gif->SHeight);
-    if ((unsigned int)gif->SWidth > display.width ||
-      (unsigned int)gif->SHeight > display.height) {
-        FAIL_MSG("GIF logical screen %dx%d does not fit framebuffer %ux%u",
-          gif->SWidth, gif->SHeight, display.width, display.height);
+    if (from_container) {
+        if (stream_frames > 0)
+            loaded = wscons_stream_open(&stream, &animation, giffile,
+              &load_options, (int)stream_frames);
+        else
+            loaded = wscons_animation_load_file(&animation, giffile,
+              &load_options);
+        /* Tiled frames cannot be streamed, however often converted. */
+        if (loaded == -1 && (!cache_hit || errno == ENOTSUP)) {
+            if (stream_frames > 0)
+                FAIL_ERRNO("open animation file %s for streaming", giffile);
+            FAIL_ERRNO("load animation file %s", giffile);
+        }
+        if (loaded == -1) {
+            if (opt_progress)
+                fprintf(stderr, "\n");
+            warn("load cache file %s", cache_path);
+            (void)unlink(cache_path);
+            wscons_animation_destroy(&animation);
+            wscons_animation_init(&animation);
+            cache_hit = false;
+            from_container = false;
+            giffile = source_file;
+            if (opt_progress)
+                fprintf(stderr, "Loading GIF file...");
+        }
+        screen_width = animation.info.width;
+        screen_height = animation.info.height;
+    }
+    if (!from_container) {
+        gif = DGifOpenFileName(giffile, &gif_error);
+        if (gif == NULL)
+            FAIL_MSG("cannot open %s: %s", giffile,
+              GifErrorString(gif_error));
+
+        if (gif->SWidth <= 0 || gif->SHeight <= 0)
+            FAIL_MSG("invalid GIF logical screen size: %dx%d",
+              gif->SWidth, gif->SHeight);
+        screen_width = (unsigned int)gif->SWidth;
+        screen_height = (unsigned int)gif->SHeight;
+    }
+
+    if (screen_width > display.width || screen_height > display.height) {
+        FAIL_MSG("GIF logical screen %ux%u does not fit framebuffer %ux%u",
+          screen_width, screen_height, display.width, display.height);
     }
     if (display_position_resolve(&position, &display,
-      (unsigned int)gif->SWidth, (unsigned int)gif->SHeight,
+      screen_width, screen_height,
       opt_center != 0, requested_x, requested_y) == -1) {
         FAIL_MSG("requested position does not fit GIF logical screen "
-          "%dx%d in framebuffer %ux%u",
-          gif->SWidth, gif->SHeight, display.width, display.height);
+          "%ux%u in framebuffer %ux%u",
+          screen_width, screen_height, display.width, display.height);
     }
 
-    if (DGifSlurp(gif) != GIF_OK)
+    /*
+     * Only the image descriptors are read here.  Frames are decoded one at
+     * a time from a second handle below, so a whole animation of 8bpp
+     * rasters is never held in memory at once.
+     */
+    if (!from_container && mono_gif_scan_frames(gif) != GIF_OK)
         FAIL_MSG("cannot load %s: %s", giffile, GifErrorString(gif->Error));
 
     if (opt_duration)
@@ -1532,40 +1450,125 @@ main(int argc, char **argv)
         fprintf(stderr, "position: %u,%u\n", position.x, position.y);
     }
 
-    if (gif->ImageCount <= 0)
-        FAIL_MSG("%s contains no GIF image frames", giffile);
-
-    if (mono_gif_info_init(&gif_info, (unsigned int)gif->SWidth,
-      (unsigned int)gif->SHeight, gif->ImageCount) == -1)
-        FAIL_ERRNO("initialize monochrome GIF geometry");
+    if (from_container) {
+        if (opt_progress) {
+            fprintf(stderr,
+              "%s: %ux%u, %d frames, precompiled 1bpp pool %zu bytes\n",
+              giffile, animation.info.width,
+              animation.info.height, animation.info.frame_count,
+              animation.bitmap_pool_size);
+            if (stream_frames > 0)
+                fprintf(stderr, "Streaming through %ld frames of %zu "
+                  "bytes\n", stream_frames, stream.slot_size);
+        }
+    } else {
+        if (gif->ImageCount <= 0)
+            FAIL_MSG("%s contains no GIF image frames", giffile);
+
+        if (mono_gif_info_init(&gif_info, (unsigned int)gif->SWidth,
+          (unsigned int)gif->SHeight, gif->ImageCount) == -1)
+            FAIL_ERRNO("initialize monochrome GIF geometry");
+
+        if (wscons_animation_allocate(&animation, &gif_info, gif,
+          &load_options) == -1) {
+            if (errno == ENOSPC && memory_budget > 0)
+                FAIL_MSG("%s does not fit in %ld bytes", giffile,
+                  memory_budget);
+            FAIL_ERRNO("allocate monochrome frame pool");
+        }
 
-    if (wscons_animation_allocate(&animation, &gif_info, gif) == -1)
-        FAIL_ERRNO("allocate monochrome frame pool");
+        raster_max = 0;
+        for (i = 0; i < gif->ImageCount; i++) {
+            const GifImageDesc *desc = &gif->SavedImages[i].ImageDesc;
+            uint64_t raster_size;
 
-    raster_total = 0;
-    for (i = 0; i < gif->ImageCount; i++) {
-        const GifImageDesc *desc = &gif->SavedImages[i].ImageDesc;
-        raster_total += (uint64_t)desc->Width * (uint64_t)desc->Height;
-    }
+            raster_size = (uint64_t)desc->Width * (uint64_t)desc->Height;
+            if (raster_size > raster_max)
+                raster_max = raster_size;
+        }
 
-    if (opt_progress) {
-        fprintf(stderr,
-          "%s: %ux%u, %d frames, RasterBits %llu bytes, 1bpp pool %zu bytes\n",
-          giffile, animation.info.width,
-          animation.info.height, animation.info.frame_count,
-          (unsigned long long)raster_total, animation.bitmap_pool_size);
-    }
+        if (opt_progress) {
+            fprintf(stderr,
+              "%s: %ux%u, %d frames, largest RasterBits %llu bytes, "
+              "1bpp pool %zu bytes\n",
+              giffile, animation.info.width,
+              animation.info.height, animation.info.frame_count,
+              (unsigned long long)raster_max, animation.bitmap_pool_size);
+        }
 
-    if (wscons_extract_mono_frames(gif, &animation) == -1)
-        FAIL_ERRNO("extract monochrome GIF frames");
+        if (DGifCloseFile(gif, &gif_error) != GIF_OK) {
+            gif = NULL;
+            FAIL_MSG("close %s: %s", giffile, GifErrorString(gif_error));
+        }
+        gif = DGifOpenFileName(giffile, &gif_error);
+        if (gif == NULL)
+            FAIL_MSG("cannot open %s: %s", giffile,
+              GifErrorString(gif_error));
+        if (gif->SWidth != (int)screen_width ||
+          gif->SHeight != (int)screen_height)
+            FAIL_MSG("%s changed while loading", giffile);
+
+        if (wscons_extract_mono_frames(gif, &animation) == -1) {
+            if (errno == 0)
+                FAIL_MSG("cannot load %s: %s", giffile,
+                  GifErrorString(gif->Error));
+            if (errno == ENOSPC && memory_budget > 0)
+                FAIL_MSG("%s does not fit in %ld bytes", giffile,
+                  memory_budget);
+            FAIL_ERRNO("extract monochrome GIF frames");
+        }
 
-    if (DGifCloseFile(gif, &gif_error) != GIF_OK) {
+        if (DGifCloseFile(gif, &gif_error) != GIF_OK) {
+            gif = NULL;
+            FAIL_MSG("close %s: %s", giffile, GifErrorString(gif_error));
+        }
         gif = NULL;
-        FAIL_MSG("close %s: %s", giffile, GifErrorString(gif_error));
+
+        /* Playback goes on without the cache if it cannot be written. */
+        if (cache_directory != NULL) {
+            if (opt_progress)
+                fprintf(stderr, "Writing %s...", cache_path);
+            if (wscons_cache_store(&animation, cache_directory,
+              cache_path) == -1) {
+                if (opt_progress)
+                    fprintf(stderr, "\n");
+                warn("write cache file %s", cache_path);
+            } else {
+                cache_stored = true;
+                if (opt_progress)
+                    fprintf(stderr, " completed.\n");
+            }
+        }
+
+        /* Without a stored file, the frames converted above are played. */
+        if (stream_frames > 0 && !cache_stored) {
+            stream_frames = 0;
+        } else if (stream_frames > 0) {
+            wscons_animation_destroy(&animation);
+            wscons_animation_init(&animation);
+            if (wscons_stream_open(&stream, &animation, cache_path,
+              &load_options, (int)stream_frames) == -1)
+                FAIL_ERRNO("open animation file %s for streaming",
+                  cache_path);
+            if (opt_progress)
+                fprintf(stderr, "Streaming through %ld frames of %zu "
+                  "bytes\n", stream_frames, stream.slot_size);
+        }
     }
-    gif = NULL;
 
     wscons_animation_finish_loading(&animation);
+    if (start_frame >= animation.info.frame_count)
+        FAIL_MSG("start frame %ld is past the last frame %d", start_frame,
+          animation.info.frame_count - 1);
+    if (opt_drop) {
+        /* Frames are also drawn here so dropped ones can be caught up. */
+        shadow.width = animation.info.width;
+        shadow.height = animation.info.height;
+        shadow.stride = (unsigned int)animation.info.line_bytes;
+        shadow.fb_base = calloc(1, animation.info.frame_bytes);
+        if (shadow.fb_base == NULL)
+            FAIL_ERRNO("allocate shadow screen");
+    }
 
     if (opt_duration) {
         uint32_t total_end_time = gettime_ms();
@@ -1573,12 +1576,38 @@ main(int argc, char **argv)
         fprintf(stderr, "\nSummary:\n");
         fprintf(stderr, "Total processing time: %u ms\n",
           total_end_time - total_start_time);
-        fprintf(stderr, "GIF file loading time: %u ms\n",
+        fprintf(stderr, "%s file loading time: %u ms\n",
+          from_container ? "Animation" : "GIF",
           gifload_end_time - gifload_start_time);
-        fprintf(stderr, "Total frame processing time: %u ms\n",
-          total_frame_time);
-        fprintf(stderr, "Average frame processing time: %u ms\n",
-          total_frame_time / (uint32_t)animation.info.frame_count);
+        if (cache_directory != NULL)
+            fprintf(stderr, "Conversion cache: %s\n",
+              cache_hit ? "hit" : cache_stored ? "stored" : "not stored");
+        if (!from_container) {
+            fprintf(stderr, "Total frame processing time: %u ms\n",
+              animation.total_frame_time);
+            fprintf(stderr, "Average frame processing time: %u ms\n",
+              animation.total_frame_time /
+              (uint32_t)animation.info.frame_count);
+            fprintf(stderr, "Changed-region trimming: %zu bytes saved "
+              "in %d frames\n", animation.trimmed_bytes,
+              animation.trimmed_frames);
+            fprintf(stderr, "Deduplication: %zu bytes saved in %d frames\n",
+              animation.dedup_bytes, animation.dedup_frames);
+            fprintf(stderr, "Motion copies: %d frames\n",
+              animation.move_frames);
+            if (opt_tiles)
+                fprintf(stderr, "Tile dictionary: %d tiles\n",
+                  animation.tile_count);
+            if (keyframe_interval > 0 || keyframe_bytes > 0)
+                fprintf(stderr, "Keyframes: %d inserted\n",
+                  animation.key_frames);
+            if (coalesce_ms > 0)
+                fprintf(stderr, "Coalesced frames: %d merged\n",
+                  animation.coalesced_frames);
+        }
+        if (animation.loop_frame != NULL)
+            fprintf(stderr, "Loop frame: %zu bytes\n",
+              animation.loop_frame->data_size);
         fprintf(stderr, "1bpp frame pool: %zu bytes\n",
           animation.bitmap_pool_size);
     }
@@ -1601,18 +1630,98 @@ main(int argc, char **argv)
         background_line = NULL;
     }
 
-    for (;;) {
-        for (i = 0; i < animation.info.frame_count; i++) {
+    window.stream = stream_frames > 0 ? &stream : NULL;
+    drawing = window.stream != NULL ? &stream.view : &animation;
+    if (start_frame > 0 && wsdisplay_seek(&display, &animation,
+      window.stream, (int)start_frame - 1, position.x, position.y) == -1)
+        FAIL_ERRNO("seek to GIF frame %ld", start_frame);
+    if (opt_drop && start_frame > 0 && wsdisplay_seek(&shadow, &animation,
+      window.stream, (int)start_frame - 1, 0, 0) == -1)
+        FAIL_ERRNO("seek to GIF frame %ld", start_frame);
+
+    /*
+     * Frames are paged in a few ahead of playback, then let go.  Streamed
+     * frames are read ahead to fill the ring instead.
+     */
+    window.animation = &animation;
+    window.pending = false;
+    window.filling = true;
+    if (window.stream != NULL) {
+        while ((filled = wscons_stream_fill(&stream)) == 1)
+            continue;
+        if (filled == -1)
+            FAIL_ERRNO("read %s", giffile);
+    }
+    wscons_animation_prefetch(&animation, (int)start_frame, false,
+      PREFETCH_FRAMES);
+
+    due_time = gettime_ms();
+    for (looped = false;; looped = true) {
+        for (i = looped ? 0 : (int)start_frame;
+          i < animation.info.frame_count; i++) {
+            const WsconsFrame *frame;
             uint32_t nextframe_time;
 
             if (stop_requested)
                 goto playback_done;
 
-            nextframe_time = gettime_ms() + animation.frames[i].gif.delay;
-            if (wsdisplay_blit_frame(&display, &animation, i,
-              position.x, position.y) == -1)
+            /*
+             * Later passes start from the change back to the first frame,
+             * which the stream also reads in its turn.
+             */
+            if (window.stream != NULL) {
+                frame = wscons_stream_next(&stream);
+                if (frame == NULL)
+                    FAIL_ERRNO("read GIF frame %d", i);
+                window.filling = true;
+            } else {
+                frame = &animation.frames[i];
+                if (i == 0 && looped && animation.loop_frame != NULL)
+                    frame = animation.loop_frame;
+            }
+            window.frame = i + 1;
+            window.looped = looped;
+            if (window.frame == animation.info.frame_count) {
+                window.frame = 0;
+                window.looped = true;
+            }
+            window.pending = true;
+            if (!opt_drop) {
+                nextframe_time = gettime_ms() + frame->gif.delay;
+                if (wsdisplay_blit_frame(&display, drawing, frame,
+                  position.x, position.y) == -1)
+                    FAIL_ERRNO("draw GIF frame %d", i);
+                if (wait_until(nextframe_time, display.stdin_is_tty,
+                  &window) == -1)
+                    FAIL_ERRNO("wait for GIF frame %d", i);
+                continue;
+            }
+
+            /*
+             * Frames follow a fixed schedule.  A frame whose display time
+             * has already run out is only composited into the shadow
+             * screen; the next frame drawn also copies the area it changed.
+             */
+            if (wsdisplay_blit_frame(&shadow, drawing, frame, 0, 0) == -1)
+                FAIL_ERRNO("composite GIF frame %d", i);
+            nextframe_time = due_time + frame->gif.delay;
+            due_time = nextframe_time;
+            if (frame->gif.delay != 0 &&
+              (int32_t)(gettime_ms() - nextframe_time) >= 0) {
+                dirty_rect_add(&dirty, frame);
+                dropped_frames++;
+                continue;
+            }
+            if (dirty.right != 0) {
+                dirty_rect_add(&dirty, frame);
+                wsdisplay_blit_dirty(&display, &animation, &shadow, &dirty,
+                  position.x, position.y);
+            } else if (wsdisplay_blit_frame(&display, drawing, frame,
+              position.x, position.y) == -1) {
                 FAIL_ERRNO("draw GIF frame %d", i);
-            if (wait_until(nextframe_time, display.stdin_is_tty) == -1)
+            }
+            if (wait_until(nextframe_time, display.stdin_is_tty,
+              &window) == -1)
                 FAIL_ERRNO("wait for GIF frame %d", i);
         }
     }
@@ -1626,9 +1735,27 @@ cleanup:
     monobg_reader_close(&background);
     free(background_line);
     wsdisplay_cleanup(&display);
+    wscons_stream_close(&stream);
+    free(shadow.fb_base);
     wscons_animation_destroy(&animation);
+    free(cache_path);
     free(progpath);
 
+    if (exit_status == EXIT_SUCCESS && opt_drop && opt_duration)
+        fprintf(stderr, "Dropped frames: %d\n", dropped_frames);
+    if (exit_status == EXIT_SUCCESS && stream_frames > 0 && opt_duration)
+        fprintf(stderr, "Streamed frames: %d read ahead, %d waited for\n",
+          stream.ahead_frames, stream.waited_frames);
+    if (exit_status == EXIT_SUCCESS && opt_calibrate) {
+        if (opt_progress)
+            fprintf(stderr, "Blit cost: %u ns per frame, %u ns per row, "
+              "%u ns per KiB, %u ns per merged edge, "
+              "%u ns per unaligned KiB\n", blit_cost.call, blit_cost.row,
+              blit_cost.kbyte, blit_cost.edge, blit_cost.unaligned);
+        printf("%u,%u,%u,%u,%u\n", blit_cost.call, blit_cost.row,
+          blit_cost.kbyte, blit_cost.edge, blit_cost.unaligned);
+    }
+
     if (have_error) {
         if (saved_errno != 0) {
             errno = saved_errno;
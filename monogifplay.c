@@ -9,6 +9,7 @@
 #include <libgen.h>
 #include <time.h>
 #include <err.h>
+#include <errno.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -16,36 +17,7 @@
 
 #include <gif_lib.h>
 
-#ifdef UNROLL_BITMAP_EXTRACT
-#if defined(__linux__) || defined(__APPLE__)
-#include <endian.h>
-#elif defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-#include <sys/endian.h>
-#endif
-
-/* Try to check endianness without autoconf etc. */
-#if defined(__BYTE_ORDER__) && \
-  defined(__ORDER_LITTLE_ENDIAN__) && defined(__ORDER_BIG_ENDIAN__)
-# define TARGET_LITTLE_ENDIAN (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
-# define TARGET_BIG_ENDIAN    (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
-#elif defined(_BYTE_ORDER) && \
-  defined(_LITTLE_ENDIAN) && defined(_BIG_ENDIAN)
-# define TARGET_LITTLE_ENDIAN (_BYTE_ORDER == _LITTLE_ENDIAN)
-# define TARGET_BIG_ENDIAN    (_BYTE_ORDER == _BIG_ENDIAN)
-#elif defined(BYTE_ORDER) && \
-  defined(LITTLE_ENDIAN) && defined(BIG_ENDIAN)
-# define TARGET_LITTLE_ENDIAN (BYTE_ORDER == LITTLE_ENDIAN)
-# define TARGET_BIG_ENDIAN    (BYTE_ORDER == BIG_ENDIAN)
-#else
-# error "Cannot determine endianness."
-#endif
-
-/* Assume gcc 4.x and later (or clang) for __builtin_bswap32() */
-/* OpenBSD/luna88k still uses gcc3 but fortunately it's big endian */
-#ifndef bswap32
-#define bswap32(x) __builtin_bswap32(x)
-#endif
-#endif /* UNROLL_BITMAP_EXTRACT */
+#include "mono_gif.h"
 
 /* monochrome frame structure */
 typedef struct {
@@ -60,6 +32,8 @@ static const char *progname = NULL;
 /* Option flags */
 int opt_duration = 0;
 int opt_progress = 0;
+int opt_threads = 1;
+int opt_index = 0;
 
 /* Global variables for time measurement (in milliseconds). */
 uint32_t total_start_time = 0, total_end_time = 0;
@@ -73,8 +47,6 @@ static uint32_t tv_sec_start;
 #define powerof2(x)	((((x) - 1) & (x)) == 0)
 #define roundup(x, y)   ((((x) + ((y) - 1)) / (y)) * (y))
 
-#define DEF_GIF_DELAY	75
-
 #define DEF_GEOM_X	10
 #define DEF_GEOM_Y	10
 
@@ -112,35 +84,24 @@ gettime_ms(void)
     return tv_sec * 1000U + ts.tv_nsec / 1000000U;
 }
 
-/* extract monochrome frames from gif file */
+/*
+ * Extract monochrome frames from gif file.  The GIF is decoded record by
+ * record, and each 8bpp raster is freed as soon as its frame is rendered.
+ */
 static int
-extract_mono_frames(GifFileType *gif, MonoFrame *frames)
+extract_mono_frames(GifFileType *gif, const MonoGifInfo *info,
+  MonoFrame *frames)
 {
     int i, frame_count;
-    unsigned int swidth, sheight, line_bytes;
 
-    frame_count = gif->ImageCount;
-    swidth  = gif->SWidth;
-    sheight = gif->SHeight;
-    line_bytes = (swidth + 7U) / 8U;
+    frame_count = info->frame_count;
 
     for (i = 0; i < frame_count; i++) {
         uint32_t frame_start_time = 0, frame_end_time = 0;
-        unsigned int ci, x, y;
-        unsigned int screenx, screeny, frame_row_offset, bitmap_row_offset;
-#ifdef UNROLL_BITMAP_EXTRACT
-        unsigned int unaligned_pixels;
-#endif
-        unsigned int frame_width, frame_height, frame_left, frame_top;
-        unsigned int ncolors;
         MonoFrame *frame = &frames[i];
-        SavedImage *img;
-        GifImageDesc *desc;
-        ColorMapObject *cmap;
-        GraphicsControlBlock gcb;
+        MonoGifFrameInfo frame_info;
         uint8_t *bitmap;
-        int delay, transparent_index;
-        uint32_t bw_bit_cache[256];
+        int gif_frame;
 
         if (opt_progress) {
             /* Show progress for each frame */
@@ -151,26 +112,8 @@ extract_mono_frames(GifFileType *gif, MonoFrame *frames)
             /* Start timing for this frame */
             frame_start_time = gettime_ms();
         }
-        img = &gif->SavedImages[i];
-        desc = &img->ImageDesc;
-
-        cmap = desc->ColorMap ? desc->ColorMap : gif->SColorMap;
-        if (cmap == NULL) {
-            if (opt_progress) {
-                fprintf(stderr, "\n");
-            }
-            fprintf(stderr, "No valid color map in frame %d\n", i);
-            return -1;
-        }
-
-        frame->width  = swidth;
-        frame->height = sheight;
-        DGifSavedExtensionToGCB(gif, i, &gcb);
-        delay = gcb.DelayTime * 10; /* delay is stored in 1/100 sec */
-        frame->delay = delay > 0 ? delay : DEF_GIF_DELAY;
-        transparent_index = gcb.TransparentColor;
 
-        bitmap = malloc(line_bytes * sheight);
+        bitmap = malloc(info->frame_bytes);
         if (bitmap == NULL) {
             if (opt_progress) {
                 fprintf(stderr, "\n");
@@ -180,284 +123,26 @@ extract_mono_frames(GifFileType *gif, MonoFrame *frames)
         }
         frame->bitmap_data = bitmap;
 
-        frame_width  = desc->Width;
-        frame_height = desc->Height;
-        frame_left   = desc->Left;
-        frame_top    = desc->Top;
-
-        if (transparent_index != NO_TRANSPARENT_COLOR ||
-          swidth != frame_width || sheight != frame_height ||
-          frame_left != 0 || frame_top != 0) {
-            if (i == 0) {
-                /* first frame should have whole screen data */
-                memset(bitmap, 0, line_bytes * sheight);
-            } else {
-                /* copy the previous frame for transparent color etc. */
-                memcpy(bitmap, frames[i - 1].bitmap_data, line_bytes * sheight);
-            }
-        }
-
-        memset(bw_bit_cache, 0, sizeof(bw_bit_cache));
-        ncolors = cmap->ColorCount;
-        for (ci = 0; ci < ncolors; ci++) {
-            GifColorType c = cmap->Colors[ci];
-            if (c.Red * 299 + c.Green * 587 + c.Blue * 114 > 128000) {
-                bw_bit_cache[ci] =
-#ifdef UNROLL_BITMAP_EXTRACT
-                  0x80000000U;
-#else
-                  0x80U;
-#endif
+        /*
+         * The previous frame's bitmap is passed as the base for the
+         * transparent pixels and those outside this frame's image.
+         */
+        if (mono_gif_decode_frame(gif, info, bitmap,
+          i == 0 ? NULL : frames[i - 1].bitmap_data, &frame_info,
+          &gif_frame) == -1 || gif_frame != i) {
+            if (opt_progress) {
+                fprintf(stderr, "\n");
             }
+            fprintf(stderr, "Failed to decode frame %d: %s\n", i,
+              gif->Error != D_GIF_SUCCEEDED ? GifErrorString(gif->Error) :
+              gif_frame != i ? "unexpected end of file" : "invalid image");
+            return -1;
         }
 
-#ifdef UNROLL_BITMAP_EXTRACT
-        unaligned_pixels = (32U - (frame_left & 31U)) & 31U;
-        if (unaligned_pixels > frame_width)
-            unaligned_pixels = frame_width;
-
-        for (y = 0, screeny = frame_top,
-          bitmap_row_offset = frame_top * line_bytes,
-          frame_row_offset = 0;
-          y < frame_height;
-          y++, screeny++,
-          bitmap_row_offset += line_bytes,
-          frame_row_offset += frame_width) {
-            GifByteType *raster, px;
-            uint8_t *bitmapp;
-
-            /* 1. 8 bit per byte ops until the first 4 byte boundary */
-            for (x = 0, screenx = frame_left,
-              raster = &img->RasterBits[frame_row_offset];
-              x < unaligned_pixels;
-              x++, screenx++) {
-                unsigned int byte, bit, bitmap_byte_offset;
-
-                px = *raster++;
-                if (px == transparent_index) {
-                    /* leave transparent pixels unchanged */
-                    continue;
-                }
-
-                byte = screenx >> 3;
-                bitmap_byte_offset = bitmap_row_offset + byte;
-                bit  = screenx & 0x07U;
-                bitmap[bitmap_byte_offset] &= ~(0x80U >> bit);
-                bitmap[bitmap_byte_offset] |= bw_bit_cache[px] >> (bit + 24U);
-            }
-
-            /* 2. 32 bits per word ops */
-            for (bitmapp = &bitmap[bitmap_row_offset + (screenx >> 3)];
-              x + 31 < frame_width;
-              x += 32, screenx += 32, bitmapp += 4) {
-                uint32_t bitmap32;
-
-                /* unroll all 32 bits */
-                if (transparent_index == NO_TRANSPARENT_COLOR) {
-                    bitmap32  = bw_bit_cache[*raster++] >> 0U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 1U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 2U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 3U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 4U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 5U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 6U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 7U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 8U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 9U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 10U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 11U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 12U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 13U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 14U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 15U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 16U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 17U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 18U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 19U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 20U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 21U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 22U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 23U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 24U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 25U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 26U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 27U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 28U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 29U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 30U;
-                    bitmap32 |= bw_bit_cache[*raster++] >> 31U;
-#if TARGET_LITTLE_ENDIAN
-                    /* bitmap byte order is MSB First */
-                    bitmap32 = bswap32(bitmap32);
-#endif
-                    *(uint32_t *)bitmapp = bitmap32;
-                } else {
-                    bitmap32 = *(uint32_t *)bitmapp;
-#if TARGET_LITTLE_ENDIAN
-                    /* bitmap byte order is MSB First */
-                    bitmap32 = bswap32(bitmap32);
-#endif
-#define UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache, \
-  px, transparent_index, bitpos) \
-    do { \
-        if ((px) != (transparent_index)) { \
-            (bitmap32) &= ~(0x80000000U >> (bitpos)); \
-            (bitmap32) |= ((bw_bit_cache)[px] >> (bitpos)); \
-        } \
-    } while (0)
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 0U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 1U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 2U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 3U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 4U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 5U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 6U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 7U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 8U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 9U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 10U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 11U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 12U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 13U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 14U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 15U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 16U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 17U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 18U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 19U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 20U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 21U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 22U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 23U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 24U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 25U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 26U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 27U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 28U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 29U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 30U);
-                    px = *raster++;
-                    UPDATE_BITMAP32_BIT(bitmap32, bw_bit_cache,
-                      px, transparent_index, 31U);
-#undef UPDATE_BITMAP32_BIT
-#if TARGET_LITTLE_ENDIAN
-                    /* bitmap byte order is MSB First */
-                    bitmap32 = bswap32(bitmap32);
-#endif
-                    *(uint32_t *)bitmapp = bitmap32;
-                }
-            }
-
-            /* 3. rest 8 bit per byte ops */
-            for (; x < frame_width; x++, screenx++) {
-                unsigned int byte, bit, bitmap_byte_offset;
-
-                px = *raster++;
-                if (px == transparent_index) {
-                    /* leave transparent pixels unchanged */
-                    continue;
-                }
-
-                byte = screenx >> 3;
-                bitmap_byte_offset = bitmap_row_offset + byte;
-                bit  = screenx & 0x07U;
-                bitmap[bitmap_byte_offset] &= ~(0x80U >> bit);
-                bitmap[bitmap_byte_offset] |= bw_bit_cache[px] >> (bit + 24U);
-            }
-        }
-#else
-        for (y = 0, screeny = frame_top,
-          bitmap_row_offset = frame_top * line_bytes,
-          frame_row_offset = 0;
-          y < frame_height;
-          y++, screeny++,
-          bitmap_row_offset += line_bytes,
-          frame_row_offset += frame_width) {
-            int frame_byte_offset;
-            for (x = 0, screenx = frame_left,
-              frame_byte_offset = frame_row_offset;
-              x < frame_width;
-              x++, screenx++, frame_byte_offset++) {
-                unsigned int byte, bit, bitmap_byte_offset;
-                GifByteType px;
-
-                px = img->RasterBits[frame_byte_offset];
-                if (px == transparent_index) {
-                    /* leave transparent pixels unchanged */
-                    continue;
-                }
+        frame->width  = info->width;
+        frame->height = info->height;
+        frame->delay  = frame_info.delay;
 
-                byte = screenx >> 3;
-                bitmap_byte_offset = bitmap_row_offset + byte;
-                bit  = screenx & 0x07U;
-                /* set/reset pixels using cached b&w data per palette */
-                bitmap[bitmap_byte_offset] &= ~(0x80U >> bit);
-                bitmap[bitmap_byte_offset] |= bw_bit_cache[px] >> bit;
-            }
-        }
-#endif
         if (opt_progress) {
             if (opt_duration) {
                 /* End timing for this frame and report */
@@ -476,6 +161,89 @@ extract_mono_frames(GifFileType *gif, MonoFrame *frames)
     return 0;
 }
 
+#ifdef THREADED_RENDER
+/*
+ * Extract monochrome frames on opt_threads threads, each decoding the
+ * frames it takes from where the index says they start.
+ */
+static int
+render_mono_frames(MonoGifIndex *index, const MonoGifInfo *info,
+  MonoFrame *frames)
+{
+    uint32_t start_time = 0, frame_time;
+    MonoGifFrameInfo *frame_infos;
+    uint8_t **bitmaps;
+    int i, frame_count;
+
+    frame_count = info->frame_count;
+
+    if (opt_progress) {
+        fprintf(stderr, "Preparing bitmaps for %d frames on %d threads...",
+          frame_count, opt_threads);
+    }
+    if (opt_duration) {
+        start_time = gettime_ms();
+    }
+
+    frame_infos = calloc(frame_count, sizeof(MonoGifFrameInfo));
+    bitmaps = calloc(frame_count, sizeof(uint8_t *));
+    if (frame_infos == NULL || bitmaps == NULL) {
+        if (opt_progress) {
+            fprintf(stderr, "\n");
+        }
+        fprintf(stderr, "Failed to allocate frame tables\n");
+        free(frame_infos);
+        free(bitmaps);
+        return -1;
+    }
+    for (i = 0; i < frame_count; i++) {
+        bitmaps[i] = malloc(info->frame_bytes);
+        if (bitmaps[i] == NULL) {
+            if (opt_progress) {
+                fprintf(stderr, "\n");
+            }
+            fprintf(stderr, "Failed to allocate bitmap for frame %d\n", i);
+            free(frame_infos);
+            free(bitmaps);
+            return -1;
+        }
+        frames[i].bitmap_data = bitmaps[i];
+    }
+
+    if (mono_gif_render_frames(index, info, bitmaps, frame_infos,
+      opt_threads) == -1) {
+        if (opt_progress) {
+            fprintf(stderr, "\n");
+        }
+        fprintf(stderr, "Failed to decode frames: %s\n",
+          errno == 0 ? GifErrorString(index->error) : strerror(errno));
+        free(frame_infos);
+        free(bitmaps);
+        return -1;
+    }
+
+    for (i = 0; i < frame_count; i++) {
+        frames[i].width  = info->width;
+        frames[i].height = info->height;
+        frames[i].delay  = frame_infos[i].delay;
+    }
+    free(frame_infos);
+    free(bitmaps);
+
+    if (opt_progress) {
+        if (opt_duration) {
+            frame_time = gettime_ms() - start_time;
+            total_frame_time += frame_time;
+            fprintf(stderr, " completed in %u ms.\n", frame_time);
+        } else {
+            fprintf(stderr, "\n");
+        }
+    }
+
+    return 0;
+}
+#endif /* THREADED_RENDER */
+
 static int
 create_pixmap_for_frames(Display *dpy, int screen,
   MonoFrame *frames, int frame_count, int swidth, int sheight)
@@ -772,10 +540,22 @@ align_window_x(Display *dpy, Window win, int screen, unsigned int align)
     }
 }
 
+#ifdef THREADED_RENDER
+#define THREAD_USAGE " [-j threads [-i]]"
+#define THREAD_HELP \
+      "  -i           Keep the frame index for -j in gif-file.idx.\n" \
+      "  -j threads   Prepare the frame bitmaps on this many threads.\n"
+#else
+#define THREAD_USAGE ""
+#define THREAD_HELP ""
+#endif
+
 static void
 usage(void)
 {
-    fprintf(stderr, "Usage: %s [-a] [-d] [-p] [-g geometry] gif-file\n",
+    fprintf(stderr,
+      "Usage: %s [-a] [-d] [-p] [-g geometry]" THREAD_USAGE "\n"
+      "       gif-file\n",
       progname != NULL ? progname : "monogifplay");
     fprintf(stderr,
       "  -a align     Align client window to multiple of align at startup\n"
@@ -783,6 +563,7 @@ usage(void)
       "  -d           Show duration (time) info for each process. (assume -p)\n"
       "  -p           Show progress messages for each process.\n"
       "  -g geometry  Set window geometry (WxH+X+Y).\n"
+      THREAD_HELP
     );
     exit(EXIT_FAILURE);
 }
@@ -791,12 +572,17 @@ int
 main(int argc, char *argv[])
 {
     char *progpath, *giffile;
+#ifdef THREADED_RENDER
+    char *index_file = NULL;
+    MonoGifIndex index;
+#endif
     int opt;
     int err, screen;
     int frame_count;
     int i;
     char title[512];
     GifFileType *gif;
+    MonoGifInfo info;
     MonoFrame *frame, *frames;
     Display *dpy;
     int swidth, sheight;
@@ -811,7 +597,7 @@ main(int argc, char *argv[])
     progpath = strdup(argv[0]);
     progname = basename(progpath);
 
-    while ((opt = getopt(argc, argv, "a:dg:p")) != -1) {
+    while ((opt = getopt(argc, argv, "a:dg:ij:p")) != -1) {
         switch (opt) {
         char *endptr;
         case 'a':
@@ -829,11 +615,22 @@ main(int argc, char *argv[])
         case 'g':
             geometry = strdup(optarg);
             break;
+#ifdef THREADED_RENDER
+        case 'i':
+            opt_index = 1;
+            break;
+        case 'j':
+            opt_threads = (int)strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opt_threads < 1) {
+                usage();
+            }
+            break;
+#endif
         default:
             usage();
         }
     }
-    if (optind + 1 != argc) {
+    if (optind + 1 != argc || (opt_index && opt_threads <= 1)) {
         usage();
     }
 
@@ -860,7 +657,8 @@ main(int argc, char *argv[])
           GifErrorString(err));
     }
 
-    if (DGifSlurp(gif) != GIF_OK) {
+    /* Read only the image descriptors; frames are decoded below. */
+    if (mono_gif_scan_frames(gif) != GIF_OK) {
         if (opt_progress) {
             fprintf(stderr, "\n");
         }
@@ -887,12 +685,50 @@ main(int argc, char *argv[])
             swidth, sheight, frame_count, gif->SColorMap->ColorCount);
     }
 
+    if (mono_gif_info_init(&info, swidth, sheight, frame_count) == -1) {
+        errx(EXIT_FAILURE, "Invalid gif geometry or no frames");
+    }
+
     frames = calloc(frame_count, sizeof(MonoFrame));
     if (frames == NULL) {
         errx(EXIT_FAILURE, "Failed to allocate memory for frame data");
     }
 
-    if (extract_mono_frames(gif, frames) < 0 || frame_count == 0) {
+    /* Reopen the file to decode frames one by one. */
+    DGifCloseFile(gif, NULL);
+    gif = DGifOpenFileName(giffile, &err);
+    if (gif == NULL) {
+        errx(EXIT_FAILURE, "Failed to open a gif file: %s",
+          GifErrorString(err));
+    }
+
+#ifdef THREADED_RENDER
+    if (opt_threads > 1) {
+        /* Frames are decoded on each thread from where they start. */
+        if (opt_index) {
+            index_file = malloc(strlen(giffile) + sizeof(".idx"));
+            if (index_file == NULL) {
+                errx(EXIT_FAILURE, "Failed to allocate index file name");
+            }
+            strcpy(index_file, giffile);
+            strcat(index_file, ".idx");
+        }
+        if (mono_gif_index_open(&index, giffile, index_file) == -1) {
+            errx(EXIT_FAILURE, "Failed to index a gif file: %s",
+              strerror(errno));
+        }
+        if (index_file != NULL && !index.from_sidecar &&
+          mono_gif_index_save(&index, index_file) == -1) {
+            warn("Failed to write %s", index_file);
+        }
+        if (render_mono_frames(&index, &info, frames) < 0) {
+            errx(EXIT_FAILURE, "Failed to extract mono frames");
+        }
+        mono_gif_index_close(&index);
+        free(index_file);
+    } else
+#endif
+    if (extract_mono_frames(gif, &info, frames) < 0) {
         errx(EXIT_FAILURE, "Failed to extract mono frames");
     }
 
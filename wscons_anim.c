@@ -0,0 +1,3249 @@
+/*
+ * wscons frame storage shared by monogifplay-wscons and gif2monoanim.
+ *
+ * This module lays out the variable-sized frame pool and fills it from GIF
+ * frames or from a precompiled animation file.  It contains no wsdisplay
+ * code, so the packer can be built and run on any host.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gif_lib.h>
+
+#include "mono_gif.h"
+#include "monoanim_format.h"
+#include "wscons_anim.h"
+
+static int
+size_mul(size_t a, size_t b, size_t *result)
+{
+    if (a != 0 && b > SIZE_MAX / a) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    *result = a * b;
+    return 0;
+}
+
+static int
+size_add(size_t a, size_t b, size_t *result)
+{
+    if (b > SIZE_MAX - a) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    *result = a + b;
+    return 0;
+}
+
+static void
+put_be16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static void
+put_be32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static uint16_t
+get_be16(const uint8_t *p)
+{
+    return (uint16_t)(((uint16_t)p[0] << 8) | p[1]);
+}
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) |
+      ((uint32_t)p[1] << 16) |
+      ((uint32_t)p[2] << 8) |
+      (uint32_t)p[3];
+}
+
+/* Number of tiles in the grid covering the logical screen. */
+static int
+wscons_tile_grid(const MonoGifInfo *info, size_t *tiles)
+{
+    return size_mul((info->line_bytes + WSCONS_TILE_BYTES - 1U) /
+      WSCONS_TILE_BYTES, (info->height + WSCONS_TILE_ROWS - 1U) /
+      WSCONS_TILE_ROWS, tiles);
+}
+
+/*
+ * Tile grid covering the update rectangle of a frame: first tile column and
+ * row, and the number of tile columns and rows.
+ */
+static void
+wscons_tile_range(const WsconsFrame *frame, unsigned int *tx0,
+  unsigned int *ty0, unsigned int *columns, unsigned int *rows)
+{
+    unsigned int byte_left, byte_right, bottom;
+
+    byte_left = frame->gif.update_left / 8U;
+    byte_right = (frame->gif.update_left + frame->gif.update_width + 7U) /
+      8U;
+    bottom = frame->gif.update_top + frame->gif.update_height;
+    *tx0 = byte_left / WSCONS_TILE_BYTES;
+    *ty0 = frame->gif.update_top / WSCONS_TILE_ROWS;
+    *columns = (byte_right + WSCONS_TILE_BYTES - 1U) / WSCONS_TILE_BYTES -
+      *tx0;
+    *rows = (bottom + WSCONS_TILE_ROWS - 1U) / WSCONS_TILE_ROWS - *ty0;
+}
+
+static int
+wscons_frame_range_valid(const WsconsAnimation *animation,
+  const WsconsFrame *frame)
+{
+    if (animation == NULL || frame == NULL ||
+      animation->bitmap_pool == MAP_FAILED ||
+      frame->data_offset > animation->bitmap_pool_size ||
+      frame->data_size >
+      animation->bitmap_pool_size - frame->data_offset) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t *
+wscons_frame_data(WsconsAnimation *animation, WsconsFrame *frame)
+{
+    if (!wscons_frame_range_valid(animation, frame))
+        return NULL;
+
+    return animation->bitmap_pool + frame->data_offset;
+}
+
+const uint8_t *
+wscons_frame_const_data(const WsconsAnimation *animation,
+  const WsconsFrame *frame)
+{
+    if (!wscons_frame_range_valid(animation, frame))
+        return NULL;
+
+    return animation->bitmap_pool + frame->data_offset;
+}
+
+/*
+ * Walk the rows and spans of WSCONS_FRAME_SPANS_1BPP data from p to end and
+ * check that they are ordered, do not overlap and stay inside the update
+ * rectangle of frame.
+ */
+static int
+wscons_spans_valid(const WsconsFrame *frame, const uint8_t *p,
+  const uint8_t *end)
+{
+    size_t byte_left, byte_right;
+    unsigned int next_row, row_end;
+
+    byte_left = frame->gif.update_left / 8U;
+    byte_right = ((size_t)frame->gif.update_left +
+      frame->gif.update_width + 7U) / 8U;
+    next_row = frame->gif.update_top;
+    row_end = next_row + frame->gif.update_height;
+
+    while (p != end) {
+        unsigned int row, count;
+        size_t next_x;
+
+        if ((size_t)(end - p) < WSCONS_SPAN_ROW_HEADER)
+            goto invalid;
+        row = get_be16(p);
+        count = get_be16(p + 2);
+        p += WSCONS_SPAN_ROW_HEADER;
+        if (row < next_row || row >= row_end || count == 0)
+            goto invalid;
+        next_row = row + 1U;
+
+        next_x = byte_left;
+        while (count-- > 0) {
+            size_t x, len;
+
+            if ((size_t)(end - p) < WSCONS_SPAN_HEADER)
+                goto invalid;
+            x = get_be16(p);
+            len = get_be16(p + 2);
+            p += WSCONS_SPAN_HEADER;
+            if (x < next_x || x > byte_right || len == 0 ||
+              len > byte_right - x || len > (size_t)(end - p))
+                goto invalid;
+            p += len;
+            next_x = x + len;
+        }
+    }
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Bits of the last byte of a row that lie past the logical screen width, or
+ * 0 if a rectangle starting at byte_left with bytes bytes per row does not
+ * reach that byte.
+ */
+static uint8_t
+wscons_padding_mask(const MonoGifInfo *info, size_t byte_left, size_t bytes)
+{
+    unsigned int rem_bits = info->width & 7U;
+
+    if (rem_bits == 0 || byte_left + bytes != info->line_bytes)
+        return 0;
+    return (uint8_t)~(0xffU << (8U - rem_bits));
+}
+
+/*
+ * Walk the codes of a WSCONS_FRAME_XOR_RLE_1BPP frame and check that each
+ * row decodes to exactly line_bytes bytes with no bits set past the logical
+ * screen width.
+ */
+static int
+wscons_frame_xor_rle_valid(const WsconsAnimation *animation,
+  const WsconsFrame *frame)
+{
+    const uint8_t *p, *end;
+    uint8_t padding;
+    unsigned int y;
+
+    p = animation->bitmap_pool + frame->data_offset;
+    end = p + frame->data_size;
+    padding = wscons_padding_mask(&animation->info,
+      frame->gif.update_left / 8U, frame->line_bytes);
+
+    for (y = 0; y < frame->gif.update_height; y++) {
+        size_t x, n;
+
+        for (x = 0; x < frame->line_bytes; x += n) {
+            unsigned int code;
+
+            if (p == end)
+                goto invalid;
+            code = *p++;
+            if ((code & 0x80U) == WSCONS_RLE_LITERAL) {
+                n = code + 1U;
+                if (n > frame->line_bytes - x || n > (size_t)(end - p) ||
+                  (x + n == frame->line_bytes && (p[n - 1] & padding) != 0))
+                    goto invalid;
+                p += n;
+            } else if ((code & 0xc0U) == WSCONS_RLE_REPEAT) {
+                n = (code & 0x3fU) + WSCONS_RLE_REPEAT_MIN;
+                if (n > frame->line_bytes - x || p == end ||
+                  (x + n == frame->line_bytes && (*p & padding) != 0))
+                    goto invalid;
+                p++;
+            } else {
+                n = (code & 0x3fU) + 1U;
+                if (n > frame->line_bytes - x)
+                    goto invalid;
+            }
+        }
+    }
+    if (p != end)
+        goto invalid;
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Check that the map of a WSCONS_FRAME_TILES_1BPP frame covers its update
+ * rectangle and that every tile lies inside the pool.
+ */
+static int
+wscons_frame_tiles_valid(const WsconsAnimation *animation,
+  const WsconsFrame *frame)
+{
+    const uint8_t *p, *end;
+    unsigned int tx0, ty0, columns, rows;
+
+    if (frame->gif.update_width == 0 || frame->gif.update_height == 0 ||
+      animation->bitmap_pool_size < WSCONS_TILE_SIZE)
+        goto invalid;
+    wscons_tile_range(frame, &tx0, &ty0, &columns, &rows);
+    if (frame->line_bytes != (size_t)columns * WSCONS_TILE_ENTRY ||
+      frame->data_size != frame->line_bytes * rows)
+        goto invalid;
+
+    p = animation->bitmap_pool + frame->data_offset;
+    for (end = p + frame->data_size; p != end; p += WSCONS_TILE_ENTRY) {
+        uint32_t offset = get_be32(p);
+
+        if (offset != WSCONS_TILE_NONE &&
+          offset > animation->bitmap_pool_size - WSCONS_TILE_SIZE)
+            goto invalid;
+    }
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Check that the band of a WSCONS_FRAME_MOVE_1BPP frame and its source lie
+ * within the logical screen, and the spans that follow it within the update
+ * rectangle.  Source bytes past the screen width may only be copied to
+ * where they are masked, at the right edge.
+ */
+static int
+wscons_frame_move_valid(const WsconsAnimation *animation,
+  const WsconsFrame *frame)
+{
+    const MonoGifInfo *info = &animation->info;
+    const uint8_t *p;
+    unsigned int top, rows, src_top;
+    size_t x, bytes, src_x;
+
+    if (frame->line_bytes != 0 || frame->data_size < WSCONS_MOVE_HEADER ||
+      frame->data_size >= info->frame_bytes)
+        goto invalid;
+    p = animation->bitmap_pool + frame->data_offset;
+    top = get_be16(p);
+    rows = get_be16(p + 2);
+    x = get_be16(p + 4);
+    bytes = get_be16(p + 6);
+    src_top = get_be16(p + 8);
+    src_x = get_be16(p + 10);
+    if (rows == 0 || bytes == 0 || rows > info->height ||
+      top > info->height - rows || src_top > info->height - rows ||
+      bytes > info->line_bytes || x > info->line_bytes - bytes ||
+      src_x > info->line_bytes - bytes)
+        goto invalid;
+    if (src_x + bytes > info->width / 8U && src_x != x)
+        goto invalid;
+    return wscons_spans_valid(frame, p + WSCONS_MOVE_HEADER,
+      p + frame->data_size);
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Check that a frame descriptor is consistent with its format and with the
+ * logical screen.  Used for freshly built frames, for frames read from an
+ * animation file, and before each blit.
+ */
+int
+wscons_frame_validate(const WsconsAnimation *animation,
+  const WsconsFrame *frame)
+{
+    const uint8_t *p;
+
+    if (!wscons_frame_range_valid(animation, frame))
+        return -1;
+
+    if (frame->format == WSCONS_FRAME_FULL_1BPP) {
+        if (frame->data_size != animation->info.frame_bytes ||
+          frame->line_bytes != animation->info.line_bytes) {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (frame->format != WSCONS_FRAME_PARTIAL_1BPP &&
+      frame->format != WSCONS_FRAME_SPANS_1BPP &&
+      frame->format != WSCONS_FRAME_XOR_RLE_1BPP &&
+      frame->format != WSCONS_FRAME_TILES_1BPP &&
+      frame->format != WSCONS_FRAME_MOVE_1BPP) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (frame->gif.update_left > animation->info.width ||
+      frame->gif.update_top > animation->info.height ||
+      frame->gif.update_width >
+      animation->info.width - frame->gif.update_left ||
+      frame->gif.update_height >
+      animation->info.height - frame->gif.update_top) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (frame->format == WSCONS_FRAME_PARTIAL_1BPP) {
+        size_t expected_line_bytes, expected_size;
+
+        expected_line_bytes =
+          ((size_t)(frame->gif.update_left & 7U) +
+          frame->gif.update_width + 7U) / 8U;
+        if (size_mul(expected_line_bytes, frame->gif.update_height,
+          &expected_size) == -1)
+            return -1;
+        if (frame->line_bytes != expected_line_bytes ||
+          frame->data_size != expected_size ||
+          frame->data_size >= animation->info.frame_bytes) {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (frame->format == WSCONS_FRAME_XOR_RLE_1BPP) {
+        if (frame->line_bytes != ((size_t)(frame->gif.update_left & 7U) +
+          frame->gif.update_width + 7U) / 8U ||
+          frame->data_size >= animation->info.frame_bytes) {
+            errno = EINVAL;
+            return -1;
+        }
+        return wscons_frame_xor_rle_valid(animation, frame);
+    }
+
+    if (frame->format == WSCONS_FRAME_TILES_1BPP)
+        return wscons_frame_tiles_valid(animation, frame);
+
+    if (frame->format == WSCONS_FRAME_MOVE_1BPP)
+        return wscons_frame_move_valid(animation, frame);
+
+    if (frame->line_bytes != 0 ||
+      frame->data_size >= animation->info.frame_bytes) {
+        errno = EINVAL;
+        return -1;
+    }
+    p = animation->bitmap_pool + frame->data_offset;
+    return wscons_spans_valid(frame, p, p + frame->data_size);
+}
+
+/*
+ * Parse a blit cost model written as "call,row,kbyte,edge,unaligned".
+ */
+int
+wscons_blit_cost_parse(WsconsBlitCost *cost, const char *s)
+{
+    uint32_t *fields[5];
+    unsigned long value;
+    char *end;
+    size_t i;
+
+    fields[0] = &cost->call;
+    fields[1] = &cost->row;
+    fields[2] = &cost->kbyte;
+    fields[3] = &cost->edge;
+    fields[4] = &cost->unaligned;
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (i > 0 && *s++ != ',')
+            break;
+        if (*s < '0' || *s > '9')
+            break;
+        errno = 0;
+        value = strtoul(s, &end, 10);
+        if (errno != 0 || value > UINT32_MAX)
+            break;
+        *fields[i] = (uint32_t)value;
+        s = end;
+    }
+    if (i < sizeof(fields) / sizeof(fields[0]) || *s != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Estimated time to draw rows rows of bytes bytes from byte column x, in
+ * 1/1024 nanoseconds.
+ */
+static uint64_t
+wscons_blit_estimate(const WsconsBlitCost *cost, const MonoGifInfo *info,
+  size_t x, size_t bytes, unsigned int rows)
+{
+    uint64_t per_row;
+
+    per_row = (uint64_t)cost->row * 1024U + (uint64_t)cost->kbyte * bytes;
+    if ((info->width & 7U) != 0 && bytes != 0 &&
+      x + bytes == info->line_bytes)
+        per_row += (uint64_t)cost->edge * 1024U;
+    if (x % WSCONS_BLIT_ALIGN != 0)
+        per_row += (uint64_t)cost->unaligned * bytes;
+    return (uint64_t)cost->call * 1024U + per_row * rows;
+}
+
+/*
+ * Return whether a rectangle of rows of line_bytes from byte column x is
+ * better stored as a partial frame than as a full frame: it must be
+ * smaller, and with a cost model other than NULL or all zero, no slower to
+ * draw.
+ */
+static bool
+wscons_partial_preferred(const WsconsBlitCost *cost,
+  const MonoGifInfo *info, size_t x, size_t line_bytes, unsigned int rows)
+{
+    if (line_bytes * rows >= info->frame_bytes)
+        return false;
+    if (cost == NULL || (cost->call == 0 && cost->row == 0 &&
+      cost->kbyte == 0 && cost->edge == 0 && cost->unaligned == 0))
+        return true;
+    return wscons_blit_estimate(cost, info, x, line_bytes, rows) <=
+      wscons_blit_estimate(cost, info, 0, info->line_bytes, info->height);
+}
+
+void
+wscons_animation_init(WsconsAnimation *animation)
+{
+    memset(animation, 0, sizeof(*animation));
+    animation->bitmap_pool = MAP_FAILED;
+    animation->pool_map_base = MAP_FAILED;
+    animation->pool_fd = -1;
+}
+
+static int
+wscons_frame_layout(WsconsFrame *frame, const MonoGifInfo *info,
+  const WsconsBlitCost *cost, const GifImageDesc *desc, bool first_frame)
+{
+    unsigned int left, top, width, height;
+    size_t line_bytes, data_size;
+
+    left = (unsigned int)desc->Left;
+    top = (unsigned int)desc->Top;
+    width = (unsigned int)desc->Width;
+    height = (unsigned int)desc->Height;
+    if (left > info->width || top > info->height ||
+      width > info->width - left || height > info->height - top) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    frame->gif.update_left = (uint16_t)left;
+    frame->gif.update_top = (uint16_t)top;
+    frame->gif.update_width = (uint16_t)width;
+    frame->gif.update_height = (uint16_t)height;
+
+    if (!first_frame) {
+        line_bytes = ((size_t)(left & 7U) + width + 7U) / 8U;
+        if (size_mul(line_bytes, height, &data_size) == -1)
+            return -1;
+        if (wscons_partial_preferred(cost, info, left / 8U, line_bytes,
+          height)) {
+            frame->data_size = data_size;
+            frame->line_bytes = line_bytes;
+            frame->format = WSCONS_FRAME_PARTIAL_1BPP;
+            return 0;
+        }
+    }
+
+    frame->data_size = info->frame_bytes;
+    frame->line_bytes = info->line_bytes;
+    frame->format = WSCONS_FRAME_FULL_1BPP;
+    return 0;
+}
+
+/*
+ * Grow rect to the bounding box of itself and desc.  Empty rectangles add
+ * nothing.
+ */
+static void
+wscons_desc_union(GifImageDesc *rect, const GifImageDesc *desc)
+{
+    int right, bottom;
+
+    if (desc->Width <= 0 || desc->Height <= 0)
+        return;
+    if (rect->Width <= 0 || rect->Height <= 0) {
+        rect->Left = desc->Left;
+        rect->Top = desc->Top;
+        rect->Width = desc->Width;
+        rect->Height = desc->Height;
+        return;
+    }
+    right = rect->Left + rect->Width;
+    if (desc->Left + desc->Width > right)
+        right = desc->Left + desc->Width;
+    bottom = rect->Top + rect->Height;
+    if (desc->Top + desc->Height > bottom)
+        bottom = desc->Top + desc->Height;
+    if (desc->Left < rect->Left)
+        rect->Left = desc->Left;
+    if (desc->Top < rect->Top)
+        rect->Top = desc->Top;
+    rect->Width = right - rect->Left;
+    rect->Height = bottom - rect->Top;
+}
+
+/*
+ * Decide which GIF frames are composited into each stored frame.  A run of
+ * frames is merged until its delays add up to coalesce_ms, so a short frame
+ * is shown no more than that much early, and a frame with an empty image
+ * rectangle always joins the run before it.
+ */
+static int
+wscons_coalesce_plan(WsconsAnimation *animation, const GifFileType *gif,
+  uint32_t coalesce_ms)
+{
+    uint32_t delay;
+    int count, i;
+
+    animation->source_last = calloc((size_t)gif->ImageCount,
+      sizeof(*animation->source_last));
+    if (animation->source_last == NULL)
+        return -1;
+
+    count = 0;
+    delay = 0;
+    for (i = 0; i < gif->ImageCount; i++) {
+        const GifImageDesc *next;
+
+        delay += mono_gif_frame_delay(&gif->SavedImages[i]);
+        if (i + 1 < gif->ImageCount) {
+            next = &gif->SavedImages[i + 1].ImageDesc;
+            if (delay < coalesce_ms || next->Width <= 0 ||
+              next->Height <= 0)
+                continue;
+        }
+        animation->source_last[count++] = i;
+        delay = 0;
+    }
+    animation->info.frame_count = count;
+    return 0;
+}
+
+/*
+ * Create an unlinked temporary file of size bytes in directory to back the
+ * frame pool.  The file is gone once it is closed and unmapped.
+ */
+static int
+wscons_pool_file_create(const char *directory, size_t size)
+{
+    char path[PATH_MAX];
+    int fd, saved_errno;
+
+    if ((off_t)size < 0 || (size_t)(off_t)size != size) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (snprintf(path, sizeof(path), "%s/monoanim.XXXXXX", directory) >=
+      (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = mkstemp(path);
+    if (fd == -1)
+        return -1;
+    (void)unlink(path);
+    if (ftruncate(fd, (off_t)size) == -1) {
+        saved_errno = errno;
+        (void)close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+int
+wscons_animation_allocate(WsconsAnimation *animation,
+  const MonoGifInfo *gif_info, const GifFileType *gif,
+  const WsconsLoadOptions *options)
+{
+    const MonoGifInfo *info;
+    size_t pool_size;
+    int first, i;
+
+    if (gif == NULL || options == NULL ||
+      gif->ImageCount != gif_info->frame_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* info describes the stored frames, fewer than the GIF's if merged. */
+    animation->info = *gif_info;
+    animation->options = *options;
+    info = &animation->info;
+    if (options->coalesce_ms != 0 &&
+      wscons_coalesce_plan(animation, gif, options->coalesce_ms) == -1)
+        return -1;
+    animation->frames = calloc((size_t)info->frame_count + 1U,
+      sizeof(*animation->frames));
+    if (animation->frames == NULL)
+        return -1;
+
+    pool_size = 0;
+    first = 0;
+    for (i = 0; i < info->frame_count; i++) {
+        WsconsFrame *frame = &animation->frames[i];
+        GifImageDesc desc;
+        int last, k;
+
+        last = animation->source_last != NULL ?
+          animation->source_last[i] : i;
+        memset(&desc, 0, sizeof(desc));
+        for (k = first; k <= last; k++)
+            wscons_desc_union(&desc, &gif->SavedImages[k].ImageDesc);
+        first = last + 1;
+
+        if (wscons_frame_layout(frame, info, &options->blit_cost, &desc,
+          i == 0) == -1)
+            return -1;
+        frame->data_offset = pool_size;
+        if (size_add(pool_size, frame->data_size, &pool_size) == -1)
+            return -1;
+    }
+    if (info->frame_count > 1 &&
+      (options->keyframe_interval > 0 || options->keyframe_bytes != 0)) {
+        size_t keys, key_size;
+
+        /*
+         * Each inserted keyframe follows keyframe_interval frames or
+         * keyframe_bytes bytes of other frames, which the layout bounds.
+         */
+        keys = 0;
+        if (options->keyframe_interval > 0)
+            keys = (size_t)(info->frame_count - 1) /
+              (size_t)options->keyframe_interval;
+        if (options->keyframe_bytes != 0)
+            keys += (pool_size - animation->frames[1].data_offset) /
+              options->keyframe_bytes;
+        if (keys > (size_t)(info->frame_count - 1))
+            keys = (size_t)(info->frame_count - 1);
+        if (size_mul(keys, info->frame_bytes, &key_size) == -1 ||
+          size_add(pool_size, key_size, &pool_size) == -1)
+            return -1;
+    }
+    if (options->tiles) {
+        size_t grid_tiles, map_size;
+
+        /* The first frame may take a whole tile grid and its map. */
+        if (wscons_tile_grid(info, &grid_tiles) == -1 ||
+          size_mul(grid_tiles, WSCONS_TILE_SIZE + WSCONS_TILE_ENTRY,
+          &map_size) == -1 ||
+          size_add(pool_size, map_size, &pool_size) == -1)
+            return -1;
+    }
+    /* A loop frame is only kept when it is smaller than a full frame. */
+    if (info->frame_count > 1 &&
+      size_add(pool_size, info->frame_bytes, &pool_size) == -1)
+        return -1;
+    if (options->memory_budget != 0) {
+        size_t limit, slack;
+
+        /*
+         * Conversion stops once the frames pass the budget, so the pool
+         * never holds more than the budget and the frame written last: a
+         * full frame, or a tile map with its new tiles.
+         */
+        if (info->frame_bytes > options->memory_budget) {
+            errno = ENOSPC;
+            return -1;
+        }
+        slack = info->frame_bytes;
+        if (options->tiles) {
+            size_t grid_tiles, map_size;
+
+            if (wscons_tile_grid(info, &grid_tiles) == -1 ||
+              size_mul(grid_tiles, WSCONS_TILE_SIZE + WSCONS_TILE_ENTRY,
+              &map_size) == -1 ||
+              size_add(slack, map_size, &slack) == -1)
+                return -1;
+        }
+        if (size_add(options->memory_budget, slack, &limit) == 0 &&
+          limit < pool_size)
+            pool_size = limit;
+    }
+    if (pool_size == 0) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    if (options->pool_directory != NULL) {
+        animation->pool_fd = wscons_pool_file_create(
+          options->pool_directory, pool_size);
+        if (animation->pool_fd == -1)
+            return -1;
+        animation->bitmap_pool = mmap(NULL, pool_size,
+          PROT_READ | PROT_WRITE, MAP_SHARED, animation->pool_fd, 0);
+    } else {
+        animation->bitmap_pool = mmap(NULL, pool_size,
+          PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    }
+    if (animation->bitmap_pool == MAP_FAILED)
+        return -1;
+
+    animation->bitmap_pool_size = pool_size;
+    animation->pool_map_base = animation->bitmap_pool;
+    animation->pool_map_size = pool_size;
+
+    /*
+     * The pool is sized for the GIF update rectangles, which bound the
+     * changed regions found while extracting.  Frames are packed from the
+     * start and the unused tail is released afterwards.  Touch no bitmap
+     * pages here; rendering commits them frame by frame.
+     */
+    return 0;
+}
+
+void
+wscons_animation_finish_loading(WsconsAnimation *animation)
+{
+    /*
+     * A pool built in a file is mapped again read-only, so that its pages
+     * stay clean once written back and can be dropped and read back from
+     * the file under memory pressure.
+     */
+    if (animation->pool_fd != -1) {
+        uint8_t *map;
+
+        map = mmap(NULL, animation->pool_map_size, PROT_READ, MAP_SHARED,
+          animation->pool_fd, 0);
+        if (map == MAP_FAILED) {
+            if (animation->options.progress)
+                warn("remap frame pool file");
+        } else {
+            (void)munmap(animation->pool_map_base,
+              animation->pool_map_size);
+            animation->bitmap_pool = map +
+              (animation->bitmap_pool - animation->pool_map_base);
+            animation->pool_map_base = map;
+        }
+        (void)close(animation->pool_fd);
+        animation->pool_fd = -1;
+    }
+
+    /* The frame pool is immutable while playing. */
+    if (animation->pool_map_base != MAP_FAILED) {
+        if (mprotect(animation->pool_map_base, animation->pool_map_size,
+          PROT_READ) == -1 && animation->options.progress)
+            warn("mprotect frame bitmap pool");
+
+        /*
+         * Playback walks the mapping from low to high addresses.  On NetBSD,
+         * MADV_SEQUENTIAL can lower the priority of pages already passed,
+         * allowing old frames to be paged out before other useful memory.
+         */
+        if (madvise(animation->pool_map_base, animation->pool_map_size,
+          MADV_SEQUENTIAL) == -1 && animation->options.progress)
+            warn("madvise frame bitmap pool");
+    }
+}
+
+void
+wscons_animation_destroy(WsconsAnimation *animation)
+{
+    if (animation->pool_map_base != MAP_FAILED) {
+        (void)munmap(animation->pool_map_base, animation->pool_map_size);
+        animation->pool_map_base = MAP_FAILED;
+    }
+    if (animation->pool_fd != -1) {
+        (void)close(animation->pool_fd);
+        animation->pool_fd = -1;
+    }
+    animation->bitmap_pool = MAP_FAILED;
+    free(animation->frames);
+    animation->frames = NULL;
+    animation->loop_frame = NULL;
+    free(animation->source_last);
+    animation->source_last = NULL;
+    animation->bitmap_pool_size = 0;
+    animation->pool_map_size = 0;
+}
+
+/*
+ * Describe a frame by the rectangle that actually changed.  Frames whose
+ * byte-aligned rectangle is not smaller than a full frame, or with a cost
+ * model, not faster to draw, are stored full.
+ */
+static void
+wscons_frame_set_rect(WsconsFrame *frame, const MonoGifInfo *info,
+  const WsconsBlitCost *cost, unsigned int left, unsigned int top,
+  unsigned int width, unsigned int height)
+{
+    size_t line_bytes;
+
+    frame->gif.update_left = (uint16_t)left;
+    frame->gif.update_top = (uint16_t)top;
+    frame->gif.update_width = (uint16_t)width;
+    frame->gif.update_height = (uint16_t)height;
+
+    /* The rectangle lies within the logical screen, so this cannot wrap. */
+    line_bytes = ((size_t)(left & 7U) + width + 7U) / 8U;
+    if (wscons_partial_preferred(cost, info, left / 8U, line_bytes,
+      height)) {
+        frame->data_size = line_bytes * height;
+        frame->line_bytes = line_bytes;
+        frame->format = WSCONS_FRAME_PARTIAL_1BPP;
+    } else {
+        frame->data_size = info->frame_bytes;
+        frame->line_bytes = info->line_bytes;
+        frame->format = WSCONS_FRAME_FULL_1BPP;
+    }
+}
+
+/*
+ * Find the bounding box of the bytes that differ between two images of
+ * rows x bytes.  Unchanged rows at the top and bottom are skipped with
+ * memcmp(), which compares a word at a time; only the remaining rows are
+ * scanned for the left and right edges.  Returns false if nothing changed.
+ */
+static bool
+wscons_diff_bounds(const uint8_t *a, size_t a_stride,
+  const uint8_t *b, size_t b_stride, size_t bytes, unsigned int rows,
+  unsigned int *top, unsigned int *bottom, size_t *left, size_t *right)
+{
+    unsigned int y0, y1, y;
+    size_t x0, x1;
+
+    for (y0 = 0; y0 < rows; y0++) {
+        if (memcmp(a + (size_t)y0 * a_stride,
+          b + (size_t)y0 * b_stride, bytes) != 0)
+            break;
+    }
+    if (y0 == rows)
+        return false;
+    for (y1 = rows; y1 > y0 + 1U; y1--) {
+        if (memcmp(a + (size_t)(y1 - 1U) * a_stride,
+          b + (size_t)(y1 - 1U) * b_stride, bytes) != 0)
+            break;
+    }
+
+    x0 = bytes;
+    x1 = 0;
+    for (y = y0; y < y1; y++) {
+        const uint8_t *ra = a + (size_t)y * a_stride;
+        const uint8_t *rb = b + (size_t)y * b_stride;
+        size_t x;
+
+        for (x = 0; x < x0 && ra[x] == rb[x]; x++)
+            continue;
+        if (x < x0)
+            x0 = x;
+        for (x = bytes; x > x1 && ra[x - 1] == rb[x - 1]; x--)
+            continue;
+        if (x > x1)
+            x1 = x;
+    }
+
+    *top = y0;
+    *bottom = y1;
+    *left = x0;
+    *right = x1;
+    return true;
+}
+
+/*
+ * Encode the changed bytes in the rectangle of a frame as
+ * WSCONS_FRAME_SPANS_1BPP data.  previous uses prev_stride and starts at the
+ * rectangle.  Runs of changed bytes separated by no more unchanged bytes
+ * than a span header are merged into one span.  Returns false if the data
+ * would not be smaller than limit, which must not exceed the size of out.
+ */
+static bool
+wscons_encode_spans(uint8_t *out, size_t limit, size_t *size,
+  const WsconsFrame *frame, const MonoGifInfo *info, const uint8_t *image,
+  const uint8_t *previous, size_t prev_stride)
+{
+    size_t byte_left, bytes, used;
+    unsigned int y;
+
+    byte_left = frame->gif.update_left / 8U;
+    bytes = ((size_t)frame->gif.update_left + frame->gif.update_width +
+      7U) / 8U - byte_left;
+    used = 0;
+
+    for (y = 0; y < frame->gif.update_height; y++) {
+        const uint8_t *ra, *rb;
+        size_t row_start, x;
+        unsigned int count;
+
+        ra = image + (size_t)(frame->gif.update_top + y) * info->line_bytes +
+          byte_left;
+        rb = previous + (size_t)y * prev_stride;
+        row_start = used;
+        count = 0;
+
+        for (x = 0; x < bytes; ) {
+            size_t start, end, gap;
+
+            if (ra[x] == rb[x]) {
+                x++;
+                continue;
+            }
+            start = x;
+            end = x + 1U;
+            for (;;) {
+                while (end < bytes && ra[end] != rb[end])
+                    end++;
+                for (gap = end; gap < bytes && ra[gap] == rb[gap] &&
+                  gap - end <= WSCONS_SPAN_HEADER; gap++)
+                    continue;
+                if (gap == bytes || gap - end > WSCONS_SPAN_HEADER)
+                    break;
+                end = gap;
+            }
+
+            if ((count == 0 ? WSCONS_SPAN_ROW_HEADER : 0U) +
+              WSCONS_SPAN_HEADER + (end - start) >= limit - used)
+                return false;
+            if (count == 0) {
+                put_be16(out + used,
+                  (uint16_t)(frame->gif.update_top + y));
+                used += WSCONS_SPAN_ROW_HEADER;
+            }
+            put_be16(out + used, (uint16_t)(byte_left + start));
+            put_be16(out + used + 2, (uint16_t)(end - start));
+            used += WSCONS_SPAN_HEADER;
+            memcpy(out + used, ra + start, end - start);
+            used += end - start;
+            count++;
+            x = end;
+        }
+        if (count != 0)
+            put_be16(out + row_start + 2, (uint16_t)count);
+    }
+
+    *size = used;
+    return true;
+}
+
+/*
+ * Code one row of XOR delta bytes for WSCONS_FRAME_XOR_RLE_1BPP.  Returns
+ * false if the codes would not fit in room bytes.
+ */
+static bool
+wscons_rle_encode_row(uint8_t *out, size_t room, size_t *size,
+  const uint8_t *delta, size_t bytes)
+{
+    size_t used, x, n;
+
+    used = 0;
+    for (x = 0; x < bytes; x += n) {
+        if (delta[x] == 0) {
+            for (n = 1; n < 64U && x + n < bytes && delta[x + n] == 0; n++)
+                continue;
+            if (room - used < 1U)
+                return false;
+            out[used++] = (uint8_t)(WSCONS_RLE_SKIP | (n - 1U));
+            continue;
+        }
+
+        for (n = 1; n < 63U + WSCONS_RLE_REPEAT_MIN && x + n < bytes &&
+          delta[x + n] == delta[x]; n++)
+            continue;
+        if (n >= WSCONS_RLE_REPEAT_MIN) {
+            if (room - used < 2U)
+                return false;
+            out[used++] = (uint8_t)(WSCONS_RLE_REPEAT |
+              (n - WSCONS_RLE_REPEAT_MIN));
+            out[used++] = delta[x];
+            continue;
+        }
+
+        /* Literal bytes up to a pair of zero bytes or a repeated run. */
+        for (n = 1; n < 128U && x + n < bytes; n++) {
+            const uint8_t *q = delta + x + n;
+            size_t left = bytes - x - n;
+
+            if (q[0] == 0 && (left == 1U || q[1] == 0))
+                break;
+            if (left >= WSCONS_RLE_REPEAT_MIN && q[1] == q[0] &&
+              q[2] == q[0])
+                break;
+        }
+        if (room - used < 1U + n)
+            return false;
+        out[used++] = (uint8_t)(WSCONS_RLE_LITERAL | (n - 1U));
+        memcpy(out + used, delta + x, n);
+        used += n;
+    }
+
+    *size = used;
+    return true;
+}
+
+/*
+ * Encode the rectangle of a frame as WSCONS_FRAME_XOR_RLE_1BPP data in out,
+ * using delta as a one-row work buffer.  previous uses prev_stride and
+ * starts at the rectangle.  Returns false if the data would not be smaller
+ * than limit, which must not exceed the size of out.
+ */
+static bool
+wscons_encode_xor_rle(uint8_t *out, size_t limit, size_t *size,
+  uint8_t *delta, const WsconsFrame *frame, const MonoGifInfo *info,
+  const uint8_t *image, const uint8_t *previous, size_t prev_stride)
+{
+    size_t byte_left, bytes, used;
+    uint8_t padding;
+    unsigned int y;
+
+    byte_left = frame->gif.update_left / 8U;
+    bytes = ((size_t)(frame->gif.update_left & 7U) +
+      frame->gif.update_width + 7U) / 8U;
+    padding = wscons_padding_mask(info, byte_left, bytes);
+    used = 0;
+
+    for (y = 0; y < frame->gif.update_height; y++) {
+        const uint8_t *ra, *rb;
+        size_t row_size, x;
+
+        ra = image + (size_t)(frame->gif.update_top + y) * info->line_bytes +
+          byte_left;
+        rb = previous + (size_t)y * prev_stride;
+        for (x = 0; x < bytes; x++)
+            delta[x] = ra[x] ^ rb[x];
+        delta[bytes - 1] &= (uint8_t)~padding;
+
+        if (!wscons_rle_encode_row(out + used, limit - used, &row_size,
+          delta, bytes))
+            return false;
+        used += row_size;
+    }
+    if (used >= limit)
+        return false;
+
+    *size = used;
+    return true;
+}
+
+#define WSCONS_HASH_INIT 2166136261U
+
+static uint32_t
+wscons_hash_update(uint32_t hash, const uint8_t *data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* 32-bit FNV-1a; data is compared in full on a hash match. */
+static uint32_t
+wscons_payload_hash(const uint8_t *data, size_t size)
+{
+    return wscons_hash_update(WSCONS_HASH_INIT, data, size);
+}
+
+/*
+ * Dictionary of the tiles stored in the pool so far, chained by content
+ * hash.  Tiles first used by the frame being encoded are kept in stage
+ * under the pool offsets they will have once that frame is stored at
+ * stage_offset, and are forgotten again if the frame is not stored as
+ * tiles.
+ */
+#define WSCONS_TILE_BUCKETS 4096U
+
+typedef struct {
+    uint32_t *hashes;
+    uint32_t *offsets;
+    uint32_t *next;
+    uint32_t count;
+    uint32_t committed;
+    uint32_t capacity;
+    const uint8_t *pool;
+    uint8_t *stage;
+    size_t stage_offset;
+    size_t stage_size;
+    uint32_t buckets[WSCONS_TILE_BUCKETS];
+} WsconsTileIndex;
+
+static void
+wscons_tile_index_destroy(WsconsTileIndex *index)
+{
+    if (index == NULL)
+        return;
+    free(index->hashes);
+    free(index->offsets);
+    free(index->next);
+    free(index->stage);
+    free(index);
+}
+
+static WsconsTileIndex *
+wscons_tile_index_create(const uint8_t *pool, size_t stage_size)
+{
+    WsconsTileIndex *index;
+    uint32_t i;
+
+    index = calloc(1, sizeof(*index));
+    if (index == NULL)
+        return NULL;
+    index->pool = pool;
+    index->stage = malloc(stage_size);
+    if (index->stage == NULL) {
+        wscons_tile_index_destroy(index);
+        return NULL;
+    }
+    for (i = 0; i < WSCONS_TILE_BUCKETS; i++)
+        index->buckets[i] = UINT32_MAX;
+    return index;
+}
+
+static uint32_t
+wscons_tile_find(const WsconsTileIndex *index, const uint8_t *tile,
+  uint32_t hash)
+{
+    uint32_t i;
+
+    for (i = index->buckets[hash % WSCONS_TILE_BUCKETS]; i != UINT32_MAX;
+      i = index->next[i]) {
+        const uint8_t *data;
+
+        if (index->hashes[i] != hash)
+            continue;
+        data = i >= index->committed ?
+          index->stage + (index->offsets[i] - index->stage_offset) :
+          index->pool + index->offsets[i];
+        if (memcmp(data, tile, WSCONS_TILE_SIZE) == 0)
+            return index->offsets[i];
+    }
+    return WSCONS_TILE_NONE;
+}
+
+static int
+wscons_tile_add(WsconsTileIndex *index, uint32_t offset, uint32_t hash)
+{
+    uint32_t bucket;
+
+    if (index->count == index->capacity) {
+        uint32_t capacity;
+        void *p;
+
+        if (index->capacity > UINT32_MAX / 2U - 1U) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+        capacity = index->capacity != 0 ? index->capacity * 2U : 256U;
+        if ((p = realloc(index->hashes,
+          capacity * sizeof(*index->hashes))) == NULL)
+            return -1;
+        index->hashes = p;
+        if ((p = realloc(index->offsets,
+          capacity * sizeof(*index->offsets))) == NULL)
+            return -1;
+        index->offsets = p;
+        if ((p = realloc(index->next,
+          capacity * sizeof(*index->next))) == NULL)
+            return -1;
+        index->next = p;
+        index->capacity = capacity;
+    }
+
+    bucket = hash % WSCONS_TILE_BUCKETS;
+    index->hashes[index->count] = hash;
+    index->offsets[index->count] = offset;
+    index->next[index->count] = index->buckets[bucket];
+    index->buckets[bucket] = index->count;
+    index->count++;
+    return 0;
+}
+
+/* Forget the staged tiles; entries are unlinked in reverse order. */
+static void
+wscons_tile_index_rollback(WsconsTileIndex *index)
+{
+    while (index->count > index->committed) {
+        index->count--;
+        index->buckets[index->hashes[index->count] % WSCONS_TILE_BUCKETS] =
+          index->next[index->count];
+    }
+    index->stage_size = 0;
+}
+
+/* Move the staged tiles to the pool at stage_offset. */
+static void
+wscons_tile_index_commit(WsconsTileIndex *index, uint8_t *pool)
+{
+    memcpy(pool + index->stage_offset, index->stage, index->stage_size);
+    index->committed = index->count;
+    index->stage_size = 0;
+}
+
+/*
+ * Copy tile (tx, ty) of a full-screen image into tile.  Everything past the
+ * logical screen, including padding bits, is zero so that the same content
+ * always gives the same tile.
+ */
+static void
+wscons_tile_extract(uint8_t *tile, const MonoGifInfo *info,
+  const uint8_t *image, unsigned int tx, unsigned int ty)
+{
+    size_t x, bytes;
+    unsigned int y, top, rows;
+    uint8_t padding;
+
+    memset(tile, 0, WSCONS_TILE_SIZE);
+    x = (size_t)tx * WSCONS_TILE_BYTES;
+    bytes = info->line_bytes - x;
+    if (bytes > WSCONS_TILE_BYTES)
+        bytes = WSCONS_TILE_BYTES;
+    top = ty * WSCONS_TILE_ROWS;
+    rows = info->height - top;
+    if (rows > WSCONS_TILE_ROWS)
+        rows = WSCONS_TILE_ROWS;
+    padding = wscons_padding_mask(info, x, bytes);
+
+    for (y = 0; y < rows; y++) {
+        uint8_t *dst = tile + (size_t)y * WSCONS_TILE_BYTES;
+
+        memcpy(dst, image + (size_t)(top + y) * info->line_bytes + x, bytes);
+        dst[bytes - 1] &= (uint8_t)~padding;
+    }
+}
+
+/*
+ * Build the tile map of the rectangle of a frame to be stored at cursor.
+ * previous uses prev_stride and starts at the rectangle; if it is NULL,
+ * every tile is entered.  Tiles whose part of the rectangle did not change
+ * become WSCONS_TILE_NONE.  Tiles missing from the dictionary are staged.
+ * Returns false, with nothing staged, unless the map plus the staged tiles
+ * are smaller than limit.  Running out of memory for the dictionary also
+ * just leaves the frame in its other form.
+ */
+static bool
+wscons_tiles_encode(WsconsTileIndex *index, uint8_t *map, uint8_t *tile,
+  size_t limit, size_t *map_size, size_t *map_line_bytes, size_t cursor,
+  const WsconsFrame *frame, const MonoGifInfo *info, const uint8_t *image,
+  const uint8_t *previous, size_t prev_stride)
+{
+    unsigned int tx0, ty0, columns, rows, tx, ty;
+    unsigned int top, bottom;
+    size_t byte_left, byte_right, cost;
+    uint8_t *entry;
+
+    wscons_tile_range(frame, &tx0, &ty0, &columns, &rows);
+    byte_left = frame->gif.update_left / 8U;
+    byte_right = ((size_t)frame->gif.update_left +
+      frame->gif.update_width + 7U) / 8U;
+    top = frame->gif.update_top;
+    bottom = top + frame->gif.update_height;
+    cost = (size_t)columns * rows * WSCONS_TILE_ENTRY;
+    if (cost >= limit)
+        return false;
+    index->stage_offset = cursor;
+
+    entry = map;
+    for (ty = ty0; ty < ty0 + rows; ty++) {
+        unsigned int y0, y1, y;
+
+        y0 = ty * WSCONS_TILE_ROWS;
+        y1 = y0 + WSCONS_TILE_ROWS;
+        if (y0 < top)
+            y0 = top;
+        if (y1 > bottom)
+            y1 = bottom;
+
+        for (tx = tx0; tx < tx0 + columns; tx++) {
+            uint32_t hash, offset;
+            size_t x0, x1;
+            bool changed;
+
+            x0 = (size_t)tx * WSCONS_TILE_BYTES;
+            x1 = x0 + WSCONS_TILE_BYTES;
+            if (x0 < byte_left)
+                x0 = byte_left;
+            if (x1 > byte_right)
+                x1 = byte_right;
+
+            changed = previous == NULL;
+            for (y = y0; y < y1 && !changed; y++) {
+                changed = memcmp(image + (size_t)y * info->line_bytes + x0,
+                  previous + (size_t)(y - top) * prev_stride +
+                  (x0 - byte_left), x1 - x0) != 0;
+            }
+            if (!changed) {
+                put_be32(entry, WSCONS_TILE_NONE);
+                entry += WSCONS_TILE_ENTRY;
+                continue;
+            }
+
+            wscons_tile_extract(tile, info, image, tx, ty);
+            hash = wscons_payload_hash(tile, WSCONS_TILE_SIZE);
+            offset = wscons_tile_find(index, tile, hash);
+            if (offset == WSCONS_TILE_NONE) {
+                cost += WSCONS_TILE_SIZE;
+                if (cost >= limit || cursor + index->stage_size >=
+                  WSCONS_TILE_NONE - WSCONS_TILE_SIZE)
+                    goto reject;
+                offset = (uint32_t)(cursor + index->stage_size);
+                if (wscons_tile_add(index, offset, hash) == -1)
+                    goto reject;
+                memcpy(index->stage + index->stage_size, tile,
+                  WSCONS_TILE_SIZE);
+                index->stage_size += WSCONS_TILE_SIZE;
+            }
+            put_be32(entry, offset);
+            entry += WSCONS_TILE_ENTRY;
+        }
+    }
+
+    *map_size = (size_t)columns * rows * WSCONS_TILE_ENTRY;
+    *map_line_bytes = (size_t)columns * WSCONS_TILE_ENTRY;
+    return true;
+
+reject:
+    wscons_tile_index_rollback(index);
+    return false;
+}
+
+/*
+ * Motion search limits: vertical shifts of up to WSCONS_MOVE_MAX_ROWS rows
+ * and horizontal shifts of up to WSCONS_MOVE_MAX_BYTES bytes are tried, for
+ * frames of at least WSCONS_MOVE_MIN_SIZE bytes in their other forms.
+ */
+#define WSCONS_MOVE_MAX_ROWS 64U
+#define WSCONS_MOVE_MAX_BYTES 8U
+#define WSCONS_MOVE_MIN_SIZE 1024U
+
+/*
+ * The previous composite as wscons_frame_trim() sees it: image outside the
+ * GIF update rectangle, and the saved bytes of previous inside it.
+ */
+typedef struct {
+    const uint8_t *image;
+    const uint8_t *previous;
+    size_t prev_stride;
+    unsigned int top;
+    unsigned int rows;
+    size_t byte_left;
+    size_t bytes;
+} WsconsPreviousImage;
+
+/*
+ * Return row y of the previous composite, assembled in row if it crosses
+ * the GIF update rectangle.
+ */
+static const uint8_t *
+wscons_previous_row(const WsconsPreviousImage *prev, const MonoGifInfo *info,
+  unsigned int y, uint8_t *row)
+{
+    const uint8_t *src;
+
+    src = prev->image + (size_t)y * info->line_bytes;
+    if (y < prev->top || y - prev->top >= prev->rows)
+        return src;
+    memcpy(row, src, info->line_bytes);
+    memcpy(row + prev->byte_left,
+      prev->previous + (size_t)(y - prev->top) * prev->prev_stride,
+      prev->bytes);
+    return row;
+}
+
+/*
+ * Find the longest band of rows of the frame rectangle that repeats the
+ * previous composite shifted vertically, comparing row hashes over the byte
+ * columns [x0, x1).  hashes holds two entries per screen row.  Returns the
+ * band length, 0 if there is none.
+ */
+static unsigned int
+wscons_find_vertical_move(const WsconsFrame *frame, const MonoGifInfo *info,
+  const WsconsPreviousImage *prev, uint8_t *row, uint32_t *hashes,
+  size_t x0, size_t x1, unsigned int *band_top, int *dy)
+{
+    uint32_t *image_hash, *prev_hash;
+    unsigned int top, bottom, p0, p1, y, d, best;
+
+    image_hash = hashes;
+    prev_hash = hashes + info->height;
+    top = frame->gif.update_top;
+    bottom = top + frame->gif.update_height;
+    p0 = top > WSCONS_MOVE_MAX_ROWS ? top - WSCONS_MOVE_MAX_ROWS : 0;
+    p1 = info->height - bottom > WSCONS_MOVE_MAX_ROWS ?
+      bottom + WSCONS_MOVE_MAX_ROWS : info->height;
+
+    for (y = top; y < bottom; y++) {
+        image_hash[y] = wscons_payload_hash(prev->image +
+          (size_t)y * info->line_bytes + x0, x1 - x0);
+    }
+    for (y = p0; y < p1; y++) {
+        prev_hash[y] = wscons_payload_hash(wscons_previous_row(prev, info,
+          y, row) + x0, x1 - x0);
+    }
+
+    best = 0;
+    for (d = 1; d <= WSCONS_MOVE_MAX_ROWS; d++) {
+        int sign;
+
+        for (sign = -1; sign <= 1; sign += 2) {
+            unsigned int run = 0;
+
+            for (y = top; y < bottom; y++) {
+                unsigned int src = sign > 0 ? y + d : y - d;
+
+                if ((sign < 0 && y < d) || src < p0 || src >= p1 ||
+                  image_hash[y] != prev_hash[src]) {
+                    run = 0;
+                    continue;
+                }
+                if (++run > best) {
+                    best = run;
+                    *band_top = y + 1U - run;
+                    *dy = sign * (int)d;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * Return whether bytes bytes of row y of the frame at column x equal those
+ * of the previous composite at column src.
+ */
+static bool
+wscons_row_shift_matches(const WsconsPreviousImage *prev,
+  const MonoGifInfo *info, uint8_t *row, unsigned int y, size_t x,
+  size_t src, size_t bytes)
+{
+    return memcmp(prev->image + (size_t)y * info->line_bytes + x,
+      wscons_previous_row(prev, info, y, row) + src, bytes) == 0;
+}
+
+/*
+ * Find the longest band of rows of the frame rectangle that repeats the
+ * previous composite shifted horizontally by whole bytes within the byte
+ * columns [x0, x1).  A shift is only followed up if the middle row of the
+ * rectangle matches.  Returns the number of bytes the band covers, with its
+ * rows, shift and destination columns.
+ */
+static size_t
+wscons_find_horizontal_move(const WsconsFrame *frame,
+  const MonoGifInfo *info, const WsconsPreviousImage *prev, uint8_t *row,
+  size_t x0, size_t x1, unsigned int *band_top, unsigned int *band_rows,
+  int *dx, size_t *band_x0, size_t *band_x1)
+{
+    size_t full_bytes, best;
+    unsigned int top, bottom, middle, d;
+
+    full_bytes = info->width / 8U;
+    top = frame->gif.update_top;
+    bottom = top + frame->gif.update_height;
+    middle = top + frame->gif.update_height / 2U;
+    best = 0;
+
+    for (d = 1; d <= WSCONS_MOVE_MAX_BYTES; d++) {
+        int sign;
+
+        for (sign = -1; sign <= 1; sign += 2) {
+            size_t a, b, src;
+            unsigned int run, y;
+
+            /* Destination columns whose source stays on the screen. */
+            a = x0;
+            b = x1;
+            if (sign > 0 && b + d > full_bytes)
+                b = full_bytes > d ? full_bytes - d : 0;
+            if (sign < 0 && a < d)
+                a = d;
+            if (a >= b || (b - a) * frame->gif.update_height <= best)
+                continue;
+
+            src = sign > 0 ? a + d : a - d;
+            if (!wscons_row_shift_matches(prev, info, row, middle, a, src,
+              b - a))
+                continue;
+            run = 0;
+            for (y = top; y < bottom; y++) {
+                if (!wscons_row_shift_matches(prev, info, row, y, a, src,
+                  b - a)) {
+                    run = 0;
+                    continue;
+                }
+                run++;
+                if ((size_t)run * (b - a) > best) {
+                    best = (size_t)run * (b - a);
+                    *band_top = y + 1U - run;
+                    *band_rows = run;
+                    *dx = sign * (int)d;
+                    *band_x0 = a;
+                    *band_x1 = b;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * Encode the rectangle of a frame as WSCONS_FRAME_MOVE_1BPP data in out:
+ * the largest band of the previous composite found shifted vertically or
+ * horizontally within it, and the spans that still differ once that band
+ * is copied.  expected receives the rectangle as the copy leaves it, rows
+ * holds two screen rows and hashes two entries per screen row.  Returns
+ * false if there is no such band or the data would not be smaller than
+ * limit, which must not exceed the size of out.
+ */
+static bool
+wscons_encode_move(uint8_t *out, size_t limit, size_t *size,
+  uint8_t *expected, uint8_t *rows, uint32_t *hashes,
+  const WsconsFrame *frame, const MonoGifInfo *info,
+  const WsconsPreviousImage *prev)
+{
+    uint8_t *row_a, *row_b;
+    size_t byte_left, bytes, x0, x1, band_x0, band_x1, h_x0, h_x1;
+    size_t spans_size;
+    unsigned int top, band_top, band_rows, h_top, h_rows, right, y;
+    int dy, dx, h_dx;
+
+    if (limit <= WSCONS_MOVE_HEADER || frame->gif.update_height < 2U)
+        return false;
+    row_a = rows;
+    row_b = rows + info->line_bytes;
+    top = frame->gif.update_top;
+    byte_left = frame->gif.update_left / 8U;
+    bytes = ((size_t)frame->gif.update_left + frame->gif.update_width +
+      7U) / 8U - byte_left;
+
+    /*
+     * The band covers the bytes that lie wholly inside the rectangle, or
+     * reach the right edge of the logical screen.
+     */
+    right = frame->gif.update_left + frame->gif.update_width;
+    x0 = ((size_t)frame->gif.update_left + 7U) / 8U;
+    x1 = right == info->width ? info->line_bytes : right / 8U;
+    if (x0 >= x1)
+        return false;
+
+    dx = 0;
+    dy = 0;
+    h_dx = 0;
+    h_top = 0;
+    h_rows = 0;
+    h_x0 = 0;
+    h_x1 = 0;
+    band_x0 = x0;
+    band_x1 = x1;
+    band_top = top;
+    band_rows = wscons_find_vertical_move(frame, info, prev, row_a, hashes,
+      x0, x1, &band_top, &dy);
+    if (band_rows < frame->gif.update_height &&
+      wscons_find_horizontal_move(frame, info, prev, row_a, x0, x1,
+      &h_top, &h_rows, &h_dx, &h_x0, &h_x1) >
+      (size_t)band_rows * (x1 - x0)) {
+        band_top = h_top;
+        band_rows = h_rows;
+        band_x0 = h_x0;
+        band_x1 = h_x1;
+        dx = h_dx;
+        dy = 0;
+    }
+    if (band_rows == 0)
+        return false;
+
+    /* Build the rectangle as the copy leaves it, checking the band. */
+    for (y = 0; y < frame->gif.update_height; y++) {
+        const uint8_t *src;
+        uint8_t *dst;
+
+        dst = expected + (size_t)y * bytes;
+        src = wscons_previous_row(prev, info, top + y, row_a);
+        memcpy(dst, src + byte_left, bytes);
+        if (top + y < band_top || top + y - band_top >= band_rows)
+            continue;
+
+        src = wscons_previous_row(prev, info,
+          (unsigned int)((int)(top + y) + dy), row_b);
+        memcpy(dst + (band_x0 - byte_left), src + (ptrdiff_t)band_x0 + dx,
+          band_x1 - band_x0);
+        if (memcmp(prev->image + (size_t)(top + y) * info->line_bytes +
+          band_x0, dst + (band_x0 - byte_left), band_x1 - band_x0) != 0)
+            return false;  /* row hash collision */
+    }
+
+    if (!wscons_encode_spans(out + WSCONS_MOVE_HEADER,
+      limit - WSCONS_MOVE_HEADER, &spans_size, frame, info, prev->image,
+      expected, bytes))
+        return false;
+
+    put_be16(out, (uint16_t)band_top);
+    put_be16(out + 2, (uint16_t)band_rows);
+    put_be16(out + 4, (uint16_t)band_x0);
+    put_be16(out + 6, (uint16_t)(band_x1 - band_x0));
+    put_be16(out + 8, (uint16_t)((int)band_top + dy));
+    put_be16(out + 10, (uint16_t)((int)band_x0 + dx));
+
+    *size = WSCONS_MOVE_HEADER + spans_size;
+    return true;
+}
+
+/*
+ * Work buffers for the encoded frame forms.  spans and xor_rle hold
+ * frame_bytes, delta holds line_bytes, tile_map holds the map of the whole
+ * tile grid and tile WSCONS_TILE_SIZE.  move and move_expected hold
+ * frame_bytes, move_rows two screen rows and move_hashes two entries per
+ * screen row.  xor_rle and delta are NULL unless compression is enabled or
+ * the pool has a memory budget, and tiles and the tile buffers unless tiled
+ * storage is.  cursor is the pool offset the frame will be stored at.
+ * blit_cost chooses between partial and full frames.
+ */
+typedef struct {
+    uint8_t *spans;
+    uint8_t *xor_rle;
+    uint8_t *delta;
+    uint8_t *move;
+    uint8_t *move_expected;
+    uint8_t *move_rows;
+    uint32_t *move_hashes;
+    WsconsTileIndex *tiles;
+    uint8_t *tile_map;
+    uint8_t *tile;
+    size_t cursor;
+    size_t xor_above;
+    const WsconsBlitCost *blit_cost;
+} WsconsEncodeBuffers;
+
+/*
+ * Shrink a frame to the part of image that differs from previous within the
+ * byte columns and rows of the GIF update rectangle.  previous uses
+ * prev_stride and starts at that rectangle; image is a full-screen bitmap.
+ * If a shifted copy of the previous frame, a tile map, the changed bytes
+ * encoded per row or a compressed XOR delta are smaller, the frame takes
+ * that format and its data is left in the corresponding buffer, with new
+ * tiles staged in the dictionary.  A XOR delta, which is slower to draw, is
+ * only tried when the frame would otherwise take more than xor_above bytes.
+ * A full frame is only chosen over a smaller rectangle for drawing speed
+ * when the frame was laid out full, as the pool has no more room for it,
+ * and the other formats must still beat that rectangle.
+ */
+static void
+wscons_frame_trim(WsconsFrame *frame, const MonoGifInfo *info,
+  const uint8_t *image, const uint8_t *previous, size_t prev_stride,
+  const WsconsEncodeBuffers *buffers)
+{
+    WsconsPreviousImage prev;
+    size_t encoded_size, limit;
+    unsigned int gif_left, gif_right;
+    unsigned int top, bottom, left, right;
+    size_t byte_left, bytes, x0, x1;
+
+    gif_left = frame->gif.update_left;
+    gif_right = gif_left + frame->gif.update_width;
+    if (frame->gif.update_width == 0 || frame->gif.update_height == 0) {
+        wscons_frame_set_rect(frame, info, NULL, 0, 0, 0, 0);
+        return;
+    }
+
+    byte_left = gif_left / 8U;
+    bytes = ((size_t)gif_right + 7U) / 8U - byte_left;
+    prev.image = image;
+    prev.previous = previous;
+    prev.prev_stride = prev_stride;
+    prev.top = frame->gif.update_top;
+    prev.rows = frame->gif.update_height;
+    prev.byte_left = byte_left;
+    prev.bytes = bytes;
+    if (!wscons_diff_bounds(image +
+      (size_t)frame->gif.update_top * info->line_bytes + byte_left,
+      info->line_bytes, previous, prev_stride, bytes,
+      frame->gif.update_height, &top, &bottom, &x0, &x1)) {
+        wscons_frame_set_rect(frame, info, NULL, 0, 0, 0, 0);
+        return;
+    }
+
+    left = (unsigned int)((byte_left + x0) * 8U);
+    right = (unsigned int)((byte_left + x1) * 8U);
+    if (left < gif_left)
+        left = gif_left;
+    if (right > gif_right)
+        right = gif_right;
+    wscons_frame_set_rect(frame, info,
+      frame->data_size >= info->frame_bytes ? buffers->blit_cost : NULL,
+      left, frame->gif.update_top + top, right - left, bottom - top);
+    limit = ((size_t)(left & 7U) + (right - left) + 7U) / 8U *
+      (bottom - top);
+    if (limit > frame->data_size)
+        limit = frame->data_size;
+
+    previous += (size_t)top * prev_stride + x0;
+
+    /* Scrolling and panning frames are mostly the previous frame moved. */
+    if (buffers->move != NULL && limit >= WSCONS_MOVE_MIN_SIZE &&
+      wscons_encode_move(buffers->move, limit, &encoded_size,
+      buffers->move_expected, buffers->move_rows, buffers->move_hashes,
+      frame, info, &prev)) {
+        frame->data_size = encoded_size;
+        frame->line_bytes = 0;
+        frame->format = WSCONS_FRAME_MOVE_1BPP;
+        limit = encoded_size;
+    }
+
+    /*
+     * In tiled mode a frame uses tiles whenever they beat the rectangle, so
+     * that its tiles can be shared by later frames.
+     */
+    if (frame->format != WSCONS_FRAME_MOVE_1BPP && buffers->tiles != NULL &&
+      wscons_tiles_encode(buffers->tiles, buffers->tile_map, buffers->tile,
+      limit, &encoded_size, &frame->line_bytes, buffers->cursor,
+      frame, info, image, previous, prev_stride)) {
+        frame->data_size = encoded_size;
+        frame->format = WSCONS_FRAME_TILES_1BPP;
+        return;
+    }
+
+    if (wscons_encode_spans(buffers->spans, limit,
+      &encoded_size, frame, info, image, previous, prev_stride)) {
+        frame->data_size = encoded_size;
+        frame->line_bytes = 0;
+        frame->format = WSCONS_FRAME_SPANS_1BPP;
+        limit = encoded_size;
+    }
+    if (buffers->xor_rle != NULL && limit > buffers->xor_above &&
+      wscons_encode_xor_rle(buffers->xor_rle, limit,
+      &encoded_size, buffers->delta, frame, info, image, previous,
+      prev_stride)) {
+        frame->data_size = encoded_size;
+        frame->line_bytes = ((size_t)(left & 7U) + (right - left) + 7U) / 8U;
+        frame->format = WSCONS_FRAME_XOR_RLE_1BPP;
+    }
+}
+
+/*
+ * Store the composited full-screen image of a frame at data_offset.  image
+ * may itself be the pool slot at data_offset, so rows are moved rather than
+ * copied; a partial frame never moves data forward.  For span, XOR delta,
+ * tile and move frames, image is the encoded data instead.
+ */
+static int
+wscons_store_frame(WsconsAnimation *animation, WsconsFrame *frame,
+  const uint8_t *image)
+{
+    uint8_t *data;
+
+    data = wscons_frame_data(animation, frame);
+    if (data == NULL)
+        return -1;
+
+    /* Encoded data can only be checked once it is in place. */
+    if (frame->format == WSCONS_FRAME_SPANS_1BPP ||
+      frame->format == WSCONS_FRAME_XOR_RLE_1BPP ||
+      frame->format == WSCONS_FRAME_TILES_1BPP ||
+      frame->format == WSCONS_FRAME_MOVE_1BPP) {
+        memcpy(data, image, frame->data_size);
+        return wscons_frame_validate(animation, frame);
+    }
+
+    if (wscons_frame_validate(animation, frame) == -1)
+        return -1;
+
+    if (frame->format == WSCONS_FRAME_FULL_1BPP) {
+        if (data != image)
+            memcpy(data, image, frame->data_size);
+        return 0;
+    }
+
+    if (frame->format == WSCONS_FRAME_PARTIAL_1BPP) {
+        size_t src_byte;
+        unsigned int y;
+
+        src_byte = frame->gif.update_left / 8U;
+        for (y = 0; y < frame->gif.update_height; y++) {
+            const uint8_t *src;
+            uint8_t *dst;
+
+            src = image +
+              (size_t)(frame->gif.update_top + y) *
+              animation->info.line_bytes + src_byte;
+            dst = data + (size_t)y * frame->line_bytes;
+            if (frame->line_bytes != 0)
+                memmove(dst, src, frame->line_bytes);
+        }
+        return 0;
+    }
+
+    errno = ENOTSUP;
+    return -1;
+}
+
+/*
+ * Release the unused tail of the pool reserved by wscons_animation_allocate()
+ * once the frames have been packed.
+ */
+static void
+wscons_animation_trim_pool(WsconsAnimation *animation, size_t used)
+{
+    long page_size;
+    size_t keep;
+
+    animation->bitmap_pool_size = used;
+    page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0)
+        return;
+    keep = (used + (size_t)page_size - 1U) / (size_t)page_size *
+      (size_t)page_size;
+    if (keep < animation->pool_map_size &&
+      munmap(animation->pool_map_base + keep,
+      animation->pool_map_size - keep) == 0) {
+        animation->pool_map_size = keep;
+        if (animation->pool_fd != -1)
+            (void)ftruncate(animation->pool_fd, (off_t)keep);
+    }
+}
+
+/*
+ * Lay out in frame the change from last, the final composite, back to
+ * first, the composite of the first frame, leaving its data in buffers.
+ * Tiles are not used, so the dictionary is left as the frames built it.
+ */
+static void
+wscons_loop_frame_trim(const WsconsAnimation *animation, WsconsFrame *frame,
+  const uint8_t *first, const uint8_t *last,
+  const WsconsEncodeBuffers *buffers, size_t cursor)
+{
+    const MonoGifInfo *info = &animation->info;
+    WsconsEncodeBuffers loop_buffers;
+
+    *frame = animation->frames[0];
+    frame->gif.update_left = 0;
+    frame->gif.update_top = 0;
+    frame->gif.update_width = (uint16_t)info->width;
+    frame->gif.update_height = (uint16_t)info->height;
+    loop_buffers = *buffers;
+    loop_buffers.tiles = NULL;
+    loop_buffers.cursor = cursor;
+    wscons_frame_trim(frame, info, first, last, info->line_bytes,
+      &loop_buffers);
+}
+
+/*
+ * Encode the loop frame laid out by wscons_loop_frame_trim() and store it
+ * at *cursor.  It is dropped if it would not be smaller than a full frame
+ * or would not fit in the memory budget even as a XOR delta, which is
+ * tried whenever it is larger than the room left in the budget.
+ */
+static int
+wscons_encode_loop_frame(WsconsAnimation *animation, const uint8_t *first,
+  const uint8_t *last, const WsconsEncodeBuffers *buffers, size_t *cursor)
+{
+    const MonoGifInfo *info = &animation->info;
+    WsconsFrame *frame;
+    const uint8_t *data;
+
+    frame = &animation->frames[info->frame_count];
+    wscons_loop_frame_trim(animation, frame, first, last, buffers, *cursor);
+    if (frame->format == WSCONS_FRAME_FULL_1BPP)
+        return 0;
+    /* The loop frame only saves drawing time, so it gives way to a budget. */
+    if (animation->options.memory_budget != 0 &&
+      frame->data_size > animation->options.memory_budget - *cursor) {
+        animation->loop_dropped = true;
+        return 0;
+    }
+
+    if (frame->format == WSCONS_FRAME_SPANS_1BPP)
+        data = buffers->spans;
+    else if (frame->format == WSCONS_FRAME_XOR_RLE_1BPP)
+        data = buffers->xor_rle;
+    else if (frame->format == WSCONS_FRAME_MOVE_1BPP)
+        data = buffers->move;
+    else
+        data = first;
+    frame->data_offset = *cursor;
+    if (wscons_store_frame(animation, frame, data) == -1)
+        return -1;
+    *cursor += frame->data_size;
+    animation->loop_frame = frame;
+    return 0;
+}
+
+/*
+ * Index of the frame payloads stored so far, chained by content hash, so
+ * that a frame whose stored data repeats an earlier one can share it.
+ */
+typedef struct {
+    uint32_t *hashes;
+    int *next;
+    int *buckets;
+    uint32_t bucket_mask;
+} WsconsPayloadIndex;
+
+static void
+wscons_payload_index_free(WsconsPayloadIndex *index)
+{
+    free(index->hashes);
+    free(index->next);
+    free(index->buckets);
+    memset(index, 0, sizeof(*index));
+}
+
+static int
+wscons_payload_index_init(WsconsPayloadIndex *index, int frame_count)
+{
+    uint32_t buckets, i;
+
+    memset(index, 0, sizeof(*index));
+    for (buckets = 16; buckets < (uint32_t)frame_count &&
+      buckets < 0x10000U; buckets <<= 1)
+        continue;
+    index->hashes = calloc((size_t)frame_count, sizeof(*index->hashes));
+    index->next = calloc((size_t)frame_count, sizeof(*index->next));
+    index->buckets = calloc(buckets, sizeof(*index->buckets));
+    if (index->hashes == NULL || index->next == NULL ||
+      index->buckets == NULL) {
+        wscons_payload_index_free(index);
+        return -1;
+    }
+    for (i = 0; i < buckets; i++)
+        index->buckets[i] = -1;
+    index->bucket_mask = buckets - 1U;
+    return 0;
+}
+
+/*
+ * Look for an earlier frame with the same format, geometry and stored bytes
+ * as frame_number, whose data is at the pool cursor.  If there is none,
+ * index the frame and return -1.
+ */
+static int
+wscons_payload_dedup(WsconsPayloadIndex *index,
+  const WsconsAnimation *animation, int frame_number)
+{
+    const WsconsFrame *frame, *other;
+    const uint8_t *data;
+    uint32_t hash, bucket;
+    int i;
+
+    frame = &animation->frames[frame_number];
+    data = animation->bitmap_pool + frame->data_offset;
+    hash = wscons_payload_hash(data, frame->data_size);
+    bucket = hash & index->bucket_mask;
+
+    for (i = index->buckets[bucket]; i != -1; i = index->next[i]) {
+        other = &animation->frames[i];
+        if (index->hashes[i] == hash &&
+          other->format == frame->format &&
+          other->data_size == frame->data_size &&
+          other->line_bytes == frame->line_bytes &&
+          other->gif.update_left == frame->gif.update_left &&
+          other->gif.update_top == frame->gif.update_top &&
+          other->gif.update_width == frame->gif.update_width &&
+          other->gif.update_height == frame->gif.update_height &&
+          memcmp(animation->bitmap_pool + other->data_offset, data,
+          frame->data_size) == 0)
+            return i;
+    }
+
+    index->hashes[frame_number] = hash;
+    index->next[frame_number] = index->buckets[bucket];
+    index->buckets[bucket] = frame_number;
+    return -1;
+}
+
+/*
+ * Return how large a frame may be stored without compression so that the
+ * frames after it still fit in budget.  reserved and rest are the GIF
+ * rectangle sizes of this frame and the frames after it; the later frames
+ * are expected to shrink as much as the done bytes of earlier delta frames
+ * shrank to stored bytes, or, before there are any, to share what is left
+ * in proportion to their rectangles.
+ */
+static size_t
+wscons_budget_allowance(size_t budget, size_t cursor, size_t done,
+  size_t stored, size_t reserved, size_t rest)
+{
+    uint64_t left, expected;
+
+    if (cursor >= budget)
+        return 0;
+    left = budget - cursor;
+    if (done == 0)
+        return (size_t)(left * reserved / ((uint64_t)reserved + rest + 1U));
+    expected = (uint64_t)rest * stored / done;
+    return expected < left ? (size_t)(left - expected) : 0;
+}
+
+/*
+ * Report how the frames were stored, for the memory budget.
+ */
+static void
+wscons_print_plan(const WsconsAnimation *animation)
+{
+    int counts[WSCONS_FRAME_MOVE_1BPP + 1];
+    int i;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < animation->info.frame_count; i++)
+        counts[animation->frames[i].format]++;
+    fprintf(stderr, "Storage plan: %d full, %d partial, %d span, "
+      "%d XOR (%d for the budget), %d tile, %d move, %d shared\n",
+      counts[WSCONS_FRAME_FULL_1BPP], counts[WSCONS_FRAME_PARTIAL_1BPP],
+      counts[WSCONS_FRAME_SPANS_1BPP], counts[WSCONS_FRAME_XOR_RLE_1BPP],
+      animation->budget_frames, counts[WSCONS_FRAME_TILES_1BPP],
+      counts[WSCONS_FRAME_MOVE_1BPP], animation->dedup_frames);
+    fprintf(stderr, "Frame pool: %zu of %zu budget bytes%s\n",
+      animation->bitmap_pool_size, animation->options.memory_budget,
+      animation->loop_frame != NULL ? ", loop frame kept" :
+      animation->loop_dropped ? ", loop frame dropped for the budget" : "");
+}
+
+/*
+ * Fold frames that turned out to change nothing into the frame before
+ * them, which stays on the screen for their delay as well.
+ */
+static void
+wscons_merge_unchanged(WsconsAnimation *animation)
+{
+    int count, i;
+
+    count = 1;
+    for (i = 1; i < animation->info.frame_count; i++) {
+        const WsconsFrame *frame = &animation->frames[i];
+
+        if (frame->data_size == 0) {
+            animation->frames[count - 1].gif.delay += frame->gif.delay;
+            continue;
+        }
+        animation->frames[count++] = *frame;
+    }
+    animation->info.frame_count = count;
+}
+
+/*
+ * GIF frames rendered ahead by mono_gif_render_frames() when
+ * options->threads is above 1 and the GIF is indexed.  They are taken in
+ * order in place of decoding, and each is freed once taken.
+ */
+typedef struct {
+    uint8_t **bitmaps;
+    MonoGifFrameInfo *infos;
+    int count;
+    int next;
+} WsconsRendered;
+
+static void
+wscons_rendered_free(WsconsRendered *rendered)
+{
+    int i;
+
+    if (rendered->bitmaps != NULL) {
+        for (i = 0; i < rendered->count; i++)
+            free(rendered->bitmaps[i]);
+    }
+    free(rendered->bitmaps);
+    free(rendered->infos);
+    memset(rendered, 0, sizeof(*rendered));
+}
+
+static int
+wscons_rendered_init(WsconsRendered *rendered, GifFileType *gif,
+  const MonoGifInfo *source_info, const WsconsLoadOptions *options)
+{
+#ifdef THREADED_RENDER
+    uint32_t start_time;
+    int i, saved_errno;
+
+    memset(rendered, 0, sizeof(*rendered));
+    if (options->threads <= 1 || options->gif_index == NULL)
+        return 0;
+    if (options->progress) {
+        fprintf(stderr, "Rendering %d frames on %d threads...",
+          source_info->frame_count, options->threads);
+    }
+    start_time = options->duration ? options->gettime_ms() : 0;
+    rendered->count = source_info->frame_count;
+    rendered->bitmaps = calloc((size_t)rendered->count,
+      sizeof(*rendered->bitmaps));
+    rendered->infos = calloc((size_t)rendered->count,
+      sizeof(*rendered->infos));
+    if (rendered->bitmaps == NULL || rendered->infos == NULL)
+        goto fail;
+    for (i = 0; i < rendered->count; i++) {
+        rendered->bitmaps[i] = malloc(source_info->frame_bytes);
+        if (rendered->bitmaps[i] == NULL)
+            goto fail;
+    }
+    if (mono_gif_render_frames(options->gif_index, source_info,
+      rendered->bitmaps, rendered->infos, options->threads) == -1) {
+        if (errno == 0)
+            gif->Error = options->gif_index->error;
+        goto fail;
+    }
+    if (options->progress) {
+        if (options->duration)
+            fprintf(stderr, " completed in %u ms.\n",
+              options->gettime_ms() - start_time);
+        else
+            fprintf(stderr, " completed.\n");
+    }
+    return 0;
+
+fail:
+    saved_errno = errno;
+    if (options->progress)
+        fprintf(stderr, "\n");
+    wscons_rendered_free(rendered);
+    errno = saved_errno;
+    return -1;
+#else
+    (void)gif;
+    (void)source_info;
+    (void)options;
+    memset(rendered, 0, sizeof(*rendered));
+    return 0;
+#endif
+}
+
+/* Like mono_gif_decode_frame(), but taking frames rendered ahead if any. */
+static int
+wscons_decode_source(GifFileType *gif, const MonoGifInfo *source_info,
+  WsconsRendered *rendered, uint8_t *image, const uint8_t *previous,
+  MonoGifFrameInfo *frame_info, int *frame)
+{
+    if (rendered->bitmaps == NULL)
+        return mono_gif_decode_frame(gif, source_info, image, previous,
+          frame_info, frame);
+    if (rendered->next >= rendered->count) {
+        *frame = -1;
+        return 0;
+    }
+    *frame = rendered->next++;
+    memcpy(image, rendered->bitmaps[*frame], source_info->frame_bytes);
+    *frame_info = rendered->infos[*frame];
+    free(rendered->bitmaps[*frame]);
+    rendered->bitmaps[*frame] = NULL;
+    return 0;
+}
+
+/*
+ * Decode the GIF record by record, composite each frame and append it to
+ * the wscons-specific mmap pool.
+ *
+ * The GIF update rectangle is only an upper bound: each composited frame is
+ * compared with its predecessor and stored as the byte-aligned rectangle
+ * that really changed, as the changed byte spans of each row, as the
+ * compressed XOR delta of that rectangle if options->compress is set, as a
+ * map of tiles shared through a dictionary if options->tiles is set, or as
+ * a full frame, whichever is smallest.
+ *
+ * A frame whose GIF rectangle covers the screen is rendered straight into
+ * the next pool position, with the previous composite as the base for
+ * transparent pixels.  If it is kept full, that slot becomes the composite
+ * for the next frame.  Other frames are composited in place in a
+ * full-screen work canvas after saving the bytes under their GIF rectangle
+ * for the comparison.
+ *
+ * A stored frame whose geometry and bytes repeat an earlier frame, as in
+ * walk cycles or blinks, shares that frame's pool region instead.
+ *
+ * With options->threads above 1 and options->gif_index, every GIF frame is
+ * decoded and rendered up front on that many threads, holding all of them
+ * in memory, and only the packing is left to run in order.
+ *
+ * With options->coalesce_ms, each stored frame is the composite of the run
+ * of GIF frames planned by wscons_animation_allocate(), described by the
+ * union of their rectangles and the sum of their delays.
+ *
+ * gif must be a freshly opened handle for the file scanned by
+ * mono_gif_scan_frames() for wscons_animation_allocate().  On a GIFLIB
+ * failure, gif->Error is set and errno is 0.
+ */
+int
+wscons_extract_mono_frames(GifFileType *gif, WsconsAnimation *animation)
+{
+    const WsconsLoadOptions *options;
+    const MonoGifInfo *info;
+    const uint8_t *state;
+    MonoGifInfo source_info;
+    WsconsEncodeBuffers buffers;
+    WsconsPayloadIndex index;
+    WsconsRendered ahead;
+    uint8_t *canvas, *scratch, *first;
+    size_t cursor, scratch_size, key_bytes;
+    size_t reserved_total, reserved_done, delta_reserved, delta_stored;
+    int gif_frame, key_frame, source;
+    int rv;
+    int i;
+
+    options = &animation->options;
+    info = &animation->info;
+    /* GIF frames are numbered separately when some are merged. */
+    source_info = *info;
+    if (animation->source_last != NULL)
+        source_info.frame_count =
+          animation->source_last[info->frame_count - 1] + 1;
+    scratch_size = 0;
+    reserved_total = 0;
+    for (i = 0; i < info->frame_count; i++) {
+        const WsconsFrame *frame = &animation->frames[i];
+
+        if (i > 0 && frame->format == WSCONS_FRAME_PARTIAL_1BPP &&
+          frame->data_size > scratch_size)
+            scratch_size = frame->data_size;
+        reserved_total += frame->data_size;
+    }
+    canvas = NULL;
+    first = NULL;
+    memset(&buffers, 0, sizeof(buffers));
+    if (wscons_rendered_init(&ahead, gif, &source_info, options) == -1)
+        return -1;
+    scratch = malloc(scratch_size != 0 ? scratch_size : 1U);
+    if (scratch == NULL) {
+        wscons_rendered_free(&ahead);
+        return -1;
+    }
+    rv = -1;
+    if (wscons_payload_index_init(&index, info->frame_count) == -1) {
+        free(scratch);
+        wscons_rendered_free(&ahead);
+        return -1;
+    }
+    if (info->frame_count > 1) {
+        buffers.spans = malloc(info->frame_bytes);
+        buffers.move = malloc(info->frame_bytes);
+        buffers.move_expected = malloc(info->frame_bytes);
+        buffers.move_rows = malloc(info->line_bytes * 2U);
+        buffers.move_hashes = calloc(info->height * 2U, sizeof(uint32_t));
+        if (buffers.spans == NULL || buffers.move == NULL ||
+          buffers.move_expected == NULL || buffers.move_rows == NULL ||
+          buffers.move_hashes == NULL)
+            goto fail;
+        if (options->compress || options->memory_budget != 0) {
+            buffers.xor_rle = malloc(info->frame_bytes);
+            buffers.delta = malloc(info->line_bytes);
+            if (buffers.xor_rle == NULL || buffers.delta == NULL)
+                goto fail;
+        }
+    }
+    if (options->tiles) {
+        size_t grid_tiles, stage_size;
+
+        if (wscons_tile_grid(info, &grid_tiles) == -1 ||
+          size_mul(grid_tiles, WSCONS_TILE_SIZE, &stage_size) == -1)
+            goto fail;
+        buffers.tiles = wscons_tile_index_create(animation->bitmap_pool,
+          stage_size);
+        buffers.tile_map = malloc(grid_tiles * WSCONS_TILE_ENTRY);
+        buffers.tile = malloc(WSCONS_TILE_SIZE);
+        if (buffers.tiles == NULL || buffers.tile_map == NULL ||
+          buffers.tile == NULL)
+            goto fail;
+    }
+    /* The loop frame needs the first composite, which tiles replace. */
+    if (info->frame_count > 1 && options->tiles) {
+        first = malloc(info->frame_bytes);
+        if (first == NULL)
+            goto fail;
+    }
+
+    /* state is the latest composite: the canvas or a full pool slot. */
+    state = NULL;
+    cursor = 0;
+    key_frame = 0;
+    key_bytes = 0;
+    reserved_done = 0;
+    delta_reserved = 0;
+    delta_stored = 0;
+    source = 0;
+    for (i = 0; i < info->frame_count; i++) {
+        uint32_t frame_start_time;
+        MonoGifFrameInfo scanned;
+        GifImageDesc decoded;
+        WsconsFrame *frame;
+        const uint8_t *previous;
+        size_t reserved, stored;
+        uint8_t *image;
+        bool keyframe;
+        int last;
+
+        if (options->progress) {
+            fprintf(stderr, "Preparing bitmap for frame %d/%d...",
+              i + 1, info->frame_count);
+        }
+
+        frame_start_time = options->duration ? options->gettime_ms() : 0;
+        frame = &animation->frames[i];
+        reserved = frame->data_size;
+
+        if (frame->format == WSCONS_FRAME_FULL_1BPP) {
+            image = animation->bitmap_pool + cursor;
+        } else {
+            size_t byte_left;
+            unsigned int y;
+
+            if (canvas == NULL) {
+                canvas = malloc(info->frame_bytes);
+                if (canvas == NULL)
+                    goto fail;
+            }
+            if (state != canvas)
+                memcpy(canvas, state, info->frame_bytes);
+
+            byte_left = frame->gif.update_left / 8U;
+            for (y = 0; y < frame->gif.update_height; y++) {
+                memcpy(scratch + (size_t)y * frame->line_bytes,
+                  canvas + (size_t)(frame->gif.update_top + y) *
+                  info->line_bytes + byte_left, frame->line_bytes);
+            }
+            image = canvas;
+        }
+
+        /* Merged GIF frames are composited in turn into one image. */
+        scanned = frame->gif;
+        last = animation->source_last != NULL ?
+          animation->source_last[i] : i;
+        memset(&decoded, 0, sizeof(decoded));
+        frame->gif.delay = 0;
+        for (previous = state; source <= last; source++) {
+            MonoGifFrameInfo rendered;
+            GifImageDesc desc;
+
+            if (wscons_decode_source(gif, &source_info, &ahead, image,
+              previous, &rendered, &gif_frame) == -1)
+                goto fail;
+            if (gif_frame != source) {
+                errno = EINVAL;
+                goto fail;
+            }
+            memset(&desc, 0, sizeof(desc));
+            desc.Left = rendered.update_left;
+            desc.Top = rendered.update_top;
+            desc.Width = rendered.update_width;
+            desc.Height = rendered.update_height;
+            wscons_desc_union(&decoded, &desc);
+            frame->gif.delay += rendered.delay;
+            previous = image;
+        }
+        if (decoded.Left != scanned.update_left ||
+          decoded.Top != scanned.update_top ||
+          decoded.Width != scanned.update_width ||
+          decoded.Height != scanned.update_height) {
+            /* The file no longer matches the scanned frame layout. */
+            errno = EINVAL;
+            goto fail;
+        }
+
+        buffers.cursor = cursor;
+        buffers.blit_cost = &options->blit_cost;
+        if (!options->compress && options->memory_budget != 0) {
+            size_t budget;
+
+            /*
+             * The last frame also leaves room for the loop frame after it,
+             * which is laid out here once to learn its size.
+             */
+            budget = options->memory_budget;
+            if (i > 0 && i == info->frame_count - 1) {
+                WsconsFrame loop;
+
+                wscons_loop_frame_trim(animation, &loop,
+                  first != NULL ? first : animation->bitmap_pool, image,
+                  &buffers, cursor);
+                if (loop.format != WSCONS_FRAME_FULL_1BPP &&
+                  cursor < budget && loop.data_size < budget - cursor)
+                    budget -= loop.data_size;
+            }
+            buffers.xor_above = wscons_budget_allowance(budget, cursor,
+              delta_reserved, delta_stored, reserved,
+              reserved_total - reserved_done - reserved);
+        }
+        keyframe = i > 0 && ((options->keyframe_interval > 0 &&
+          i - key_frame >= options->keyframe_interval) ||
+          (options->keyframe_bytes != 0 &&
+          key_bytes >= options->keyframe_bytes));
+        if (i == 0 || keyframe) {
+            size_t map_size;
+
+            /*
+             * A tiled animation starts with a complete tile map, which
+             * seeds the dictionary.  The pool reserves room for it, and
+             * later keyframes use a map only when it beats a full frame.
+             */
+            wscons_frame_set_rect(frame, info, NULL, 0, 0,
+              info->width, info->height);
+            if (buffers.tiles != NULL &&
+              wscons_tiles_encode(buffers.tiles, buffers.tile_map,
+              buffers.tile, i == 0 ? SIZE_MAX : info->frame_bytes,
+              &map_size, &frame->line_bytes, cursor, frame, info, image,
+              NULL, 0)) {
+                frame->data_size = map_size;
+                frame->format = WSCONS_FRAME_TILES_1BPP;
+            }
+            if (i == 0 && first != NULL)
+                memcpy(first, image, info->frame_bytes);
+            if (keyframe)
+                animation->key_frames++;
+        } else if (image == canvas) {
+            wscons_frame_trim(frame, info, image, scratch,
+              frame->line_bytes, &buffers);
+        } else {
+            wscons_frame_trim(frame, info, image, state +
+              (size_t)frame->gif.update_top * info->line_bytes +
+              frame->gif.update_left / 8U, info->line_bytes, &buffers);
+        }
+        frame->data_offset = cursor;
+        if (frame->format == WSCONS_FRAME_XOR_RLE_1BPP && !options->compress)
+            animation->budget_frames++;
+
+        if (image != canvas && frame->format != WSCONS_FRAME_FULL_1BPP) {
+            /*
+             * The full composite in the pool is about to be packed down to
+             * the changed region; keep it in the canvas for the next frame.
+             */
+            if (canvas == NULL) {
+                canvas = malloc(info->frame_bytes);
+                if (canvas == NULL)
+                    goto fail;
+            }
+            if (state == canvas) {
+                size_t bytes;
+                unsigned int y;
+
+                bytes = ((size_t)(frame->gif.update_left & 7U) +
+                  frame->gif.update_width + 7U) / 8U;
+                for (y = 0; y < frame->gif.update_height; y++) {
+                    size_t offset;
+
+                    offset = (size_t)(frame->gif.update_top + y) *
+                      info->line_bytes + frame->gif.update_left / 8U;
+                    memcpy(canvas + offset, image + offset, bytes);
+                }
+            } else {
+                memcpy(canvas, image, info->frame_bytes);
+            }
+            state = canvas;
+        } else {
+            state = image;
+        }
+
+        stored = 0;
+        if (frame->format == WSCONS_FRAME_SPANS_1BPP) {
+            image = buffers.spans;
+        } else if (frame->format == WSCONS_FRAME_XOR_RLE_1BPP) {
+            image = buffers.xor_rle;
+        } else if (frame->format == WSCONS_FRAME_MOVE_1BPP) {
+            image = buffers.move;
+            animation->move_frames++;
+        } else if (frame->format == WSCONS_FRAME_TILES_1BPP) {
+            /* New tiles go to the pool ahead of the map. */
+            stored = buffers.tiles->stage_size;
+            animation->tile_count += (int)(stored / WSCONS_TILE_SIZE);
+            wscons_tile_index_commit(buffers.tiles, animation->bitmap_pool);
+            cursor += stored;
+            frame->data_offset = cursor;
+            image = buffers.tile_map;
+        }
+        if (wscons_store_frame(animation, frame, image) == -1)
+            goto fail;
+        stored += frame->data_size;
+        if (frame->data_size != 0) {
+            int match;
+
+            match = wscons_payload_dedup(&index, animation, i);
+            if (match == -1) {
+                cursor += frame->data_size;
+            } else {
+                /*
+                 * The slot at the cursor is reused by the next frame, so a
+                 * full composite left there must be read from the copy.
+                 */
+                if (state == animation->bitmap_pool + cursor)
+                    state = animation->bitmap_pool +
+                      animation->frames[match].data_offset;
+                frame->data_offset = animation->frames[match].data_offset;
+                animation->dedup_frames++;
+                animation->dedup_bytes += frame->data_size;
+            }
+        }
+        if (stored < reserved) {
+            animation->trimmed_frames++;
+            animation->trimmed_bytes += reserved - stored;
+        }
+        reserved_done += reserved;
+        if (!(i == 0 || keyframe)) {
+            delta_reserved += reserved;
+            delta_stored += stored;
+        }
+        if (options->memory_budget != 0 &&
+          cursor > options->memory_budget) {
+            errno = ENOSPC;
+            goto fail;
+        }
+        if (i == 0 || keyframe || frame->format == WSCONS_FRAME_FULL_1BPP) {
+            key_frame = i;
+            key_bytes = 0;
+        } else {
+            key_bytes += stored;
+        }
+
+        if (options->progress) {
+            if (options->duration) {
+                uint32_t frame_time;
+
+                frame_time = options->gettime_ms() - frame_start_time;
+                animation->total_frame_time += frame_time;
+                fprintf(stderr, " completed in %u ms.\n", frame_time);
+            } else {
+                fprintf(stderr, "%s",
+                  i < info->frame_count - 1 ? "\r" : "\n");
+            }
+        }
+    }
+
+    if (animation->source_last != NULL) {
+        wscons_merge_unchanged(animation);
+        animation->coalesced_frames = source_info.frame_count -
+          info->frame_count;
+    }
+    if (!options->compress && options->memory_budget != 0)
+        buffers.xor_above = options->memory_budget - cursor;
+    if (info->frame_count > 1 && wscons_encode_loop_frame(animation,
+      first != NULL ? first : animation->bitmap_pool, state, &buffers,
+      &cursor) == -1)
+        goto fail;
+
+    wscons_animation_trim_pool(animation, cursor);
+    if (options->progress && options->memory_budget != 0)
+        wscons_print_plan(animation);
+    rv = 0;
+    goto out;
+
+fail:
+    if (options->progress)
+        fprintf(stderr, "\n");
+out:
+    free(canvas);
+    free(scratch);
+    free(first);
+    free(buffers.spans);
+    free(buffers.xor_rle);
+    free(buffers.delta);
+    free(buffers.move);
+    free(buffers.move_expected);
+    free(buffers.move_rows);
+    free(buffers.move_hashes);
+    wscons_tile_index_destroy(buffers.tiles);
+    free(buffers.tile_map);
+    free(buffers.tile);
+    wscons_payload_index_free(&index);
+    wscons_rendered_free(&ahead);
+    free(animation->source_last);
+    animation->source_last = NULL;
+    return rv;
+}
+
+/*
+ * Return whether a validated frame redraws the whole logical screen: a full
+ * frame, or a tile map of the whole screen without unchanged tiles.
+ */
+static bool
+wscons_frame_complete(const WsconsAnimation *animation,
+  const WsconsFrame *frame)
+{
+    const uint8_t *p, *end;
+
+    if (frame->format == WSCONS_FRAME_FULL_1BPP)
+        return true;
+    if (frame->format != WSCONS_FRAME_TILES_1BPP ||
+      frame->gif.update_left != 0 || frame->gif.update_top != 0 ||
+      frame->gif.update_width != animation->info.width ||
+      frame->gif.update_height != animation->info.height)
+        return false;
+
+    p = animation->bitmap_pool + frame->data_offset;
+    for (end = p + frame->data_size; p != end; p += WSCONS_TILE_ENTRY) {
+        if (get_be32(p) == WSCONS_TILE_NONE)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Return the nearest frame at or before frame that redraws the whole
+ * screen.  Drawing it and the frames up to frame in order shows frame, so
+ * playback can start anywhere.  The first frame always qualifies.
+ */
+int
+wscons_animation_seek_start(const WsconsAnimation *animation, int frame)
+{
+    if (frame >= animation->info.frame_count)
+        frame = animation->info.frame_count - 1;
+    for (; frame > 0; frame--) {
+        if (wscons_frame_complete(animation, &animation->frames[frame]))
+            break;
+    }
+    return frame > 0 ? frame : 0;
+}
+
+/*
+ * Return the frame drawn at position frame of playback, on a pass after the
+ * first if looped.  Positions past the last frame continue on the next
+ * pass, which starts with the loop frame.
+ */
+static const WsconsFrame *
+wscons_playback_frame(const WsconsAnimation *animation, int frame,
+  bool looped)
+{
+    if (frame >= animation->info.frame_count) {
+        frame -= animation->info.frame_count;
+        looped = true;
+    }
+    if (frame == 0 && looped && animation->loop_frame != NULL)
+        return animation->loop_frame;
+    return &animation->frames[frame];
+}
+
+/*
+ * Give advice for the pool pages holding the data of a frame, clamped to
+ * the mapping.  Pages are rounded outward, or inward to leave alone those
+ * shared with neighbouring frames.
+ */
+static void
+wscons_frame_advise(const WsconsAnimation *animation,
+  const WsconsFrame *frame, int advice, bool inward)
+{
+    uintptr_t base, start, end;
+    long page_size;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0 || frame->data_size == 0)
+        return;
+    base = (uintptr_t)animation->pool_map_base;
+    start = (uintptr_t)(animation->bitmap_pool + frame->data_offset) - base;
+    end = start + frame->data_size;
+    if (inward) {
+        start = (start + (uintptr_t)page_size - 1U) /
+          (uintptr_t)page_size * (uintptr_t)page_size;
+        end = end / (uintptr_t)page_size * (uintptr_t)page_size;
+    } else {
+        start = start / (uintptr_t)page_size * (uintptr_t)page_size;
+        end = (end + (uintptr_t)page_size - 1U) /
+          (uintptr_t)page_size * (uintptr_t)page_size;
+    }
+    if (end > animation->pool_map_size)
+        end = animation->pool_map_size;
+    if (start >= end)
+        return;
+    (void)madvise(animation->pool_map_base + start, end - start, advice);
+}
+
+/*
+ * Start paging in the count frames drawn from position frame of playback,
+ * on a pass after the first if looped.
+ */
+void
+wscons_animation_prefetch(const WsconsAnimation *animation, int frame,
+  bool looped, int count)
+{
+    int i;
+
+    if (animation->pool_map_base == MAP_FAILED)
+        return;
+    if (count > animation->info.frame_count)
+        count = animation->info.frame_count;
+    for (i = 0; i < count; i++) {
+        wscons_frame_advise(animation,
+          wscons_playback_frame(animation, frame + i, looped),
+          MADV_WILLNEED, false);
+    }
+}
+
+/*
+ * Slide a prefetch window of ahead frames to start at position frame of
+ * playback, which is drawn next: page in the frame that enters it and mark
+ * the pages of the frame drawn last as not needed soon, unless one of the
+ * window frames also uses them.  On NetBSD this only deactivates the pages,
+ * whose contents stay valid, so a frame that shares its data with a later
+ * one is paged back in when drawn.
+ */
+void
+wscons_animation_advance(const WsconsAnimation *animation, int frame,
+  bool looped, int ahead)
+{
+    const WsconsFrame *drawn;
+    int i;
+
+    if (animation->pool_map_base == MAP_FAILED || ahead <= 0)
+        return;
+    if (ahead > animation->info.frame_count)
+        ahead = animation->info.frame_count;
+    wscons_animation_prefetch(animation, frame + ahead - 1, looped, 1);
+
+    if (frame == 0 && !looped)
+        return;
+    if (frame == 0)
+        drawn = &animation->frames[animation->info.frame_count - 1];
+    else
+        drawn = wscons_playback_frame(animation, frame - 1, looped);
+    for (i = 0; i < ahead; i++) {
+        const WsconsFrame *next;
+
+        next = wscons_playback_frame(animation, frame + i, looped);
+        if (next->data_offset < drawn->data_offset + drawn->data_size &&
+          drawn->data_offset < next->data_offset + next->data_size)
+            return;
+    }
+    wscons_frame_advise(animation, drawn, MADV_DONTNEED, true);
+}
+
+/*
+ * Rebuild the frame descriptors of animation from the table of the
+ * precompiled animation file open in reader.
+ */
+static int
+wscons_read_frame_table(WsconsAnimation *animation, MonoAnimReader *reader,
+  const WsconsLoadOptions *options)
+{
+    MonoGifInfo info;
+    uint32_t i;
+
+    if (reader->info.frame_count > INT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mono_gif_info_init(&info, reader->info.width, reader->info.height,
+      (int)reader->info.frame_count) == -1)
+        return -1;
+    if (info.line_bytes != reader->info.line_bytes ||
+      info.frame_bytes != reader->info.frame_bytes) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    animation->info = info;
+    animation->options = *options;
+    animation->frames = calloc((size_t)info.frame_count + 1U,
+      sizeof(*animation->frames));
+    if (animation->frames == NULL)
+        return -1;
+    if ((reader->info.flags & MONOANIM_FLAG_LOOP_FRAME) != 0)
+        animation->loop_frame = &animation->frames[info.frame_count];
+
+    for (i = 0; i < monoanim_table_entries(&reader->info); i++) {
+        WsconsFrame *frame = &animation->frames[i];
+        MonoAnimFrame entry;
+
+        if (monoanim_reader_read_frame(reader, &entry) == -1)
+            return -1;
+        frame->gif.delay = entry.delay;
+        frame->gif.update_left = entry.update_left;
+        frame->gif.update_top = entry.update_top;
+        frame->gif.update_width = entry.update_width;
+        frame->gif.update_height = entry.update_height;
+        frame->data_offset = entry.data_offset;
+        frame->data_size = entry.data_size;
+        frame->line_bytes = entry.line_bytes;
+        frame->format = entry.format;
+        frame->flags = entry.flags;
+    }
+    return 0;
+}
+
+/*
+ * Map the frame pool of a precompiled animation file read-only and rebuild
+ * the frame descriptors from its table.  No GIF decoding takes place, and
+ * the pool pages are only read from the file when a frame is first drawn.
+ */
+int
+wscons_animation_load_file(WsconsAnimation *animation, const char *path,
+  const WsconsLoadOptions *options)
+{
+    MonoAnimReader reader;
+    long page_size;
+    size_t map_skip;
+    uint32_t i;
+    int saved_errno;
+
+    if (options == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    monoanim_reader_init(&reader);
+    if (monoanim_reader_open(path, &reader) == -1)
+        return -1;
+    if (wscons_read_frame_table(animation, &reader, options) == -1)
+        goto fail;
+
+    /* The pool is MONOANIM_POOL_ALIGN aligned, but pages may be larger. */
+    page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0)
+        page_size = MONOANIM_POOL_ALIGN;
+    map_skip = reader.info.pool_offset % (size_t)page_size;
+    if (size_add(map_skip, reader.info.pool_size,
+      &animation->pool_map_size) == -1)
+        goto fail;
+
+    animation->pool_map_base = mmap(NULL, animation->pool_map_size,
+      PROT_READ, MAP_PRIVATE, reader.fd,
+      (off_t)(reader.info.pool_offset - map_skip));
+    if (animation->pool_map_base == MAP_FAILED)
+        goto fail;
+    animation->bitmap_pool = animation->pool_map_base + map_skip;
+    animation->bitmap_pool_size = reader.info.pool_size;
+    monoanim_reader_close(&reader);
+
+    for (i = 0; i < monoanim_table_entries(&reader.info); i++) {
+        if (wscons_frame_validate(animation, &animation->frames[i]) == -1)
+            return -1;
+    }
+
+    /*
+     * Playback starts from the first frame, which must be full; later
+     * passes may start from the loop frame instead.
+     */
+    if (!wscons_frame_complete(animation, &animation->frames[0])) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+
+fail:
+    saved_errno = errno;
+    monoanim_reader_close(&reader);
+    errno = saved_errno;
+    return -1;
+}
+
+void
+wscons_stream_init(WsconsStream *stream)
+{
+    memset(stream, 0, sizeof(*stream));
+    wscons_animation_init(&stream->view);
+    monoanim_reader_init(&stream->reader);
+}
+
+/*
+ * Rebuild the frame descriptors from the table of a precompiled animation
+ * file like wscons_animation_load_file(), but leave the frame pool in the
+ * file, to be read frame by frame into a ring of slots frame slots.  Each
+ * slot holds the largest frame, so memory does not grow with the
+ * animation.  Frames built from shared tiles, which may be anywhere in the
+ * pool, cannot be streamed and fail with ENOTSUP.
+ */
+int
+wscons_stream_open(WsconsStream *stream, WsconsAnimation *animation,
+  const char *path, const WsconsLoadOptions *options, int slots)
+{
+    size_t slot_size, ring_size;
+    uint32_t i;
+    int saved_errno;
+
+    if (options == NULL || slots <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (monoanim_reader_open(path, &stream->reader) == -1)
+        return -1;
+    if (wscons_read_frame_table(animation, &stream->reader, options) == -1)
+        goto fail;
+
+    slot_size = 1;
+    for (i = 0; i < monoanim_table_entries(&stream->reader.info); i++) {
+        const WsconsFrame *frame = &animation->frames[i];
+
+        if (frame->format == WSCONS_FRAME_TILES_1BPP) {
+            errno = ENOTSUP;
+            goto fail;
+        }
+        if (frame->data_offset > stream->reader.info.pool_size ||
+          frame->data_size >
+          stream->reader.info.pool_size - frame->data_offset) {
+            errno = EINVAL;
+            goto fail;
+        }
+        if (frame->data_size > slot_size)
+            slot_size = frame->data_size;
+    }
+    /* Playback starts from the first frame, which must be full. */
+    if (animation->frames[0].format != WSCONS_FRAME_FULL_1BPP) {
+        errno = EINVAL;
+        goto fail;
+    }
+    animation->bitmap_pool_size = stream->reader.info.pool_size;
+
+    if (size_mul(slot_size, (size_t)slots, &ring_size) == -1)
+        goto fail;
+    stream->view.info = animation->info;
+    stream->view.options = animation->options;
+    stream->view.frames = calloc((size_t)slots, sizeof(*stream->view.frames));
+    stream->view.bitmap_pool = malloc(ring_size);
+    if (stream->view.frames == NULL || stream->view.bitmap_pool == NULL)
+        goto fail;
+    stream->view.bitmap_pool_size = ring_size;
+    stream->animation = animation;
+    stream->slot_size = slot_size;
+    stream->slots = slots;
+    wscons_stream_seek(stream, 0, false);
+    return 0;
+
+fail:
+    saved_errno = errno;
+    wscons_stream_close(stream);
+    errno = saved_errno;
+    return -1;
+}
+
+/*
+ * Drop the buffered frames and continue reading from position frame of
+ * playback, on a pass after the first if looped.
+ */
+void
+wscons_stream_seek(WsconsStream *stream, int frame, bool looped)
+{
+    stream->head = 0;
+    stream->count = 0;
+    stream->held = false;
+    stream->next_frame = frame;
+    stream->next_looped = looped;
+}
+
+/*
+ * Read the next frame of playback into a free slot.  Returns 1 if a frame
+ * was read, 0 if the ring is full and -1 on error.
+ */
+int
+wscons_stream_fill(WsconsStream *stream)
+{
+    const WsconsFrame *frame;
+    WsconsFrame *slot;
+    int index;
+
+    if (stream->count == stream->slots)
+        return 0;
+    index = (stream->head + stream->count) % stream->slots;
+    frame = wscons_playback_frame(stream->animation, stream->next_frame,
+      stream->next_looped);
+    if (monoanim_reader_read_pool(&stream->reader,
+      stream->view.bitmap_pool + (size_t)index * stream->slot_size,
+      frame->data_offset, frame->data_size) == -1)
+        return -1;
+    slot = &stream->view.frames[index];
+    *slot = *frame;
+    slot->data_offset = (size_t)index * stream->slot_size;
+    stream->count++;
+    if (++stream->next_frame == stream->animation->info.frame_count) {
+        stream->next_frame = 0;
+        stream->next_looped = true;
+    }
+    return 1;
+}
+
+/*
+ * Return the next frame of playback, described within view, reading it
+ * now if it was not read ahead.  It stays valid until the next call.
+ * Returns NULL on error.
+ */
+const WsconsFrame *
+wscons_stream_next(WsconsStream *stream)
+{
+    if (stream->held) {
+        stream->head = (stream->head + 1) % stream->slots;
+        stream->count--;
+        stream->held = false;
+    }
+    if (stream->count == 0) {
+        if (wscons_stream_fill(stream) == -1)
+            return NULL;
+        stream->waited_frames++;
+    } else {
+        stream->ahead_frames++;
+    }
+    stream->held = true;
+    return &stream->view.frames[stream->head];
+}
+
+/* Close the file and free the ring; the counters are kept. */
+void
+wscons_stream_close(WsconsStream *stream)
+{
+    monoanim_reader_close(&stream->reader);
+    free(stream->view.frames);
+    stream->view.frames = NULL;
+    if (stream->view.bitmap_pool != MAP_FAILED)
+        free(stream->view.bitmap_pool);
+    stream->view.bitmap_pool = MAP_FAILED;
+    stream->view.bitmap_pool_size = 0;
+    stream->animation = NULL;
+    stream->slots = 0;
+    stream->count = 0;
+    stream->held = false;
+}
+
+int
+wscons_animation_write_file(const WsconsAnimation *animation,
+  const char *path)
+{
+    MonoAnimInfo info;
+    MonoAnimFrame *entries;
+    int saved_errno;
+    int rv;
+    uint32_t i;
+
+    if (animation->bitmap_pool == MAP_FAILED ||
+      animation->info.frame_count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (animation->bitmap_pool_size > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    if (monoanim_info_init(&info, animation->info.width,
+      animation->info.height, (uint32_t)animation->info.frame_count,
+      animation->loop_frame != NULL ? MONOANIM_FLAG_LOOP_FRAME : 0,
+      (uint32_t)animation->bitmap_pool_size) == -1)
+        return -1;
+
+    entries = calloc(monoanim_table_entries(&info), sizeof(*entries));
+    if (entries == NULL)
+        return -1;
+
+    /* The loop frame, if any, directly follows the frames. */
+    for (i = 0; i < monoanim_table_entries(&info); i++) {
+        const WsconsFrame *frame = &animation->frames[i];
+        MonoAnimFrame *entry = &entries[i];
+
+        /* Offsets and sizes are bounded by the pool size checked above. */
+        entry->delay = frame->gif.delay;
+        entry->update_left = frame->gif.update_left;
+        entry->update_top = frame->gif.update_top;
+        entry->update_width = frame->gif.update_width;
+        entry->update_height = frame->gif.update_height;
+        entry->data_offset = (uint32_t)frame->data_offset;
+        entry->data_size = (uint32_t)frame->data_size;
+        entry->line_bytes = (uint32_t)frame->line_bytes;
+        entry->format = frame->format;
+        entry->flags = frame->flags;
+    }
+
+    rv = monoanim_write_file(path, &info, entries, animation->bitmap_pool);
+    saved_errno = errno;
+    free(entries);
+    errno = saved_errno;
+    return rv;
+}
+
+/*
+ * Conversion cache.  A GIF file converted by a player is kept as an
+ * animation file in the cache directory, named after the size, modification
+ * time and contents of the GIF file, the options that change what is stored
+ * and the container version, so that later runs with the same file and
+ * options load it instead of converting again.
+ */
+#define WSCONS_CACHE_READ 16384
+
+static uint32_t
+wscons_hash_value(uint32_t hash, uint64_t value)
+{
+    uint8_t bytes[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        bytes[i] = (uint8_t)(value >> (56 - 8 * i));
+    return wscons_hash_update(hash, bytes, sizeof(bytes));
+}
+
+/* Returns the malloc()ed path for gif_path in directory, or NULL. */
+char *
+wscons_cache_path(const char *directory, const char *gif_path,
+  const WsconsLoadOptions *options)
+{
+    struct stat st;
+    uint8_t *buf;
+    char *path;
+    uint32_t content_hash, options_hash;
+    ssize_t n;
+    int fd, len, saved_errno;
+
+    buf = malloc(WSCONS_CACHE_READ);
+    if (buf == NULL)
+        return NULL;
+    fd = open(gif_path, O_RDONLY);
+    if (fd == -1)
+        goto fail;
+    if (fstat(fd, &st) == -1)
+        goto fail;
+    content_hash = WSCONS_HASH_INIT;
+    for (;;) {
+        n = read(fd, buf, WSCONS_CACHE_READ);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+        if (n == 0)
+            break;
+        content_hash = wscons_hash_update(content_hash, buf, (size_t)n);
+    }
+    (void)close(fd);
+    free(buf);
+
+    /* Progress, timing and where the pool is built do not change it. */
+    options_hash = WSCONS_HASH_INIT;
+    options_hash = wscons_hash_value(options_hash, MONOANIM_VERSION);
+    options_hash = wscons_hash_value(options_hash, options->compress);
+    options_hash = wscons_hash_value(options_hash, options->tiles);
+    options_hash = wscons_hash_value(options_hash,
+      (uint64_t)options->keyframe_interval);
+    options_hash = wscons_hash_value(options_hash, options->keyframe_bytes);
+    options_hash = wscons_hash_value(options_hash, options->coalesce_ms);
+    options_hash = wscons_hash_value(options_hash, options->memory_budget);
+    options_hash = wscons_hash_value(options_hash, options->blit_cost.call);
+    options_hash = wscons_hash_value(options_hash, options->blit_cost.row);
+    options_hash = wscons_hash_value(options_hash, options->blit_cost.kbyte);
+    options_hash = wscons_hash_value(options_hash, options->blit_cost.edge);
+    options_hash = wscons_hash_value(options_hash,
+      options->blit_cost.unaligned);
+
+#define WSCONS_CACHE_NAME "%s/%08lx%08lx-%jd-%jd.anim"
+    len = snprintf(NULL, 0, WSCONS_CACHE_NAME, directory,
+      (unsigned long)content_hash, (unsigned long)options_hash,
+      (intmax_t)st.st_size, (intmax_t)st.st_mtime);
+    if (len < 0)
+        return NULL;
+    path = malloc((size_t)len + 1);
+    if (path == NULL)
+        return NULL;
+    (void)snprintf(path, (size_t)len + 1, WSCONS_CACHE_NAME, directory,
+      (unsigned long)content_hash, (unsigned long)options_hash,
+      (intmax_t)st.st_size, (intmax_t)st.st_mtime);
+    return path;
+
+fail:
+    saved_errno = errno;
+    if (fd != -1)
+        (void)close(fd);
+    free(buf);
+    errno = saved_errno;
+    return NULL;
+}
+
+/*
+ * Store a converted animation under a path made by wscons_cache_path(),
+ * creating the cache directory if needed.  The file is written under a
+ * temporary name and renamed into place, so other players never see it
+ * half written.
+ */
+int
+wscons_cache_store(const WsconsAnimation *animation, const char *directory,
+  const char *path)
+{
+    char temp[PATH_MAX];
+    int len, saved_errno;
+
+    if (mkdir(directory, 0777) == -1 && errno != EEXIST)
+        return -1;
+    len = snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+    if (len < 0 || (size_t)len >= sizeof(temp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (wscons_animation_write_file(animation, temp) == -1)
+        return -1;
+    if (rename(temp, path) == -1) {
+        saved_errno = errno;
+        (void)unlink(temp);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,245 @@
+#ifndef WSCONS_ANIM_H
+#define WSCONS_ANIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gif_lib.h>
+
+#include "mono_gif.h"
+#include "monoanim_format.h"
+
+enum {
+    WSCONS_FRAME_FULL_1BPP = 0,
+    WSCONS_FRAME_PARTIAL_1BPP,
+    WSCONS_FRAME_SPANS_1BPP,
+    WSCONS_FRAME_XOR_RLE_1BPP,
+    WSCONS_FRAME_TILES_1BPP,
+    WSCONS_FRAME_MOVE_1BPP
+};
+
+/*
+ * WSCONS_FRAME_SPANS_1BPP data is a sequence of changed rows in ascending
+ * order.  Each row starts with a big-endian 16-bit screen row number and
+ * span count, followed by that many spans, each a big-endian 16-bit byte
+ * column and byte length followed by the bitmap bytes.  Rows without
+ * changes are omitted.  line_bytes is 0 for such frames.
+ */
+#define WSCONS_SPAN_ROW_HEADER 4U
+#define WSCONS_SPAN_HEADER 4U
+
+/*
+ * WSCONS_FRAME_XOR_RLE_1BPP data is the update rectangle XORed with the
+ * previous frame and run-length coded row by row, so it can only be drawn
+ * over the previous frame.  Each row is a sequence of codes that never
+ * crosses into the next row:
+ *   0x00-0x7f  code + 1 literal bytes follow
+ *   0x80-0xbf  the next byte is repeated (code & 0x3f) + 3 times
+ *   0xc0-0xff  (code & 0x3f) + 1 zero bytes, leaving the screen as is
+ * Bits past the logical screen width are always zero.  line_bytes is the
+ * byte width of the rectangle.
+ */
+#define WSCONS_RLE_LITERAL 0x00U
+#define WSCONS_RLE_REPEAT 0x80U
+#define WSCONS_RLE_SKIP 0xc0U
+#define WSCONS_RLE_REPEAT_MIN 3U
+
+/*
+ * WSCONS_FRAME_TILES_1BPP data is a map of the screen-aligned 32x32 tiles
+ * that cover the update rectangle, row by row.  Each entry is the big-endian
+ * 32-bit pool offset of a tile shared through the pool, or WSCONS_TILE_NONE
+ * for a tile that did not change.  A tile is 32 rows of 4 bytes holding the
+ * whole tile of the composited frame, zero past the logical screen.
+ * line_bytes is the size of one row of map entries.
+ */
+#define WSCONS_TILE_BYTES 4U
+#define WSCONS_TILE_ROWS 32U
+#define WSCONS_TILE_SIZE (WSCONS_TILE_BYTES * WSCONS_TILE_ROWS)
+#define WSCONS_TILE_ENTRY 4U
+#define WSCONS_TILE_NONE 0xffffffffU
+
+/*
+ * WSCONS_FRAME_MOVE_1BPP data starts with six big-endian 16-bit values: the
+ * first row, row count, first byte column and byte count of a band that is
+ * copied within the screen, and the first row and byte column it is copied
+ * from, all within the logical screen.  The band is copied as if from the
+ * previous frame, then the rest of the update rectangle is drawn from span
+ * data as in WSCONS_FRAME_SPANS_1BPP.  line_bytes is 0 for such frames.
+ */
+#define WSCONS_MOVE_HEADER 12U
+
+/*
+ * wscons-specific frame descriptor.  The first frame is a complete composited
+ * logical-screen bitmap.  Later frames may store only the byte-aligned portion
+ * covering the region that changed from the previous frame, which is recorded
+ * in gif.update_* in place of the original GIF rectangle, only the byte
+ * spans that changed in each row of that region, the compressed XOR delta
+ * of that region, a map of shared tiles covering it, or a copy of a shifted
+ * band of the previous frame plus what is left.  Addresses are
+ * described by pool offsets rather than inferred from the frame number.
+ */
+typedef struct {
+    MonoGifFrameInfo gif;
+    size_t data_offset;
+    size_t data_size;
+    size_t line_bytes;
+    uint8_t format;
+    uint8_t flags;
+    uint16_t reserved;
+} WsconsFrame;
+
+/*
+ * Estimated time to draw a rectangle of rows, in nanoseconds: call once
+ * per frame, row per row, kbyte per 1024 bytes copied, edge per row whose
+ * last byte is merged with the screen past the logical width, and unaligned
+ * per 1024 bytes in rows that start off a WSCONS_BLIT_ALIGN byte boundary
+ * of the logical screen.  Players measure these for their framebuffer.
+ */
+#define WSCONS_BLIT_ALIGN 4U
+
+typedef struct {
+    uint32_t call;
+    uint32_t row;
+    uint32_t kbyte;
+    uint32_t edge;
+    uint32_t unaligned;
+} WsconsBlitCost;
+
+/*
+ * Loader settings shared by monogifplay-wscons and gif2monoanim.  gettime_ms
+ * is only called when duration is set.  compress allows XOR delta frames,
+ * which are smaller but must read back the screen when drawn.  tiles allows
+ * frames built from a dictionary of tiles shared by all frames.  A frame
+ * that redraws the whole screen is stored once keyframe_interval frames or
+ * keyframe_bytes bytes of other frames follow the last one; 0 disables
+ * either limit.  GIF frames shown for less than coalesce_ms are merged into
+ * the frames that follow them, and frames that change nothing into the
+ * frame before them; 0 keeps every GIF frame.  memory_budget, unless 0,
+ * bounds the frame pool: frames are compressed as XOR deltas only where the
+ * budget needs it, and conversion fails with ENOSPC once it cannot fit.
+ * A changed rectangle is stored as a partial frame when it is smaller than
+ * a full frame and, unless blit_cost is all zero, not slower to draw.
+ * pool_directory, unless NULL, is where the frame pool is built in an
+ * unlinked temporary file, so that its clean pages can be dropped and read
+ * back from the file rather than written to swap.  threads, if above 1
+ * in a THREADED_RENDER build, is how many threads decode and render the
+ * GIF frames located by gif_index, all held in memory at once, before they
+ * are packed in order.
+ */
+typedef struct {
+    bool progress;
+    bool duration;
+    bool compress;
+    bool tiles;
+    int keyframe_interval;
+    size_t keyframe_bytes;
+    uint32_t coalesce_ms;
+    size_t memory_budget;
+    WsconsBlitCost blit_cost;
+    const char *pool_directory;
+    int threads;
+    MonoGifIndex *gif_index;
+    uint32_t (*gettime_ms)(void);
+} WsconsLoadOptions;
+
+/*
+ * The frame pool is either an anonymous mapping built from a GIF file or a
+ * read-only mapping of a precompiled animation file.  pool_map_* describe
+ * the whole mapping, which may start before bitmap_pool for the latter.
+ * loop_frame, if not NULL, follows the frames in the frames array and takes
+ * the screen from the last frame back to the first; players draw it instead
+ * of the first frame on every pass after the first.  source_last, while
+ * a GIF file is being converted with coalescing, holds the last GIF frame
+ * merged into each frame.  pool_fd is the file holding the pool while it is
+ * built with pool_directory, and -1 otherwise.  loop_dropped is set when
+ * the loop frame was left out to keep the pool within the memory budget.
+ */
+typedef struct {
+    MonoGifInfo info;
+    WsconsFrame *frames;
+    WsconsFrame *loop_frame;
+    uint8_t *bitmap_pool;
+    size_t bitmap_pool_size;
+    uint8_t *pool_map_base;
+    size_t pool_map_size;
+    int pool_fd;
+    WsconsLoadOptions options;
+    uint32_t total_frame_time;
+    int trimmed_frames;
+    size_t trimmed_bytes;
+    int dedup_frames;
+    size_t dedup_bytes;
+    int tile_count;
+    int move_frames;
+    int key_frames;
+    int coalesced_frames;
+    int budget_frames;
+    bool loop_dropped;
+    int *source_last;
+} WsconsAnimation;
+
+int wscons_blit_cost_parse(WsconsBlitCost *cost, const char *s);
+
+/*
+ * Playback of a precompiled animation file without mapping its frame pool.
+ * Frames are read in playback order into a ring of slots, each as large as
+ * the largest frame.  view describes the ring as a pool holding one frame
+ * per slot and is what frames returned by wscons_stream_next() are drawn
+ * with.  head is the slot of the oldest of count frames read, the first of
+ * which is held by the caller if held.  next_frame and next_looped are the
+ * playback position of the next frame to read.
+ */
+typedef struct {
+    WsconsAnimation view;
+    const WsconsAnimation *animation;
+    MonoAnimReader reader;
+    size_t slot_size;
+    int slots;
+    int head;
+    int count;
+    bool held;
+    int next_frame;
+    bool next_looped;
+    int ahead_frames;
+    int waited_frames;
+} WsconsStream;
+
+void wscons_animation_init(WsconsAnimation *animation);
+int wscons_animation_allocate(WsconsAnimation *animation,
+    const MonoGifInfo *gif_info, const GifFileType *gif,
+    const WsconsLoadOptions *options);
+int wscons_extract_mono_frames(GifFileType *gif, WsconsAnimation *animation);
+void wscons_animation_finish_loading(WsconsAnimation *animation);
+void wscons_animation_destroy(WsconsAnimation *animation);
+
+int wscons_frame_validate(const WsconsAnimation *animation,
+    const WsconsFrame *frame);
+int wscons_animation_seek_start(const WsconsAnimation *animation,
+    int frame);
+void wscons_animation_prefetch(const WsconsAnimation *animation, int frame,
+    bool looped, int count);
+void wscons_animation_advance(const WsconsAnimation *animation, int frame,
+    bool looped, int ahead);
+const uint8_t *wscons_frame_const_data(const WsconsAnimation *animation,
+    const WsconsFrame *frame);
+
+int wscons_animation_load_file(WsconsAnimation *animation, const char *path,
+    const WsconsLoadOptions *options);
+int wscons_animation_write_file(const WsconsAnimation *animation,
+    const char *path);
+
+char *wscons_cache_path(const char *directory, const char *gif_path,
+    const WsconsLoadOptions *options);
+int wscons_cache_store(const WsconsAnimation *animation,
+    const char *directory, const char *path);
+
+void wscons_stream_init(WsconsStream *stream);
+int wscons_stream_open(WsconsStream *stream, WsconsAnimation *animation,
+    const char *path, const WsconsLoadOptions *options, int slots);
+void wscons_stream_seek(WsconsStream *stream, int frame, bool looped);
+int wscons_stream_fill(WsconsStream *stream);
+const WsconsFrame *wscons_stream_next(WsconsStream *stream);
+void wscons_stream_close(WsconsStream *stream);
+
+#endif /* WSCONS_ANIM_H */